@@ -0,0 +1,126 @@
+#!/bin/bash
+# Benchmark of ow transfer modes.
+#
+# usage: bench.sh [ow]
+#
+# Environment:
+#   BENCH_SIZES   file sizes (default "1M 64M 1G 4G")
+#   BENCH_DIRS    directories to run in (default "/dev/shm ${TMPDIR:-/var/tmp}")
+#   BENCH_FORMAT  csv or json, one object per line (default csv)
+#   BENCH_OUTPUT  result file (default stdout)
+#
+# Each result has throughput in MB/s of input, elapsed and CPU seconds
+# of ow and the command, calls counted by ow --stats for the modes with
+# a command, and system calls counted by strace -c when it is installed.
+
+OW=${1:-./ow}
+SIZES=${BENCH_SIZES:-1M 64M 1G 4G}
+DIRS=${BENCH_DIRS:-/dev/shm ${TMPDIR:-/var/tmp}}
+FORMAT=${BENCH_FORMAT:-csv}
+TIMEFORMAT='%3R %3U %3S'
+STRACE=$(command -v strace)
+
+case "$FORMAT" in
+  csv | json) ;;
+  *)
+    echo "bench.sh: unknown format: $FORMAT" >&2
+    exit 1
+    ;;
+esac
+if ! "$OW" -V > /dev/null; then
+  echo "bench.sh: cannot run $OW" >&2
+  exit 1
+fi
+OW=$(cd "$(dirname "$OW")" && pwd)/$(basename "$OW")
+
+bytes () {
+  case "$1" in
+    *K) echo $((${1%K} << 10)) ;;
+    *M) echo $((${1%M} << 20)) ;;
+    *G) echo $((${1%G} << 30)) ;;
+    *) echo "$1" ;;
+  esac
+}
+
+emit () {
+  # fs size mode seconds user sys calls syscalls
+  local mbps
+  mbps=$(awk -v b="$2" -v s="$4" 'BEGIN { printf "%.1f", (s > 0 ? b / s / 1e6 : 0) }')
+  if [ "$FORMAT" = csv ]; then
+    echo "$1,$2,$3,$mbps,$4,$5,$6,$7,$8"
+  else
+    echo "{\"dir\":\"$1\",\"size\":$2,\"mode\":\"$3\",\"mbps\":$mbps,\"seconds\":$4,\"user\":$5,\"sys\":$6,\"calls\":${7:-null},\"syscalls\":${8:-null}}"
+  fi
+}
+
+# Sum of the calls of the last ow --stats=json report.
+stats_calls () {
+  tail -n 1 "$1" | sed -n 's/.*"calls":{\([^}]*\)}.*/\1/p' \
+    | tr ',' '\n' | awk -F: '{ n += $2 } END { if (NR) print n }'
+}
+
+# Run one mode: prepare the work file, time ow, and count system calls
+# in a second run when strace is available.
+run () {
+  local dir=$1 size=$2 mode=$3
+  shift 3
+  local t calls syscalls=
+  prepare "$dir" "$mode"
+  t=$({ time "$OW" "$@" < /dev/null > /dev/null 2> /dev/null 3> "$dir/ow-bench.stats" ; } 2>&1)
+  if [ $? -ne 0 ]; then
+    echo "bench.sh: $mode failed on $dir ($size bytes)" >&2
+    return
+  fi
+  calls=$(stats_calls "$dir/ow-bench.stats")
+  if [ -n "$STRACE" ]; then
+    prepare "$dir" "$mode"
+    "$STRACE" -f -c -o "$dir/ow-bench.strace" "$OW" "$@" < /dev/null > /dev/null 2>&1 3> /dev/null
+    syscalls=$(awk '$NF == "total" { print $(NF - 2) }' "$dir/ow-bench.strace")
+  fi
+  emit "$dir" "$size" "$mode" $t "$calls" "$syscalls"
+}
+
+prepare () {
+  rm -f "$1/ow-bench.out" "$1/ow-bench.renamed"
+  case "$2" in
+    copy) ;;
+    *) cp "$1/ow-bench.src" "$1/ow-bench.work" ;;
+  esac
+}
+
+bench () {
+  local dir=$1 size=$2
+  local src=$dir/ow-bench.src work=$dir/ow-bench.work
+  local stats="--stats=json --stats-fd=3"
+  run "$dir" "$size" copy -i "$src" -o "$dir/ow-bench.out"
+  run "$dir" "$size" shrink $stats -f "$work" tr -d a-m
+  run "$dir" "$size" same $stats -f "$work" tr a-z A-Z
+  run "$dir" "$size" grow $stats -s -f "$work" sed 's/$/ grow/'
+  run "$dir" "$size" punchhole $stats -p -i "$work" -o "$dir/ow-bench.out" cat
+  run "$dir" "$size" append $stats -a -f "$work" cat
+  run "$dir" "$size" rename $stats -r "$dir/ow-bench.renamed" -f "$work" cat
+  run "$dir" "$size" gzip $stats -f "$work" gzip -1
+  run "$dir" "$size" builtin $stats -f "$work" :gzip -1
+  run "$dir" "$size" filter $stats -f "$work" :tr -d a-m
+}
+
+if [ -n "$BENCH_OUTPUT" ]; then
+  exec > "$BENCH_OUTPUT"
+fi
+if [ "$FORMAT" = csv ]; then
+  echo "dir,size,mode,mbps,seconds,user,sys,calls,syscalls"
+fi
+for dir in $DIRS; do
+  for size in $SIZES; do
+    n=$(bytes "$size")
+    avail=$(df -P -k "$dir" | awk 'NR == 2 { printf "%d", $4 * 1024 }')
+    # source, work file and output or its grown size
+    if [ -z "$avail" ] || [ "$avail" -lt $((n * 4)) ]; then
+      echo "bench.sh: skip $size on $dir (no space)" >&2
+      continue
+    fi
+    head -c "$n" /dev/urandom | base64 | head -c "$n" > "$dir/ow-bench.src"
+    bench "$dir" "$n"
+    rm -f "$dir"/ow-bench.*
+  done
+done
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Check of collapse mode with a command that exits before reading all of
+# its input.
+#
+# usage: check-collapse.sh [ow]
+#
+# The file is collapsed to the output when the command succeeds, and
+# restored when it fails, in every engine.
+
+OW=${1:-./ow}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/ow-check.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+status=0
+
+fail () {
+  echo "check-collapse.sh: $*" >&2
+  status=1
+}
+
+seq 1 300000 > "$DIR/base"
+printf '1\n2\n3\n' > "$DIR/head"
+engines="select splice thread"
+# io_uring may be unavailable
+if "$OW" -e uring -i "$DIR/head" -o "$DIR/file" cat < /dev/null > /dev/null 2>&1; then
+  engines="$engines uring"
+fi
+for engine in $engines; do
+  cp "$DIR/base" "$DIR/file"
+  "$OW" -e "$engine" -C -f "$DIR/file" head -n 3 < /dev/null > /dev/null
+  ret=$?
+  [ $ret -eq 0 ] || fail "$engine: head exited $ret"
+  cmp -s "$DIR/head" "$DIR/file" || fail "$engine: head output not collapsed"
+  cp "$DIR/base" "$DIR/file"
+  "$OW" -e "$engine" -C -f "$DIR/file" \
+    sh -c 'head -c 100 > /dev/null; exit 3' < /dev/null > /dev/null
+  ret=$?
+  [ $ret -eq 3 ] || fail "$engine: failed command exited $ret"
+  cmp -s "$DIR/base" "$DIR/file" || fail "$engine: file not restored"
+done
+exit $status
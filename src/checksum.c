@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+
+#if defined HAVE_LIBXXHASH && defined HAVE_XXHASH_H
+#define CHECKSUM_XXH3_SUPPORTED 1
+#include <xxhash.h>
+#endif
+#if defined HAVE_LIBCRYPTO && defined HAVE_OPENSSL_EVP_H
+#define CHECKSUM_SHA256_SUPPORTED 1
+#include <openssl/evp.h>
+#endif
+
+#include "checksum.h"
+
+// Streaming checksums of the data which ow reads and writes, so that the
+// files are verified without reading them again.  CRC-32C is builtin and
+// uses the instruction of SSE 4.2 when the CPU has it; XXH3 and SHA-256
+// come from libxxhash and libcrypto, which select the vector or SHA
+// instructions of the CPU themselves.
+//
+// checksum_final writes the digest as a hexadecimal string, and frees
+// the state.
+
+static const char *const checksum_names[] = { "crc32c", "xxh3", "sha256" };
+
+const char *
+checksum_name (enum checksum_kind kind)
+{
+  return checksum_names[kind];
+}
+
+int
+checksum_supported (enum checksum_kind kind)
+{
+  switch (kind)
+    {
+    case CHECKSUM_CRC32C:
+      return 1;
+#ifdef CHECKSUM_XXH3_SUPPORTED
+    case CHECKSUM_XXH3:
+      return 1;
+#endif
+#ifdef CHECKSUM_SHA256_SUPPORTED
+    case CHECKSUM_SHA256:
+      return 1;
+#endif
+    default:
+      return 0;
+    }
+}
+
+// CRC-32C (Castagnoli) in slices of 8 bytes by tables, reflected.
+static uint32_t crc32c_table[8][256];
+
+static void
+crc32c_table_init (void)
+{
+  for (uint32_t n = 0; n < 256; n++)
+    {
+      uint32_t crc = n;
+      for (int k = 0; k < 8; k++)
+	crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+      crc32c_table[0][n] = crc;
+    }
+  for (uint32_t n = 0; n < 256; n++)
+    for (int k = 1; k < 8; k++)
+      crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8)
+	^ crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+}
+
+static uint32_t
+crc32c_soft (uint32_t crc, const unsigned char *p, size_t len)
+{
+  for (; len > 0 && ((uintptr_t) p & 7) != 0; len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+  for (; len >= 8; len -= 8, p += 8)
+    {
+      uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16
+			   | (uint32_t) p[3] << 24);
+      crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+	^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+	^ crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]]
+	^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    }
+  for (; len > 0; len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if defined __x86_64__ && defined __GNUC__
+__attribute__ ((target ("sse4.2")))
+static uint32_t
+crc32c_sse42 (uint32_t crc, const unsigned char *p, size_t len)
+{
+  for (; len > 0 && ((uintptr_t) p & 7) != 0; len--)
+    crc = __builtin_ia32_crc32qi (crc, *p++);
+  uint64_t crc64 = crc;
+  for (; len >= 8; len -= 8, p += 8)
+    {
+      uint64_t word;
+      memcpy (&word, p, sizeof (word));
+      crc64 = __builtin_ia32_crc32di (crc64, word);
+    }
+  crc = crc64;
+  for (; len > 0; len--)
+    crc = __builtin_ia32_crc32qi (crc, *p++);
+  return crc;
+}
+#endif
+
+static uint32_t (*crc32c_update) (uint32_t crc, const unsigned char *p,
+				  size_t len);
+
+int
+checksum_init (struct checksum *c)
+{
+  c->state = NULL;
+  switch (c->kind)
+    {
+    case CHECKSUM_CRC32C:
+      if (crc32c_update == NULL)
+	{
+#if defined __x86_64__ && defined __GNUC__
+	  if (__builtin_cpu_supports ("sse4.2"))
+	    crc32c_update = crc32c_sse42;
+#endif
+	  if (crc32c_update == NULL)
+	    {
+	      crc32c_table_init ();
+	      crc32c_update = crc32c_soft;
+	    }
+	}
+      c->crc = 0xffffffff;
+      return 0;
+#ifdef CHECKSUM_XXH3_SUPPORTED
+    case CHECKSUM_XXH3:
+      c->state = XXH3_createState ();
+      if (c->state == NULL || XXH3_64bits_reset (c->state) != XXH_OK)
+	break;
+      return 0;
+#endif
+#ifdef CHECKSUM_SHA256_SUPPORTED
+    case CHECKSUM_SHA256:
+      c->state = EVP_MD_CTX_new ();
+      if (c->state == NULL
+	  || EVP_DigestInit_ex (c->state, EVP_sha256 (), NULL) != 1)
+	break;
+      return 0;
+#endif
+    default:
+      c->error = strerror (ENOTSUP);
+      return -1;
+    }
+  c->error = strerror (ENOMEM);
+  return -1;
+}
+
+void
+checksum_update (struct checksum *c, const void *buf, size_t len)
+{
+  switch (c->kind)
+    {
+    case CHECKSUM_CRC32C:
+      c->crc = crc32c_update (c->crc, buf, len);
+      break;
+#ifdef CHECKSUM_XXH3_SUPPORTED
+    case CHECKSUM_XXH3:
+      XXH3_64bits_update (c->state, buf, len);
+      break;
+#endif
+#ifdef CHECKSUM_SHA256_SUPPORTED
+    case CHECKSUM_SHA256:
+      EVP_DigestUpdate (c->state, buf, len);
+      break;
+#endif
+    default:
+      break;
+    }
+}
+
+void
+checksum_final (struct checksum *c, char hex[CHECKSUM_HEX])
+{
+  hex[0] = '\0';
+  switch (c->kind)
+    {
+    case CHECKSUM_CRC32C:
+      snprintf (hex, CHECKSUM_HEX, "%08x", (unsigned) ~c->crc);
+      break;
+#ifdef CHECKSUM_XXH3_SUPPORTED
+    case CHECKSUM_XXH3:
+      snprintf (hex, CHECKSUM_HEX, "%016llx",
+		(unsigned long long) XXH3_64bits_digest (c->state));
+      XXH3_freeState (c->state);
+      break;
+#endif
+#ifdef CHECKSUM_SHA256_SUPPORTED
+    case CHECKSUM_SHA256:
+      {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	EVP_DigestFinal_ex (c->state, md, &len);
+	for (unsigned int i = 0; i < len && i * 2 + 2 < CHECKSUM_HEX; i++)
+	  snprintf (hex + i * 2, 3, "%02x", md[i]);
+	EVP_MD_CTX_free (c->state);
+	break;
+      }
+#endif
+    default:
+      break;
+    }
+  c->state = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef OW_CHECKSUM_H
+#define OW_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of a digest in hexadecimal with the terminating NUL.
+#define CHECKSUM_HEX 65
+
+enum checksum_kind
+{
+  CHECKSUM_CRC32C,
+  CHECKSUM_XXH3,
+  CHECKSUM_SHA256,
+};
+
+struct checksum
+{
+  enum checksum_kind kind;
+  uint32_t crc;
+  void *state;
+  const char *error;
+};
+
+const char *checksum_name (enum checksum_kind kind);
+int checksum_supported (enum checksum_kind kind);
+int checksum_init (struct checksum *c);
+void checksum_update (struct checksum *c, const void *buf, size_t len);
+void checksum_final (struct checksum *c, char hex[CHECKSUM_HEX]);
+
+#endif
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "config.h"
+
+#if defined HAVE_LIBZ && defined HAVE_ZLIB_H
+#define CODEC_GZIP_SUPPORTED 1
+#include <zlib.h>
+#endif
+#if defined HAVE_LIBZSTD && defined HAVE_ZSTD_H
+#define CODEC_ZSTD_SUPPORTED 1
+#include <zstd.h>
+#endif
+
+#include "codec.h"
+#include "filter.h"
+
+// messages are translated where they are printed
+#define N_(String) String
+
+// Streaming compression and decompression of the builtin commands, so
+// that ow transforms the data in its relay loop instead of piping it
+// through a command.  The byte filters are in filter.c.
+//
+// codec_step transforms up to *ilen bytes of in into up to *olen bytes of
+// out, and sets them to the consumed and produced sizes.  finish tells
+// that in is the rest of the input.  Returns 1 when the output is
+// complete, 0 to be called again, and -1 with error on a broken input,
+// with the sizes set to what was done before it.
+
+#ifdef CODEC_GZIP_SUPPORTED
+
+static int
+gzip_init (struct codec *c)
+{
+  z_stream *zs = calloc (1, sizeof (*zs));
+  if (zs == NULL)
+    {
+      c->error = strerror (ENOMEM);
+      return -1;
+    }
+  // 16 for the gzip header, and 32 to accept zlib streams as well
+  int ret = c->decompress ? inflateInit2 (zs, 15 + 32)
+    : deflateInit2 (zs, c->level == -1 ? Z_DEFAULT_COMPRESSION : c->level,
+		    Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  if (ret != Z_OK)
+    {
+      c->error = zError (ret);
+      free (zs);
+      return -1;
+    }
+  c->state = zs;
+  return 0;
+}
+
+static int
+gzip_step (struct codec *c, const void *in, size_t *ilen, void *out,
+	   size_t *olen, int finish)
+{
+  z_stream *zs = c->state;
+  uInt isize = *ilen < UINT_MAX ? *ilen : UINT_MAX;
+  uInt osize = *olen < UINT_MAX ? *olen : UINT_MAX;
+  // concatenated members, e.g. output of parallel mode
+  if (c->decompress && c->end && isize > 0)
+    {
+      inflateReset (zs);
+      c->end = 0;
+    }
+  zs->next_in = (Bytef *) in;
+  zs->avail_in = isize;
+  zs->next_out = out;
+  zs->avail_out = osize;
+  int ret = c->decompress ? inflate (zs, Z_NO_FLUSH)
+    : deflate (zs, finish && *ilen == isize ? Z_FINISH : Z_NO_FLUSH);
+  *ilen = isize - zs->avail_in;
+  *olen = osize - zs->avail_out;
+  if (ret == Z_STREAM_END)
+    c->end = 1;
+  else if (ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+      c->error = zs->msg != NULL ? zs->msg : zError (ret);
+      return -1;
+    }
+  if (!c->decompress)
+    return c->end;
+  if (*ilen > 0)
+    c->started = 1;
+  if (!finish || zs->avail_in > 0 || zs->avail_out == 0)
+    return 0;
+  if (c->started && !c->end)
+    {
+      c->error = N_("unexpected end of input");
+      return -1;
+    }
+  return 1;
+}
+
+static void
+gzip_end (struct codec *c)
+{
+  if (c->decompress)
+    inflateEnd (c->state);
+  else
+    deflateEnd (c->state);
+  free (c->state);
+}
+
+#endif
+
+#ifdef CODEC_ZSTD_SUPPORTED
+
+static int
+zstd_init (struct codec *c)
+{
+  size_t ret = 0;
+  if (c->decompress)
+    {
+      ZSTD_DCtx *dctx = ZSTD_createDCtx ();
+      if (dctx == NULL)
+	{
+	  c->error = strerror (ENOMEM);
+	  return -1;
+	}
+      c->state = dctx;
+      return 0;
+    }
+  ZSTD_CCtx *cctx = ZSTD_createCCtx ();
+  if (cctx == NULL)
+    {
+      c->error = strerror (ENOMEM);
+      return -1;
+    }
+  if (c->level != -1)
+    ret = ZSTD_CCtx_setParameter (cctx, ZSTD_c_compressionLevel, c->level);
+  if (!ZSTD_isError (ret) && c->threads > 0)
+    ret = ZSTD_CCtx_setParameter (cctx, ZSTD_c_nbWorkers, c->threads);
+  if (ZSTD_isError (ret))
+    {
+      c->error = ZSTD_getErrorName (ret);
+      ZSTD_freeCCtx (cctx);
+      return -1;
+    }
+  c->state = cctx;
+  return 0;
+}
+
+static int
+zstd_step (struct codec *c, const void *in, size_t *ilen, void *out,
+	   size_t *olen, int finish)
+{
+  ZSTD_inBuffer ib = { in, *ilen, 0 };
+  ZSTD_outBuffer ob = { out, *olen, 0 };
+  size_t ret = c->decompress ? ZSTD_decompressStream (c->state, &ob, &ib)
+    : ZSTD_compressStream2 (c->state, &ob, &ib,
+			    finish ? ZSTD_e_end : ZSTD_e_continue);
+  *ilen = ib.pos;
+  *olen = ob.pos;
+  if (ZSTD_isError (ret))
+    {
+      c->error = ZSTD_getErrorName (ret);
+      return -1;
+    }
+  // 0 is a flushed frame of both directions
+  c->end = ret == 0;
+  if (!c->decompress)
+    return finish && c->end;
+  if (ib.pos > 0)
+    c->started = 1;
+  if (!finish || ib.pos < ib.size || ob.pos == ob.size)
+    return 0;
+  if (c->started && !c->end)
+    {
+      c->error = N_("unexpected end of input");
+      return -1;
+    }
+  return 1;
+}
+
+static void
+zstd_end (struct codec *c)
+{
+  if (c->decompress)
+    ZSTD_freeDCtx (c->state);
+  else
+    ZSTD_freeCCtx (c->state);
+}
+
+#endif
+
+int
+codec_supported (enum codec_kind kind)
+{
+  switch (kind)
+    {
+#ifdef CODEC_GZIP_SUPPORTED
+    case CODEC_GZIP:
+      return 1;
+#endif
+#ifdef CODEC_ZSTD_SUPPORTED
+    case CODEC_ZSTD:
+      return 1;
+#endif
+    case CODEC_TR:
+    case CODEC_CRLF:
+    case CODEC_GREP:
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+// The output is never longer than the input, so the codec may write it
+// over its input.
+int
+codec_inplace (enum codec_kind kind)
+{
+  return kind == CODEC_TR || kind == CODEC_CRLF || kind == CODEC_GREP;
+}
+
+int
+codec_init (struct codec *c)
+{
+  c->started = 0;
+  c->end = 0;
+  c->state = NULL;
+  c->error = NULL;
+  switch (c->kind)
+    {
+#ifdef CODEC_GZIP_SUPPORTED
+    case CODEC_GZIP:
+      return gzip_init (c);
+#endif
+#ifdef CODEC_ZSTD_SUPPORTED
+    case CODEC_ZSTD:
+      return zstd_init (c);
+#endif
+    case CODEC_TR:
+    case CODEC_CRLF:
+    case CODEC_GREP:
+      return filter_init (c);
+    default:
+      c->error = strerror (ENOSYS);
+      return -1;
+    }
+}
+
+int
+codec_step (struct codec *c, const void *in, size_t *ilen, void *out,
+	    size_t *olen, int finish)
+{
+  switch (c->kind)
+    {
+#ifdef CODEC_GZIP_SUPPORTED
+    case CODEC_GZIP:
+      return gzip_step (c, in, ilen, out, olen, finish);
+#endif
+#ifdef CODEC_ZSTD_SUPPORTED
+    case CODEC_ZSTD:
+      return zstd_step (c, in, ilen, out, olen, finish);
+#endif
+    case CODEC_TR:
+    case CODEC_CRLF:
+    case CODEC_GREP:
+      return filter_step (c, in, ilen, out, olen, finish);
+    default:
+      c->error = strerror (ENOSYS);
+      return -1;
+    }
+}
+
+void
+codec_end (struct codec *c)
+{
+  switch (c->kind)
+    {
+#ifdef CODEC_GZIP_SUPPORTED
+    case CODEC_GZIP:
+      gzip_end (c);
+      break;
+#endif
+#ifdef CODEC_ZSTD_SUPPORTED
+    case CODEC_ZSTD:
+      zstd_end (c);
+      break;
+#endif
+    case CODEC_TR:
+    case CODEC_CRLF:
+    case CODEC_GREP:
+      filter_end (c);
+      break;
+    default:
+      break;
+    }
+  c->state = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef OW_CODEC_H
+#define OW_CODEC_H
+
+#include <stddef.h>
+
+enum codec_kind
+{
+  CODEC_GZIP,
+  CODEC_ZSTD,
+  CODEC_TR,
+  CODEC_CRLF,
+  CODEC_GREP,
+};
+
+struct codec
+{
+  enum codec_kind kind;
+  int decompress;
+  int level;
+  int threads;
+  int delete;
+  int invert;
+  const char *arg[2];
+  int started;
+  int end;
+  void *state;
+  const char *error;
+};
+
+int codec_supported (enum codec_kind kind);
+int codec_inplace (enum codec_kind kind);
+int codec_init (struct codec *c);
+int codec_step (struct codec *c, const void *in, size_t *ilen, void *out,
+		size_t *olen, int finish);
+void codec_end (struct codec *c);
+
+#endif
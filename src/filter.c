@@ -0,0 +1,661 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "config.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define FILTER_X86 1
+#include <immintrin.h>
+#endif
+
+#include "filter.h"
+
+// messages are translated where they are printed
+#define N_(String) String
+
+// Byte filters of the builtin commands.  None of them makes the output
+// longer than its input, so they can run in place on a buffer.
+//
+// The kernels test 32 (AVX2) or 16 (SSE2) bytes at once, chosen by the
+// processor when the filter starts, and move bytes one by one only in
+// the blocks which change.  A set of up to FILTER_RANGES ranges is tested
+// with range compares, other sets of up to 16 bytes to delete with SSE4.2
+// string compare, and the rest with a table.
+
+#define FILTER_RANGES 4
+
+struct range
+{
+  unsigned char lo;
+  unsigned char width;
+  unsigned char delta;
+};
+
+struct filter
+{
+  unsigned char map[256];
+  unsigned char del[256];
+  struct range range[FILTER_RANGES];
+  int nrange;
+  unsigned char set[16];
+  int nset;
+  unsigned char *pat;
+  size_t plen;
+  size_t (*run) (const struct filter *, const unsigned char *, size_t,
+		 unsigned char *);
+  const unsigned char *(*find) (const unsigned char *, size_t,
+				const unsigned char *, size_t);
+};
+
+// Scalar kernels, also for the tails of the vector kernels.  out may be
+// in, as the output is never ahead of the input.
+
+static size_t
+tr_scalar (const struct filter *f, const unsigned char *in, size_t len,
+	   unsigned char *out)
+{
+  for (size_t i = 0; i < len; i++)
+    out[i] = f->map[in[i]];
+  return len;
+}
+
+static size_t
+del_scalar (const struct filter *f, const unsigned char *in, size_t len,
+	    unsigned char *out)
+{
+  size_t o = 0;
+  for (size_t i = 0; i < len; i++)
+    {
+      out[o] = in[i];
+      o += !f->del[in[i]];
+    }
+  return o;
+}
+
+static size_t
+crlf_scalar (const struct filter *f, const unsigned char *in, size_t len,
+	     unsigned char *out)
+{
+  (void) f;
+  size_t o = 0;
+  for (size_t i = 0; i < len; i++)
+    {
+      out[o] = in[i];
+      o += !(in[i] == '\r' && i + 1 < len && in[i + 1] == '\n');
+    }
+  return o;
+}
+
+// Copy a block of n bytes without the bytes of mask.
+static inline size_t
+compact (unsigned char *out, const unsigned char *in, size_t n,
+	 uint32_t mask)
+{
+  size_t o = 0;
+  for (size_t i = 0; i < n; i++)
+    {
+      out[o] = in[i];
+      o += !(mask >> i & 1);
+    }
+  return o;
+}
+
+static const unsigned char *
+find_scalar (const unsigned char *s, size_t n, const unsigned char *p,
+	     size_t m)
+{
+  return memmem (s, n, p, m);
+}
+
+#ifdef FILTER_X86
+
+__attribute__((target ("avx2")))
+static inline __m256i
+range_avx2 (const struct filter *f, __m256i v, __m256i *delta)
+{
+  __m256i in = _mm256_setzero_si256 ();
+  *delta = _mm256_setzero_si256 ();
+  for (int k = 0; k < f->nrange; k++)
+    {
+      const struct range *r = &f->range[k];
+      __m256i d = _mm256_sub_epi8 (v, _mm256_set1_epi8 (r->lo));
+      __m256i m = _mm256_cmpeq_epi8 (_mm256_min_epu8
+				     (d, _mm256_set1_epi8 (r->width)), d);
+      in = _mm256_or_si256 (in, m);
+      *delta = _mm256_or_si256 (*delta, _mm256_and_si256
+				(m, _mm256_set1_epi8 (r->delta)));
+    }
+  return in;
+}
+
+__attribute__((target ("avx2")))
+static size_t
+tr_avx2 (const struct filter *f, const unsigned char *in, size_t len,
+	 unsigned char *out)
+{
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+    {
+      __m256i delta;
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (in + i));
+      range_avx2 (f, v, &delta);
+      _mm256_storeu_si256 ((__m256i *) (out + i),
+			   _mm256_add_epi8 (v, delta));
+    }
+  return i + tr_scalar (f, in + i, len - i, out + i);
+}
+
+__attribute__((target ("avx2")))
+static size_t
+del_avx2 (const struct filter *f, const unsigned char *in, size_t len,
+	  unsigned char *out)
+{
+  size_t i = 0;
+  size_t o = 0;
+  for (; i + 32 <= len; i += 32)
+    {
+      __m256i delta;
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (in + i));
+      uint32_t mask = _mm256_movemask_epi8 (range_avx2 (f, v, &delta));
+      if (mask == 0)
+	{
+	  _mm256_storeu_si256 ((__m256i *) (out + o), v);
+	  o += 32;
+	}
+      else if (mask != UINT32_MAX)
+	o += compact (out + o, in + i, 32, mask);
+    }
+  return o + del_scalar (f, in + i, len - i, out + o);
+}
+
+__attribute__((target ("avx2")))
+static size_t
+crlf_avx2 (const struct filter *f, const unsigned char *in, size_t len,
+	   unsigned char *out)
+{
+  size_t i = 0;
+  size_t o = 0;
+  for (; i + 33 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (in + i));
+      __m256i next = _mm256_loadu_si256 ((const __m256i *) (in + i + 1));
+      uint32_t mask = _mm256_movemask_epi8 (_mm256_and_si256
+					    (_mm256_cmpeq_epi8
+					     (v, _mm256_set1_epi8 ('\r')),
+					     _mm256_cmpeq_epi8
+					     (next, _mm256_set1_epi8 ('\n'))));
+      if (mask == 0)
+	{
+	  _mm256_storeu_si256 ((__m256i *) (out + o), v);
+	  o += 32;
+	}
+      else
+	o += compact (out + o, in + i, 32, mask);
+    }
+  return o + crlf_scalar (f, in + i, len - i, out + o);
+}
+
+// Candidates of the first and the last byte of the string are compared
+// in blocks, and only the candidates are compared as whole.
+__attribute__((target ("avx2")))
+static const unsigned char *
+find_avx2 (const unsigned char *s, size_t n, const unsigned char *p,
+	   size_t m)
+{
+  if (m < 2 || n < m)
+    return memmem (s, n, p, m);
+  __m256i first = _mm256_set1_epi8 (p[0]);
+  __m256i last = _mm256_set1_epi8 (p[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 32 <= n; i += 32)
+    {
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (s + i + m - 1));
+      uint32_t mask = _mm256_movemask_epi8 (_mm256_and_si256
+					    (_mm256_cmpeq_epi8 (a, first),
+					     _mm256_cmpeq_epi8 (b, last)));
+      for (; mask != 0; mask &= mask - 1)
+	{
+	  size_t j = i + __builtin_ctz (mask);
+	  if (memcmp (s + j + 1, p + 1, m - 2) == 0)
+	    return s + j;
+	}
+    }
+  return memmem (s + i, n - i, p, m);
+}
+
+__attribute__((target ("sse2")))
+static inline __m128i
+range_sse2 (const struct filter *f, __m128i v, __m128i *delta)
+{
+  __m128i in = _mm_setzero_si128 ();
+  *delta = _mm_setzero_si128 ();
+  for (int k = 0; k < f->nrange; k++)
+    {
+      const struct range *r = &f->range[k];
+      __m128i d = _mm_sub_epi8 (v, _mm_set1_epi8 (r->lo));
+      __m128i m = _mm_cmpeq_epi8 (_mm_min_epu8 (d, _mm_set1_epi8 (r->width)),
+				  d);
+      in = _mm_or_si128 (in, m);
+      *delta = _mm_or_si128 (*delta, _mm_and_si128
+			     (m, _mm_set1_epi8 (r->delta)));
+    }
+  return in;
+}
+
+__attribute__((target ("sse2")))
+static size_t
+tr_sse2 (const struct filter *f, const unsigned char *in, size_t len,
+	 unsigned char *out)
+{
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i delta;
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+      range_sse2 (f, v, &delta);
+      _mm_storeu_si128 ((__m128i *) (out + i), _mm_add_epi8 (v, delta));
+    }
+  return i + tr_scalar (f, in + i, len - i, out + i);
+}
+
+__attribute__((target ("sse2")))
+static size_t
+del_sse2 (const struct filter *f, const unsigned char *in, size_t len,
+	  unsigned char *out)
+{
+  size_t i = 0;
+  size_t o = 0;
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i delta;
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+      uint32_t mask = _mm_movemask_epi8 (range_sse2 (f, v, &delta));
+      if (mask == 0)
+	{
+	  _mm_storeu_si128 ((__m128i *) (out + o), v);
+	  o += 16;
+	}
+      else if (mask != 0xffff)
+	o += compact (out + o, in + i, 16, mask);
+    }
+  return o + del_scalar (f, in + i, len - i, out + o);
+}
+
+__attribute__((target ("sse4.2")))
+static size_t
+del_sse42 (const struct filter *f, const unsigned char *in, size_t len,
+	   unsigned char *out)
+{
+  __m128i set = _mm_loadu_si128 ((const __m128i *) f->set);
+  size_t i = 0;
+  size_t o = 0;
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+      uint32_t mask =
+	_mm_cvtsi128_si32 (_mm_cmpestrm (set, f->nset, v, 16,
+					 _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY
+					 | _SIDD_BIT_MASK));
+      if (mask == 0)
+	{
+	  _mm_storeu_si128 ((__m128i *) (out + o), v);
+	  o += 16;
+	}
+      else if (mask != 0xffff)
+	o += compact (out + o, in + i, 16, mask);
+    }
+  return o + del_scalar (f, in + i, len - i, out + o);
+}
+
+__attribute__((target ("sse2")))
+static size_t
+crlf_sse2 (const struct filter *f, const unsigned char *in, size_t len,
+	   unsigned char *out)
+{
+  size_t i = 0;
+  size_t o = 0;
+  for (; i + 17 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+      __m128i next = _mm_loadu_si128 ((const __m128i *) (in + i + 1));
+      uint32_t mask = _mm_movemask_epi8 (_mm_and_si128
+					 (_mm_cmpeq_epi8
+					  (v, _mm_set1_epi8 ('\r')),
+					  _mm_cmpeq_epi8
+					  (next, _mm_set1_epi8 ('\n'))));
+      if (mask == 0)
+	{
+	  _mm_storeu_si128 ((__m128i *) (out + o), v);
+	  o += 16;
+	}
+      else
+	o += compact (out + o, in + i, 16, mask);
+    }
+  return o + crlf_scalar (f, in + i, len - i, out + o);
+}
+
+__attribute__((target ("sse2")))
+static const unsigned char *
+find_sse2 (const unsigned char *s, size_t n, const unsigned char *p,
+	   size_t m)
+{
+  if (m < 2 || n < m)
+    return memmem (s, n, p, m);
+  __m128i first = _mm_set1_epi8 (p[0]);
+  __m128i last = _mm_set1_epi8 (p[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= n; i += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (s + i));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (s + i + m - 1));
+      uint32_t mask = _mm_movemask_epi8 (_mm_and_si128
+					 (_mm_cmpeq_epi8 (a, first),
+					  _mm_cmpeq_epi8 (b, last)));
+      for (; mask != 0; mask &= mask - 1)
+	{
+	  size_t j = i + __builtin_ctz (mask);
+	  if (memcmp (s + j + 1, p + 1, m - 2) == 0)
+	    return s + j;
+	}
+    }
+  return memmem (s + i, n - i, p, m);
+}
+
+#endif
+
+// Read a byte of a set or string, with backslash escapes.
+static int
+filter_char (const char **s)
+{
+  const unsigned char *p = (const unsigned char *) *s;
+  int ch = *p++;
+  if (ch == '\\' && *p != '\0')
+    {
+      ch = *p++;
+      switch (ch)
+	{
+	case 'a':
+	  ch = '\a';
+	  break;
+	case 'b':
+	  ch = '\b';
+	  break;
+	case 'f':
+	  ch = '\f';
+	  break;
+	case 'n':
+	  ch = '\n';
+	  break;
+	case 'r':
+	  ch = '\r';
+	  break;
+	case 't':
+	  ch = '\t';
+	  break;
+	case 'v':
+	  ch = '\v';
+	  break;
+	default:
+	  if (ch >= '0' && ch <= '7')
+	    {
+	      ch -= '0';
+	      for (int i = 0; i < 2 && *p >= '0' && *p <= '7'; i++)
+		ch = ch * 8 + *p++ - '0';
+	      ch &= 0xff;
+	    }
+	  break;
+	}
+    }
+  *s = (const char *) p;
+  return ch;
+}
+
+// Expand a set of :tr with ranges such as a-z.  Returns the number of
+// bytes, or -1 with error.
+static int
+filter_set (struct codec *c, const char *s, unsigned char **set)
+{
+  size_t n = 0;
+  *set = malloc (strlen (s) * 256 + 1);
+  if (*set == NULL)
+    {
+      c->error = strerror (ENOMEM);
+      return -1;
+    }
+  while (*s != '\0')
+    {
+      int lo = filter_char (&s);
+      int hi = lo;
+      if (s[0] == '-' && s[1] != '\0')
+	{
+	  s++;
+	  hi = filter_char (&s);
+	  if (hi < lo)
+	    {
+	      c->error = N_("range-endpoints are in reverse order");
+	      free (*set);
+	      return -1;
+	    }
+	}
+      for (int ch = lo; ch <= hi; ch++)
+	(*set)[n++] = ch;
+    }
+  return n;
+}
+
+// Find the ranges of the changed bytes, with the same difference for
+// translation.  nrange is -1 if there are too many of them.
+static void
+filter_ranges (struct filter *f, const unsigned char *changed, int translate)
+{
+  f->nrange = 0;
+  for (int ch = 0; ch < 256; ch++)
+    {
+      if (!changed[ch])
+	continue;
+      unsigned char delta = translate ? f->map[ch] - ch : 0;
+      int hi = ch;
+      while (hi + 1 < 256 && changed[hi + 1]
+	     && (unsigned char) (translate ? f->map[hi + 1] - (hi + 1) : 0)
+	     == delta)
+	hi++;
+      if (f->nrange == FILTER_RANGES)
+	{
+	  f->nrange = -1;
+	  return;
+	}
+      f->range[f->nrange].lo = ch;
+      f->range[f->nrange].width = hi - ch;
+      f->range[f->nrange].delta = delta;
+      f->nrange++;
+      ch = hi;
+    }
+}
+
+static int
+filter_tr (struct codec *c, struct filter *f)
+{
+  unsigned char *set1;
+  unsigned char *set2 = NULL;
+  int n1 = filter_set (c, c->arg[0], &set1);
+  int n2 = 0;
+  if (n1 == -1)
+    return -1;
+  if (!c->delete && (n2 = filter_set (c, c->arg[1], &set2)) == -1)
+    {
+      free (set1);
+      return -1;
+    }
+  if (!c->delete && n2 == 0 && n1 > 0)
+    {
+      c->error = N_("when not deleting, set2 must be non-empty");
+      free (set1);
+      free (set2);
+      return -1;
+    }
+  unsigned char changed[256] = { 0 };
+  for (int ch = 0; ch < 256; ch++)
+    f->map[ch] = ch;
+  // set2 is extended by its last byte as tr
+  for (int i = 0; i < n1; i++)
+    if (c->delete)
+      f->del[set1[i]] = 1;
+    else
+      f->map[set1[i]] = set2[i < n2 ? i : n2 - 1];
+  for (int ch = 0; ch < 256; ch++)
+    changed[ch] = c->delete ? f->del[ch] : f->map[ch] != ch;
+  filter_ranges (f, changed, !c->delete);
+  f->nset = 0;
+  for (int ch = 0; ch < 256 && f->nset >= 0; ch++)
+    if (f->del[ch])
+      {
+	if (f->nset < 16)
+	  f->set[f->nset++] = ch;
+	else
+	  f->nset = -1;
+      }
+  free (set1);
+  free (set2);
+  return 0;
+}
+
+static int
+filter_grep (struct codec *c, struct filter *f)
+{
+  const char *s = c->arg[0];
+  f->pat = malloc (strlen (s) + 1);
+  if (f->pat == NULL)
+    {
+      c->error = strerror (ENOMEM);
+      return -1;
+    }
+  f->plen = 0;
+  while (*s != '\0')
+    f->pat[f->plen++] = filter_char (&s);
+  if (memchr (f->pat, '\n', f->plen) != NULL)
+    {
+      c->error = N_("string must not contain newline");
+      free (f->pat);
+      return -1;
+    }
+  return 0;
+}
+
+int
+filter_init (struct codec *c)
+{
+  struct filter *f = calloc (1, sizeof (*f));
+  if (f == NULL)
+    {
+      c->error = strerror (ENOMEM);
+      return -1;
+    }
+  int ret = 0;
+  if (c->kind == CODEC_TR)
+    ret = filter_tr (c, f);
+  else if (c->kind == CODEC_GREP)
+    ret = filter_grep (c, f);
+  if (ret == -1)
+    {
+      free (f);
+      return -1;
+    }
+  f->run = c->kind == CODEC_CRLF ? crlf_scalar
+    : c->delete ? del_scalar : tr_scalar;
+  f->find = find_scalar;
+#ifdef FILTER_X86
+  __builtin_cpu_init ();
+  int avx2 = __builtin_cpu_supports ("avx2");
+  if (c->kind == CODEC_CRLF)
+    f->run = avx2 ? crlf_avx2 : crlf_sse2;
+  else if (c->kind == CODEC_TR && f->nrange >= 0)
+    f->run = c->delete ? (avx2 ? del_avx2 : del_sse2)
+      : (avx2 ? tr_avx2 : tr_sse2);
+  else if (c->kind == CODEC_TR && c->delete && f->nset >= 0
+	   && __builtin_cpu_supports ("sse4.2"))
+    f->run = del_sse42;
+  f->find = avx2 ? find_avx2 : find_sse2;
+#endif
+  c->state = f;
+  return 0;
+}
+
+// Copy the lines of in which contain the string (or not with invert) to
+// out.  Unless last, the line without newline at the end is left and
+// *len is set to the consumed size.
+static size_t
+filter_lines (const struct filter *f, int invert, const unsigned char *in,
+	      size_t *len, unsigned char *out, int last)
+{
+  size_t end = *len;
+  if (!last)
+    {
+      const unsigned char *nl = memrchr (in, '\n', end);
+      end = nl == NULL ? 0 : (size_t) (nl - in) + 1;
+    }
+  size_t i = 0;
+  size_t o = 0;
+  while (i < end)
+    {
+      const unsigned char *m = f->find (in + i, end - i, f->pat, f->plen);
+      if (m == NULL)
+	{
+	  if (invert)
+	    {
+	      memmove (out + o, in + i, end - i);
+	      o += end - i;
+	    }
+	  break;
+	}
+      const unsigned char *nl = memrchr (in + i, '\n', m - (in + i));
+      size_t start = nl == NULL ? i : (size_t) (nl - in) + 1;
+      nl = memchr (m, '\n', in + end - m);
+      size_t next = nl == NULL ? end : (size_t) (nl - in) + 1;
+      if (invert)
+	{
+	  memmove (out + o, in + i, start - i);
+	  o += start - i;
+	}
+      else
+	{
+	  memmove (out + o, in + start, next - start);
+	  o += next - start;
+	}
+      i = next;
+    }
+  *len = end;
+  return o;
+}
+
+int
+filter_step (struct codec *c, const void *in, size_t *ilen, void *out,
+	     size_t *olen, int finish)
+{
+  struct filter *f = c->state;
+  const unsigned char *src = in;
+  size_t len = *ilen < *olen ? *ilen : *olen;
+  int last = finish && len == *ilen;
+  if (c->kind == CODEC_GREP)
+    *olen = filter_lines (f, c->invert, src, &len, out, last);
+  else
+    {
+      // CR at the end may be followed by LF of the next input
+      if (c->kind == CODEC_CRLF && !last && len > 0 && src[len - 1] == '\r')
+	len--;
+      *olen = f->run (f, src, len, out);
+    }
+  *ilen = len;
+  return last;
+}
+
+void
+filter_end (struct codec *c)
+{
+  struct filter *f = c->state;
+  free (f->pat);
+  free (f);
+}
@@ -0,0 +1,13 @@
+#ifndef OW_FILTER_H
+#define OW_FILTER_H
+
+#include <stddef.h>
+
+#include "codec.h"
+
+int filter_init (struct codec *c);
+int filter_step (struct codec *c, const void *in, size_t *ilen, void *out,
+		 size_t *olen, int finish);
+void filter_end (struct codec *c);
+
+#endif
@@ -8,15 +8,38 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <ctype.h>
 #include <sys/sendfile.h>
 #include <libgen.h>
 #include <locale.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/xattr.h>
+#include <sys/statvfs.h>
 
 #include "config.h"
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include "uring.h"
+#endif
+#include "codec.h"
+#include "checksum.h"
+
 #include <libintl.h>
 #define _(String) gettext (String)
 #define gettext_noop(String) String
@@ -24,25 +47,108 @@
 
 #define OFF_MAX (~((off_t)1<<(sizeof(off_t)*8-1)))
 
+#define DEFAULT_BUFSIZE (128 * 1024)
+#define DEFAULT_SPILL_MEMORY (64 * 1024 * 1024)
+#define DEFAULT_PUNCH_BATCH (64 * 1024 * 1024)
+#define COPY_CHUNK (1024 * 1024 * 1024)
+#define DEFAULT_PIPE_MAX (1024 * 1024)
+#define PIPE_GROW_COUNT 4
+#define STALL_TIMEOUT_MS 500
+#define EACH_REPORT_MS 100
+#define MAX_JOBS 256
+#define MIN_CHUNK_SIZE (1024 * 1024)
+#define MAX_CHUNK_SIZE (64 * 1024 * 1024)
+#define DEFAULT_JOURNAL_SYNC (256 * 1024 * 1024)
+#define CACHE_WINDOW (8 * 1024 * 1024)
+#define DIRECT_ALIGN 4096
+#define WRITE_BATCH (64 * 1024)
+#define DEFAULT_AUTO_SAMPLE (8 * 1024 * 1024)
+
 struct opt
 {
   const char *file_input;
   const char *file_output;
   const char *file_rename;
+  const char *file_temp;
+  const char *engine;
+  size_t bufsize;
+  size_t spill_memory;
+  size_t punch_batch;
+  size_t pipe_max;
+  size_t prealloc_size;
+  size_t auto_size;
+  size_t rate_bytes[2];
+  size_t rate_ops[2];
+  const char *rate_file;
+  const char **tee_output;
+  int ntee;
+  int jobs;
+  char delim;
+  const char *stats;
+  double stats_interval;
+  int stats_fd;
+  const char *journal;
+  size_t journal_sync;
+  int cache;
+  int holes;
+  int atomic;
+  int checksum;
+  int stats_pipe;
   int append:1;
   int punchhole:1;
   int file_stdin:1;
   int file_stdout:1;
+  int verbose:1;
+  int spill:1;
+  int clone:1;
+  int resume:1;
+  int each:1;
+  int collapse:1;
+  int prealloc:1;
+  int checksum_xattr:1;
 };
 
 #define OPT_INITIALIZER {\
   .file_input = NULL,\
   .file_output = NULL,\
   .file_rename = NULL,\
+  .file_temp = NULL,\
+  .engine = NULL,\
+  .bufsize = 0,\
+  .spill_memory = 0,\
+  .punch_batch = 0,\
+  .pipe_max = 0,\
+  .prealloc_size = 0,\
+  .auto_size = 0,\
+  .rate_bytes = {0, 0},\
+  .rate_ops = {0, 0},\
+  .rate_file = NULL,\
+  .tee_output = NULL,\
+  .ntee = 0,\
+  .jobs = 0,\
+  .delim = '\n',\
+  .stats = NULL,\
+  .stats_interval = 0,\
+  .stats_fd = -1,\
+  .journal = NULL,\
+  .journal_sync = 0,\
+  .cache = -1,\
+  .holes = -1,\
+  .atomic = -1,\
+  .checksum = -1,\
+  .stats_pipe = -1,\
   .append = 0,\
   .punchhole = 0,\
   .file_stdin = 0,\
   .file_stdout = 0,\
+  .verbose = 0,\
+  .spill = 0,\
+  .clone = 0,\
+  .resume = 0,\
+  .each = 0,\
+  .collapse = 0,\
+  .prealloc = 0,\
+  .checksum_xattr = 0,\
 }
 
 static void
@@ -55,7 +161,18 @@ static void
 print_usage (FILE * fp, int argc, char *const argv[])
 {
   fprintf (fp, _("Usage:\n"));
-  fprintf (fp, _("  %s [options] [--] cmd [arg ...] [redirects]\n"), argv[0]);
+  fprintf (fp,
+	   _
+	   ("  %s [options] [--] cmd [arg ...] [| cmd [arg ...]] ... [redirects]\n"),
+	   argv[0]);
+  fprintf (fp,
+	   _
+	   ("  %s --tee=file ... [options] [--] cmd [arg ...] [& cmd [arg ...]] ... [redirects]\n"),
+	   argv[0]);
+  fprintf (fp,
+	   _
+	   ("  %s --each [options] [--] cmd [arg ...] [| cmd [arg ...]] ... [-- file ...]\n"),
+	   argv[0]);
   fprintf (fp, _("\n"));
   fprintf (fp, _("Options:\n"));
   fprintf (fp, _("  -i infile     : input file\n"));
@@ -63,9 +180,89 @@ print_usage (FILE * fp, int argc, char *const argv[])
   fprintf (fp, _("  -f inoutfile  : input/output file\n"));
   fprintf (fp, _("  -r renamefile : rename output file\n"));
   fprintf (fp, _("  -a            : append mode\n"));
+  fprintf (fp,
+	   _
+	   ("  -C            : collapse mode (append to same file and collapse the input)\n"));
+  fprintf (fp,
+	   _
+	   ("  -c            : clone mode (share file extents without command)\n"));
   fprintf (fp,
 	   _
 	   ("  -p            : punchhole mode (punchhole read data on input file)\n"));
+  fprintf (fp,
+	   _
+	   ("  -P size       : punchhole batch size for punchhole mode (default 64M)\n"));
+  fprintf (fp, _("  -b size       : relay buffer size (K, M and G suffixes)\n"));
+  fprintf (fp,
+	   _
+	   ("  -L size       : pipe size limit (default /proc/sys/fs/pipe-max-size)\n"));
+  fprintf (fp,
+	   _("  -e engine     : relay engine (auto, select, uring, splice or thread)\n"));
+  fprintf (fp,
+	   _
+	   ("  -s            : spill mode (spill output exceeding buffer to memory or temporary file)\n"));
+  fprintf (fp, _("  -m size       : memory size for spill mode (default 64M)\n"));
+  fprintf (fp,
+	   _
+	   ("  -j jobs       : parallel mode (run jobs commands on chunks of input)\n"));
+  fprintf (fp,
+	   _
+	   ("  -d delim      : record delimiter for parallel mode (default newline)\n"));
+  fprintf (fp, _("  -v            : verbose mode\n"));
+  fprintf (fp,
+	   _
+	   ("  --stats[=json]        : report statistics at exit and on SIGUSR1\n"));
+  fprintf (fp,
+	   _
+	   ("  --stats-interval=secs : report statistics periodically\n"));
+  fprintf (fp,
+	   _
+	   ("  --stats-fd=fd         : file descriptor for statistics (default 2)\n"));
+  fprintf (fp,
+	   _
+	   ("  --journal=file        : journal of checkpoints for resume\n"));
+  fprintf (fp,
+	   _
+	   ("  --journal-sync=size   : input size between checkpoints (default 256M)\n"));
+  fprintf (fp,
+	   _
+	   ("  --resume              : resume from the last checkpoint of journal\n"));
+  fprintf (fp,
+	   _
+	   ("  --cache=policy        : page cache policy (normal, sequential, dontneed or direct)\n"));
+  fprintf (fp,
+	   _
+	   ("  --holes=policy        : holes of input to command (read, zero or skip)\n"));
+  fprintf (fp,
+	   _
+	   ("  --atomic[=exchange]   : write to temporary file and replace output at once\n"));
+  fprintf (fp,
+	   _
+	   ("  --prealloc[=size]     : preallocate output (default input size)\n"));
+  fprintf (fp,
+	   _
+	   ("  --read-rate=size[/ops]  : limit file reads per second\n"));
+  fprintf (fp,
+	   _
+	   ("  --write-rate=size[/ops] : limit file writes per second\n"));
+  fprintf (fp,
+	   _
+	   ("  --rate-file=file      : read and write rates reloaded on change and SIGHUP\n"));
+  fprintf (fp,
+	   _
+	   ("  --checksum=type       : checksums of input and output (crc32c, xxh3 or sha256)\n"));
+  fprintf (fp,
+	   _
+	   ("  --checksum-xattr      : store checksums as extended attributes of output\n"));
+  fprintf (fp,
+	   _
+	   ("  --auto[=size]         : choose strategy by command on sample (default 8M)\n"));
+  fprintf (fp,
+	   _
+	   ("  --tee=file            : output file of next command group after &\n"));
+  fprintf (fp,
+	   _
+	   ("  --each                : run on each file after -- (or NUL separated on stdin)\n"));
   fprintf (fp, _("  -V            : show version\n"));
   fprintf (fp, _("  -h            : show usage\n"));
   fprintf (fp, _("\n"));
@@ -91,12 +288,39 @@ print_usage (FILE * fp, int argc, char *const argv[])
 	   _
 	   ("        to wait forever writing for read position on the file.\n"));
   fprintf (fp, _("\n"));
-  fprintf (fp, _("  NOTE: < and > must escape or quote on shell.\n"));
+  fprintf (fp, _("Pipeline:\n"));
+  fprintf (fp, _("  cmd1 | cmd2   : connect output of cmd1 to input of cmd2\n"));
+  fprintf (fp,
+	   _
+	   ("  cmd1 & cmd2   : feed same input to cmd1 and cmd2 (cmd2 writes --tee file)\n"));
+  fprintf (fp, _("\n"));
+  fprintf (fp, _("Builtin commands:\n"));
+  fprintf (fp,
+	   _
+	   ("  :gzip [-1..-9] [-d]             : gzip (:gunzip and :zcat decompress)\n"));
+  fprintf (fp,
+	   _
+	   ("  :zstd [-1..-19] [-d] [-T threads] : zstd (:unzstd and :zstdcat decompress)\n"));
+  fprintf (fp,
+	   _
+	   ("  :tr [-d] set1 [set2]            : translate or delete bytes as tr\n"));
+  fprintf (fp,
+	   _
+	   ("  :dos2unix                       : convert CRLF to LF\n"));
+  fprintf (fp,
+	   _
+	   ("  :grep [-v] string               : lines containing fixed string\n"));
+  fprintf (fp, _("\n"));
+  fprintf (fp, _("  NOTE: <, >, | and & must escape or quote on shell.\n"));
   fprintf (fp, _("    example:\n"));
   fprintf (fp,
 	   _
 	   ("      %s -p -r hugefile.txt.gz gzip -c '<hugefile.txt' \\> hugefile.txt\n"),
 	   argv[0]);
+  fprintf (fp,
+	   _
+	   ("      %s -p -r hugefile.txt.zst :zstd -T 4 '<hugefile.txt' \\> hugefile.txt\n"),
+	   argv[0]);
   fprintf (fp, _("\n"));
   fprintf (fp,
 	   _
@@ -152,98 +376,866 @@ getrelative (const char *path)
   return path;
 }
 
-static void pump_read_write (int[2], off_t, size_t) __attribute__((noreturn));
+// Parse size with optional K, M or G suffix (power of 1024).
+static int
+parse_size (const char *str, size_t *size)
+{
+  char *end;
+  errno = 0;
+  if (!isdigit (*str))
+    return -1;
+  uintmax_t value = strtoumax (str, &end, 10);
+  if (errno != 0)
+    return -1;
+  int shift = 0;
+  switch (*end)
+    {
+    case 'k':
+    case 'K':
+      shift = 10;
+      end++;
+      break;
+    case 'm':
+    case 'M':
+      shift = 20;
+      end++;
+      break;
+    case 'g':
+    case 'G':
+      shift = 30;
+      end++;
+      break;
+    }
+  if (*end != '\0' || value > (SIZE_MAX >> shift))
+    return -1;
+  *size = value << shift;
+  return 0;
+}
+
+// Page cache policy of a regular input or output file.  Readahead is
+// requested ahead of the position, and the page cache behind it is
+// dropped after the write back.  In direct mode, aligned transfers go
+// through another descriptor opened with O_DIRECT.
+enum cache_policy
+{
+  CACHE_NORMAL,
+  CACHE_SEQUENTIAL,
+  CACHE_DONTNEED,
+  CACHE_DIRECT,
+};
+
+// Atomic replacement of the output: the output is written to a
+// temporary file, and renamed over the output file, or exchanged with it.
+enum atomic_mode
+{
+  ATOMIC_NONE,
+  ATOMIC_RENAME,
+  ATOMIC_EXCHANGE,
+};
+
+static uint64_t
+clock_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Holes of a regular input file passed to the command: read from the
+// file system, made of zeros without reading, or skipped altogether.
+enum holes_policy
+{
+  HOLES_READ,
+  HOLES_ZERO,
+  HOLES_SKIP,
+};
+
+struct cache
+{
+  int policy;
+  int fd;
+  int dfd;
+  int write;
+  off_t done;
+  off_t drop;
+};
+
+static void
+cache_init (struct cache *c, int fd, int write, int policy, off_t pos)
+{
+  struct stat st;
+  c->fd = fd;
+  c->dfd = -1;
+  c->write = write;
+  c->policy = fstat (fd, &st) == 0 && S_ISREG (st.st_mode)
+    ? policy : CACHE_NORMAL;
+  c->done = pos;
+  c->drop = pos;
+  if (c->policy == CACHE_DIRECT)
+    {
+      char path[32];
+      int flags = fcntl (fd, F_GETFL);
+      snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);
+      if (flags != -1)
+	c->dfd = open (path, (flags & (O_ACCMODE | O_APPEND)) | O_DIRECT
+		       | O_CLOEXEC);
+      // e.g. the file system does not support O_DIRECT
+      if (c->dfd == -1)
+	c->policy = CACHE_DONTNEED;
+    }
+  if (!write && c->policy != CACHE_NORMAL && c->policy != CACHE_DIRECT)
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+static void
+cache_close (struct cache *c)
+{
+  if (c->dfd != -1)
+    close (c->dfd);
+  c->dfd = -1;
+}
+
+// The file position moved to pos.
+static void
+cache_update (struct cache *c, off_t pos)
+{
+  if (c->policy == CACHE_NORMAL)
+    return;
+  if (!c->write)
+    {
+      if (c->policy != CACHE_DIRECT && pos + CACHE_WINDOW > c->done)
+	{
+	  off_t start = c->done > pos ? c->done : pos;
+	  c->done = pos + CACHE_WINDOW * 2;
+	  posix_fadvise (c->fd, start, c->done - start, POSIX_FADV_WILLNEED);
+	}
+      if (c->policy != CACHE_SEQUENTIAL && pos - c->drop >= CACHE_WINDOW)
+	{
+	  off_t end = pos - pos % CACHE_WINDOW;
+	  posix_fadvise (c->fd, c->drop, end - c->drop, POSIX_FADV_DONTNEED);
+	  c->drop = end;
+	}
+      return;
+    }
+  if (c->policy == CACHE_SEQUENTIAL || pos - c->done < CACHE_WINDOW)
+    return;
+  // start the write back of the last window, and drop the one before
+  sync_file_range (c->fd, c->done, pos - c->done, SYNC_FILE_RANGE_WRITE);
+  if (c->done > c->drop)
+    {
+      sync_file_range (c->fd, c->drop, c->done - c->drop,
+		       SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+		       | SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise (c->fd, c->drop, c->done - c->drop, POSIX_FADV_DONTNEED);
+      c->drop = c->done;
+    }
+  c->done = pos;
+}
+
+// Read or write at pos in direct mode.  Aligned blocks go through the
+// O_DIRECT descriptor, and unaligned parts through the page cache up to
+// the next block boundary.
+static ssize_t
+cache_io (struct cache *c, struct iovec *iov, int iovcnt, off_t pos)
+{
+  int fd = c->fd;
+  size_t skew = pos % DIRECT_ALIGN;
+  if (c->dfd != -1 && skew == 0
+      && (uintptr_t) iov[0].iov_base % DIRECT_ALIGN == 0
+      && iov[0].iov_len >= DIRECT_ALIGN)
+    {
+      fd = c->dfd;
+      iovcnt = 1;
+      iov[0].iov_len -= iov[0].iov_len % DIRECT_ALIGN;
+    }
+  else if (c->dfd != -1 && skew != 0)
+    {
+      size_t room = DIRECT_ALIGN - skew;
+      for (int i = 0; i < iovcnt; i++)
+	{
+	  if (iov[i].iov_len >= room)
+	    {
+	      iov[i].iov_len = room;
+	      iovcnt = i + 1;
+	      break;
+	    }
+	  room -= iov[i].iov_len;
+	}
+    }
+  ssize_t sz = c->write ? pwritev (fd, iov, iovcnt, pos)
+    : preadv (fd, iov, iovcnt, pos);
+  if (sz == -1 && errno == EINVAL && fd == c->dfd)
+    {
+      // the alignment of the device is larger
+      cache_close (c);
+      return cache_io (c, iov, iovcnt, pos);
+    }
+  return sz;
+}
+
+// Token buckets limiting the bytes and operations per second of the
+// reads (0) and writes (1) of the files.  Tokens accrue up to one second
+// of the rate; an I/O is cut to a tenth of a second of it, waits while
+// the bucket is in debt, and takes its size and one operation afterwards.
+// The rates are reloaded from the rate file when it is modified or on
+// SIGHUP.
+struct rate
+{
+  uint64_t bytes;
+  uint64_t ops;
+  double btokens;
+  double otokens;
+  uint64_t last;
+};
+
+static struct rate rates[2];
+static const char *rate_file;
+static struct timespec rate_mtime;
+static uint64_t rate_checked;
+static int rate_verbose;
+static volatile sig_atomic_t rate_signaled;
+
+// Parse rate of size[/ops].
+static int
+parse_rate (const char *str, size_t *bytes, size_t *ops)
+{
+  char buf[64];
+  const char *slash = strchr (str, '/');
+  size_t len = slash == NULL ? strlen (str) : (size_t) (slash - str);
+  if (len >= sizeof (buf))
+    return -1;
+  memcpy (buf, str, len);
+  buf[len] = '\0';
+  *bytes = 0;
+  *ops = 0;
+  if (len > 0 && parse_size (buf, bytes) == -1)
+    return -1;
+  if (slash != NULL)
+    {
+      char *end;
+      errno = 0;
+      unsigned long long n = strtoull (slash + 1, &end, 10);
+      if (errno != 0 || end == slash + 1 || *end != '\0' || n > SIZE_MAX)
+	return -1;
+      *ops = n;
+    }
+  return 0;
+}
+
+static int
+rate_limited (const struct opt *opt)
+{
+  return opt->rate_file != NULL || opt->rate_bytes[0] != 0
+    || opt->rate_ops[0] != 0 || opt->rate_bytes[1] != 0
+    || opt->rate_ops[1] != 0;
+}
+
+static void
+rate_handler (int sig)
+{
+  (void) sig;
+  rate_signaled = 1;
+}
+
+static void
+rate_set (int i, size_t bytes, size_t ops)
+{
+  rates[i].bytes = bytes;
+  rates[i].ops = ops;
+  rates[i].btokens = bytes;
+  rates[i].otokens = ops;
+  rates[i].last = clock_ns ();
+  if (rate_verbose)
+    fprintf (stderr, _("rate: %s %zu bytes/%zu ops per second\n"),
+	     i == 0 ? _("read") : _("write"), bytes, ops);
+}
+
+// Load the rate file of lines of read=size[/ops] and write=size[/ops],
+// where 0 is no limit.  A broken file keeps the current rates.
+static void
+rate_load (void)
+{
+  FILE *fp = fopen (rate_file, "r");
+  if (fp == NULL)
+    {
+      perror (rate_file);
+      return;
+    }
+  struct stat st;
+  if (fstat (fileno (fp), &st) == 0)
+    rate_mtime = st.st_mtim;
+  size_t bytes[2] = { rates[0].bytes, rates[1].bytes };
+  size_t ops[2] = { rates[0].ops, rates[1].ops };
+  char line[256];
+  int lineno = 0;
+  while (fgets (line, sizeof (line), fp) != NULL)
+    {
+      lineno++;
+      line[strcspn (line, "\r\n")] = '\0';
+      char *s = line + strspn (line, " \t");
+      if (*s == '\0' || *s == '#')
+	continue;
+      int i = strncmp (s, "read=", 5) == 0 ? 0
+	: strncmp (s, "write=", 6) == 0 ? 1 : -1;
+      if (i == -1 || parse_rate (s + 5 + i, &bytes[i], &ops[i]) == -1)
+	{
+	  fprintf (stderr, _("%s:%d: invalid rate: %s\n"), rate_file, lineno,
+		   s);
+	  fclose (fp);
+	  return;
+	}
+    }
+  fclose (fp);
+  for (int i = 0; i < 2; i++)
+    if (bytes[i] != rates[i].bytes || ops[i] != rates[i].ops)
+      rate_set (i, bytes[i], ops[i]);
+}
+
+static void
+rate_init (const struct opt *opt)
+{
+  rate_verbose = opt->verbose;
+  for (int i = 0; i < 2; i++)
+    if (opt->rate_bytes[i] != 0 || opt->rate_ops[i] != 0)
+      rate_set (i, opt->rate_bytes[i], opt->rate_ops[i]);
+  if (opt->rate_file == NULL)
+    return;
+  rate_file = opt->rate_file;
+  rate_load ();
+  rate_checked = clock_ns ();
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = rate_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+  if (sigaction (SIGHUP, &sa, NULL) == -1)
+    {
+      perror ("sigaction");
+      exit (EXIT_FAILURE);
+    }
+}
+
+// Reload the rate file on SIGHUP, or once a second if it is modified.
+static void
+rate_check (void)
+{
+  if (rate_file == NULL)
+    return;
+  uint64_t now = clock_ns ();
+  if (!rate_signaled && now - rate_checked < 1000000000)
+    return;
+  rate_checked = now;
+  struct stat st;
+  if (rate_signaled || (stat (rate_file, &st) == 0
+			&& (st.st_mtim.tv_sec != rate_mtime.tv_sec
+			    || st.st_mtim.tv_nsec != rate_mtime.tv_nsec)))
+    {
+      rate_signaled = 0;
+      rate_load ();
+    }
+}
+
+// Size of an I/O of size bytes in direction i: a tenth of a second of
+// the rate in blocks.
+static size_t
+rate_size (int i, size_t size)
+{
+  size_t max = rates[i].bytes / 10 / DIRECT_ALIGN * DIRECT_ALIGN;
+  if (rates[i].bytes == 0)
+    return size;
+  if (max < DIRECT_ALIGN)
+    max = DIRECT_ALIGN;
+  return size < max ? size : max;
+}
+
+// Wait until the bucket of direction i is out of debt.
+static void
+rate_wait (int i)
+{
+  rate_check ();
+  struct rate *rt = &rates[i];
+  while (rt->bytes != 0 || rt->ops != 0)
+    {
+      uint64_t now = clock_ns ();
+      double elapsed = (now - rt->last) / 1e9;
+      rt->last = now;
+      rt->btokens += elapsed * rt->bytes;
+      if (rt->btokens > rt->bytes)
+	rt->btokens = rt->bytes;
+      rt->otokens += elapsed * rt->ops;
+      if (rt->otokens > rt->ops)
+	rt->otokens = rt->ops;
+      double wait = 0;
+      if (rt->bytes != 0 && rt->btokens < 0)
+	wait = -rt->btokens / rt->bytes;
+      if (rt->ops != 0 && rt->otokens < 1 && (1 - rt->otokens) / rt->ops > wait)
+	wait = (1 - rt->otokens) / rt->ops;
+      if (wait <= 0)
+	return;
+      struct timespec ts = {
+	.tv_sec = (time_t) wait,
+	.tv_nsec = (long) ((wait - (time_t) wait) * 1e9),
+      };
+      nanosleep (&ts, NULL);
+      rate_check ();
+    }
+}
+
+// An I/O of size bytes is done in direction i.
+static void
+rate_take (int i, ssize_t size)
+{
+  if (size <= 0)
+    return;
+  rates[i].btokens -= size;
+  rates[i].otokens -= 1;
+}
+
+// Checksums of the bytes read from the input file (0) and written to the
+// output file (1), taken by the relay or the copy as they pass, so that
+// the files need not be read again to verify them.  The digests are
+// reported, and stored as extended attributes of the output on request,
+// when the output is finished.
+static struct checksum sums[2];
+static int sum_enabled;
+
+static void
+sum_init (const struct opt *opt)
+{
+  if (opt->checksum == -1)
+    return;
+  for (int i = 0; i < 2; i++)
+    {
+      sums[i].kind = opt->checksum;
+      if (checksum_init (&sums[i]) == -1)
+	{
+	  fprintf (stderr, _("checksum: %s\n"), sums[i].error);
+	  exit (EXIT_FAILURE);
+	}
+    }
+  sum_enabled = 1;
+}
+
+static void
+sum_update (int i, const void *buf, ssize_t size)
+{
+  if (sum_enabled && size > 0)
+    checksum_update (&sums[i], buf, size);
+}
+
+// The first size bytes of the iovecs are read or written in direction i.
+static void
+sum_iov (int i, const struct iovec *iov, int iovcnt, ssize_t size)
+{
+  for (int k = 0; k < iovcnt && size > 0; k++)
+    {
+      size_t len = iov[k].iov_len < (size_t) size ? iov[k].iov_len
+	: (size_t) size;
+      sum_update (i, iov[k].iov_base, len);
+      size -= len;
+    }
+}
+
+// A hole of size bytes is passed in direction i without reading it.
+static void
+sum_zeros (int i, off_t size)
+{
+  static const char zeros[BUFSIZ];
+  for (; size > 0 && sum_enabled; size -= BUFSIZ)
+    sum_update (i, zeros, size < BUFSIZ ? (size_t) size : BUFSIZ);
+}
+
+// Report the digests, and store them on the output file fd.
+static void
+sum_finish (const struct opt *opt, int fd)
+{
+  if (!sum_enabled)
+    return;
+  sum_enabled = 0;
+  const char *kind = checksum_name (opt->checksum);
+  for (int i = 0; i < 2; i++)
+    {
+      char hex[CHECKSUM_HEX];
+      checksum_final (&sums[i], hex);
+      const char *file = i == 0 ? opt->file_input : opt->file_output;
+      fprintf (stderr, _("checksum: %s %s %s (%s)\n"), kind, hex,
+	       file == NULL ? (i == 0 ? _("<stdin>") : _("<stdout>"))
+	       : getrelative (file), i == 0 ? _("input") : _("output"));
+      if (!opt->checksum_xattr)
+	continue;
+      char name[64];
+      snprintf (name, sizeof (name), "user.ow.%s.%s", kind,
+		i == 0 ? "input" : "output");
+      if (fsetxattr (fd, name, hex, strlen (hex), 0) == -1)
+	perror (name);
+    }
+}
+
+// Position of the descriptor, or 0 if it is not seekable.
+static off_t
+pump_pos (int fd)
+{
+  off_t pos = lseek (fd, 0, SEEK_CUR);
+  return pos == -1 ? 0 : pos;
+}
 
 static void
-pump_read_write (int fds[2], off_t size, size_t size_buf)
+pump_read_write (int fds[2], off_t size, size_t size_buf,
+		 struct cache cache[2])
 {
-  char buf[size_buf];
+  char *buf;
+  int ret = posix_memalign ((void **) &buf, DIRECT_ALIGN, size_buf);
+  if (ret != 0)
+    {
+      errno = ret;
+      perror ("posix_memalign");
+      exit (EXIT_FAILURE);
+    }
+  int direct = cache[0].policy == CACHE_DIRECT
+    || cache[1].policy == CACHE_DIRECT;
+  off_t pos[2] = { pump_pos (fds[0]), pump_pos (fds[1]) };
   off_t size_transfered = 0;
   while (size_transfered < size)
     {
       size_t size_to_read =
 	size - size_transfered > size_buf ? size_buf : size - size_transfered;
       if (size_to_read == 0)
-	exit (EXIT_SUCCESS);
-      ssize_t size_read = read (fds[0], buf, size_to_read);
+	break;
+      size_to_read = rate_size (0, size_to_read);
+      rate_wait (0);
+      struct iovec iov = {.iov_base = buf,.iov_len = size_to_read };
+      ssize_t size_read = cache[0].policy == CACHE_DIRECT
+	? cache_io (&cache[0], &iov, 1, pos[0]) : read (fds[0], buf,
+							size_to_read);
       if (size_read == -1)
 	{
 	  perror ("read");
 	  exit (EXIT_FAILURE);
 	}
       if (size_read == 0)
-	exit (EXIT_SUCCESS);
-      ssize_t size_written = write (fds[1], buf, size_read);
-      if (size_written == -1)
+	break;
+      rate_take (0, size_read);
+      sum_update (0, buf, size_read);
+      pos[0] += size_read;
+      cache_update (&cache[0], pos[0]);
+      for (ssize_t done = 0; done < size_read;)
 	{
-	  perror ("write");
-	  exit (EXIT_FAILURE);
+	  iov.iov_base = buf + done;
+	  iov.iov_len = rate_size (1, size_read - done);
+	  rate_wait (1);
+	  ssize_t size_written = cache[1].policy == CACHE_DIRECT
+	    ? cache_io (&cache[1], &iov, 1, pos[1])
+	    : write (fds[1], iov.iov_base, iov.iov_len);
+	  if (size_written == -1)
+	    {
+	      perror ("write");
+	      exit (EXIT_FAILURE);
+	    }
+	  rate_take (1, size_written);
+	  sum_update (1, iov.iov_base, size_written);
+	  done += size_written;
+	  pos[1] += size_written;
 	}
-      size_transfered += size_written;
+      cache_update (&cache[1], pos[1]);
+      size_transfered += size_read;
     }
-  exit (EXIT_SUCCESS);
+  // the descriptors are shared with the parent of the command
+  if (direct)
+    {
+      lseek (fds[0], pos[0], SEEK_SET);
+      lseek (fds[1], pos[1], SEEK_SET);
+    }
+  free (buf);
+}
+
+// Size of a transfer in the kernel: a window of the page cache policy,
+// within the rates of both files.  It waits for the rates.
+static size_t
+pump_window (const struct cache cache[2], size_t size)
+{
+  rate_wait (0);
+  rate_wait (1);
+  size = rate_size (0, rate_size (1, size));
+  if (cache[0].policy == CACHE_NORMAL && cache[1].policy == CACHE_NORMAL)
+    return size;
+  return size > CACHE_WINDOW ? CACHE_WINDOW : size;
 }
 
-static void pump_splice (int[2], off_t) __attribute__((noreturn));
+// A transfer in the kernel of size bytes is done.
+static void
+pump_take (ssize_t size)
+{
+  rate_take (0, size);
+  rate_take (1, size);
+}
 
 static void
-pump_splice (int fds[2], off_t size)
+pump_splice (int fds[2], off_t size, struct cache cache[2])
 {
+  off_t pos[2] = { pump_pos (fds[0]), pump_pos (fds[1]) };
   off_t size_transfered = 0;
   while (size_transfered < size)
     {
       size_t size_to_splice =
 	size - size_transfered > SIZE_MAX ? SIZE_MAX : size - size_transfered;
       if (size_to_splice == 0)
-	exit (EXIT_SUCCESS);
+	return;
       ssize_t size_spliced =
-	splice (fds[0], NULL, fds[1], NULL, size_to_splice, 0);
+	splice (fds[0], NULL, fds[1], NULL,
+		pump_window (cache, size_to_splice), 0);
       if (size_spliced == -1)
 	{
 	  perror ("splice");
 	  exit (EXIT_FAILURE);
 	}
       if (size_spliced == 0)
-	exit (EXIT_SUCCESS);
+	return;
+      pump_take (size_spliced);
       size_transfered += size_spliced;
+      for (int i = 0; i < 2; i++)
+	cache_update (&cache[i], pos[i] += size_spliced);
     }
-  exit (EXIT_SUCCESS);
 }
 
-static void pump_sendfile (int[2], off_t) __attribute__((noreturn));
-
 static void
-pump_sendfile (int fds[2], off_t size)
+pump_sendfile (int fds[2], off_t size, struct cache cache[2])
 {
+  off_t pos[2] = { pump_pos (fds[0]), pump_pos (fds[1]) };
   off_t size_transfered = 0;
   while (size_transfered < size)
     {
       size_t size_to_send =
 	size - size_transfered > SIZE_MAX ? SIZE_MAX : size - size_transfered;
       if (size_to_send == 0)
-	exit (EXIT_SUCCESS);
-      ssize_t size_sent = sendfile (fds[1], fds[0], NULL, size_to_send);
+	return;
+      ssize_t size_sent =
+	sendfile (fds[1], fds[0], NULL, pump_window (cache, size_to_send));
       if (size_sent == -1)
 	{
 	  perror ("sendfile");
 	  exit (EXIT_FAILURE);
 	}
       if (size_sent == 0)
-	exit (EXIT_SUCCESS);
+	return;
+      pump_take (size_sent);
       size_transfered += size_sent;
+      for (int i = 0; i < 2; i++)
+	cache_update (&cache[i], pos[i] += size_sent);
     }
-  exit (EXIT_SUCCESS);
 }
 
-static void pump (int[2]) __attribute__((noreturn));
+// Errors of copy_file_range and clone when the files or the file system
+// do not support them.
+static int
+pump_unsupported (int err)
+{
+  return err == EXDEV || err == EOPNOTSUPP || err == ENOSYS || err == EINVAL
+    || err == EBADF || err == ENOTTY;
+}
 
-static void
-pump (int fds[2])
+// Copy in the kernel (or by server side copy or reflink of the file
+// system).  Returns -1 when nothing is copied because it is not supported.
+static int
+pump_copy_file_range (int fds[2], off_t size, struct cache cache[2])
 {
-  struct stat st[2];
-  if (fstat (fds[0], st + 0) == -1)
+  off_t pos[2] = { pump_pos (fds[0]), pump_pos (fds[1]) };
+  off_t size_transfered = 0;
+  while (size_transfered < size)
     {
-      perror ("fstat");
+      // the file position plus size must not overflow
+      size_t size_to_copy =
+	size - size_transfered > COPY_CHUNK ? COPY_CHUNK
+	: size - size_transfered;
+      ssize_t size_copied = copy_file_range (fds[0], NULL, fds[1], NULL,
+					     pump_window (cache, size_to_copy),
+					     0);
+      if (size_copied == -1)
+	{
+	  if (size_transfered == 0 && pump_unsupported (errno))
+	    return -1;
+	  perror ("copy_file_range");
+	  exit (EXIT_FAILURE);
+	}
+      if (size_copied == 0)
+	return 0;
+      pump_take (size_copied);
+      size_transfered += size_copied;
+      for (int i = 0; i < 2; i++)
+	cache_update (&cache[i], pos[i] += size_copied);
+    }
+  return 0;
+}
+
+// Share the extents of the rest of the input file with the output file.
+// Returns -1 when the file system cannot clone them.
+static int
+pump_clone (int fds[2], off_t size)
+{
+  off_t ipos = lseek (fds[0], 0, SEEK_CUR);
+  off_t opos = lseek (fds[1], 0, SEEK_CUR);
+  if (ipos == -1 || opos == -1)
+    return -1;
+  struct file_clone_range range = {
+    .src_fd = fds[0],
+    .src_offset = ipos,
+    .src_length = size == OFF_MAX ? 0 : size,
+    .dest_offset = opos,
+  };
+  int ret = ipos == 0 && opos == 0 && size == OFF_MAX
+    ? ioctl (fds[1], FICLONE, fds[0]) : ioctl (fds[1], FICLONERANGE, &range);
+  if (ret == -1)
+    {
+      if (pump_unsupported (errno))
+	return -1;
+      perror ("ioctl(..., FICLONE)");
+      exit (EXIT_FAILURE);
+    }
+  return 0;
+}
+
+// Buffer size of read and write: the capacity of the pipe if any.
+static size_t
+pump_bufsize (int fds[2])
+{
+  size_t size = PIPE_BUF;
+  for (int i = 0; i < 2; i++)
+    {
+      int ret = fcntl (fds[i], F_GETPIPE_SZ);
+      if (ret != -1 && (size_t) ret > size)
+	size = ret;
+    }
+  return size;
+}
+
+// Transfer size bytes with the fastest way for the files.
+static void
+pump_data (int fds[2], const struct stat st[2], off_t size, int append,
+	   int copy, size_t size_buf, struct cache cache[2])
+{
+  int direct = cache[0].policy == CACHE_DIRECT
+    || cache[1].policy == CACHE_DIRECT;
+  // the checksums are taken from the buffer
+  if (append || direct || sum_enabled)
+    pump_read_write (fds, size, size_buf, cache);
+  else if (copy && pump_copy_file_range (fds, size, cache) == 0)
+    ;
+  else if (S_ISREG (st[0].st_mode))
+    pump_sendfile (fds, size, cache);
+  else if (S_ISFIFO (st[0].st_mode) || S_ISFIFO (st[1].st_mode))
+    pump_splice (fds, size, cache);
+  else
+    pump_read_write (fds, size, size_buf, cache);
+}
+
+// Make a hole of len bytes at pos in the output file.  Past its end,
+// seeking or extending the file is enough; old data is punched out, or
+// overwritten with zeros when the file system cannot punch.
+static void
+pump_hole (int fd, off_t pos, off_t len, int append)
+{
+  struct stat st;
+  if (fstat (fd, &st) == -1)
+    {
+      perror ("fstat");
+      exit (EXIT_FAILURE);
+    }
+  off_t old = st.st_size - pos < len ? st.st_size - pos : len;
+  if (old > 0
+      && fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos,
+		    old) == -1)
+    {
+      static const char zeros[BUFSIZ];
+      for (off_t off = 0; off < old;)
+	{
+	  size_t size = old - off < (off_t) sizeof zeros ? (size_t) (old - off)
+	    : sizeof zeros;
+	  ssize_t wsize = pwrite (fd, zeros, size, pos + off);
+	  if (wsize == -1)
+	    {
+	      perror ("pwrite");
+	      exit (EXIT_FAILURE);
+	    }
+	  off += wsize;
+	}
+    }
+  if (append ? pos + len > st.st_size && ftruncate (fd, pos + len) == -1
+      : lseek (fd, pos + len, SEEK_SET) == -1)
+    {
+      perror (append ? "ftruncate" : "lseek");
+      exit (EXIT_FAILURE);
+    }
+}
+
+// Transfer the data segments of the input file, and make holes in the
+// output file instead of writing zeros.  Returns -1 when the input has no
+// holes.
+static int
+pump_sparse (int fds[2], const struct stat st[2], off_t size, int append,
+	     int copy, size_t size_buf, struct cache cache[2])
+{
+  off_t ipos = pump_pos (fds[0]);
+  off_t opos = append ? st[1].st_size : pump_pos (fds[1]);
+  off_t end = st[0].st_size - ipos < size ? st[0].st_size : ipos + size;
+  off_t hole = lseek (fds[0], ipos, SEEK_HOLE);
+  if (hole == -1 || hole >= end)
+    {
+      lseek (fds[0], ipos, SEEK_SET);
+      return -1;
+    }
+  while (ipos < end)
+    {
+      off_t data = lseek (fds[0], ipos, SEEK_DATA);
+      if (data == -1 && errno != ENXIO)
+	{
+	  perror ("lseek");
+	  exit (EXIT_FAILURE);
+	}
+      if (data == -1 || data > end)
+	data = end;
+      if (data > ipos)
+	{
+	  pump_hole (fds[1], opos, data - ipos, append);
+	  sum_zeros (0, data - ipos);
+	  sum_zeros (1, data - ipos);
+	  opos += data - ipos;
+	  ipos = data;
+	  if (ipos == end)
+	    break;
+	}
+      hole = lseek (fds[0], ipos, SEEK_HOLE);
+      if (hole == -1 || lseek (fds[0], ipos, SEEK_SET) == -1)
+	{
+	  perror ("lseek");
+	  exit (EXIT_FAILURE);
+	}
+      if (hole > end)
+	hole = end;
+      pump_data (fds, st, hole - ipos, append, copy, size_buf, cache);
+      opos += hole - ipos;
+      ipos = hole;
+    }
+  // a hole at the end
+  struct stat ost;
+  if (fstat (fds[1], &ost) == -1)
+    {
+      perror ("fstat");
+      exit (EXIT_FAILURE);
+    }
+  if (ost.st_size < opos && ftruncate (fds[1], opos) == -1)
+    {
+      perror ("ftruncate");
+      exit (EXIT_FAILURE);
+    }
+  return 0;
+}
+
+static void
+pump (int fds[2], int clone, int policy)
+{
+  struct stat st[2];
+  if (fstat (fds[0], st + 0) == -1)
+    {
+      perror ("fstat");
       exit (EXIT_FAILURE);
     }
   if (fstat (fds[1], st + 1) == -1)
@@ -257,34 +1249,60 @@ pump (int fds[2])
       perror ("fcntl(..., F_GETFL)");
       exit (EXIT_FAILURE);
     }
+  struct cache cache[2];
+  for (int i = 0; i < 2; i++)
+    cache_init (&cache[i], fds[i], i, policy, pump_pos (fds[i]));
   off_t size_to_transfer = OFF_MAX;
   int append = (flags & O_APPEND) != 0;
-  if (S_ISREG (st[0].st_mode) && st[0].st_dev == st[1].st_dev
-      && st[0].st_ino == st[1].st_ino && append)
+  int same = st[0].st_dev == st[1].st_dev && st[0].st_ino == st[1].st_ino;
+  if (S_ISREG (st[0].st_mode) && same && append)
     size_to_transfer = st[0].st_size;
-  if (append)
-    pump_read_write (fds, size_to_transfer, PIPE_BUF);
-  if (S_ISREG (st[0].st_mode))
-    pump_sendfile (fds, size_to_transfer);
-  if (S_ISFIFO (st[0].st_mode) || S_ISFIFO (st[1].st_mode))
-    pump_splice (fds, size_to_transfer);
-  pump_read_write (fds, size_to_transfer, PIPE_BUF);
+  size_t size_buf = pump_bufsize (fds);
+  // the kernel copies go through the page cache
+  int direct = cache[0].policy == CACHE_DIRECT
+    || cache[1].policy == CACHE_DIRECT;
+  if (direct && size_buf < DEFAULT_BUFSIZE * 8)
+    size_buf = DEFAULT_BUFSIZE * 8;
+  int copy = !append && S_ISREG (st[0].st_mode) && S_ISREG (st[1].st_mode)
+    && !same;
+  if (copy && clone && !sum_enabled && st[0].st_dev == st[1].st_dev
+      && pump_clone (fds, size_to_transfer) == 0)
+    ;
+  else if (S_ISREG (st[0].st_mode) && S_ISREG (st[1].st_mode) && !same
+	   && pump_sparse (fds, st, size_to_transfer, append, copy, size_buf,
+			   cache) == 0)
+    ;
+  else
+    pump_data (fds, st, size_to_transfer, append, copy, size_buf, cache);
+  for (int i = 0; i < 2; i++)
+    cache_close (&cache[i]);
 }
 
+// Separator of the pipeline stages.  It replaces "|" in argv, and is
+// identified by address since it may be moved with redirects.
+static char pipe_token[] = "|";
+
 static void
 parse_redirect (int argc, char **argv, struct opt *opt)
 {
   for (int i = 1; i < argc; i++)
     {
-      // _("\\<..."), _("\\>..."), _("\\\\<...") or _("\\\\>...") is escaped argument
+      // _("\\<..."), _("\\>..."), _("\\|..."), _("\\\\<..."), _("\\\\>...") or _("\\\\|...") is escaped argument
       if (argv[i][0] == '\\'
-	  && (argv[i][1] == '<' || argv[i][1] == '>'
+	  && (argv[i][1] == '<' || argv[i][1] == '>' || argv[i][1] == '|'
 	      || (argv[i][1] == '\\'
-		  && (argv[i][2] == '<' || argv[i][2] == '>'))))
+		  && (argv[i][2] == '<' || argv[i][2] == '>'
+		      || argv[i][2] == '|'))))
 	{
 	  argv[i]++;
 	  continue;
 	}
+      // |
+      if (strcmp (argv[i], "|") == 0)
+	{
+	  argv[i] = pipe_token;
+	  continue;
+	}
       // <>>...
       // <>...
       if (argv[i][0] == '<' || argv[i][0] == '>')
@@ -348,7 +1366,7 @@ parse_redirect (int argc, char **argv, struct opt *opt)
 	  if (out)
 	    opt->file_output = file;
 	  memmove (argv + optind + rargc, argv + optind,
-		   sizeof (char *) * (i - optind));
+		   sizeof (char *) * (i + 1 - rargc - optind));
 	  memcpy (argv + optind, rargv, sizeof (char *) * rargc);
 	  optind += rargc;
 	  continue;
@@ -356,12 +1374,57 @@ parse_redirect (int argc, char **argv, struct opt *opt)
     }
 }
 
+enum
+{
+  OPT_STATS = 256,
+  OPT_STATS_INTERVAL,
+  OPT_STATS_FD,
+  OPT_JOURNAL,
+  OPT_JOURNAL_SYNC,
+  OPT_RESUME,
+  OPT_CACHE,
+  OPT_HOLES,
+  OPT_ATOMIC,
+  OPT_PREALLOC,
+  OPT_READ_RATE,
+  OPT_WRITE_RATE,
+  OPT_RATE_FILE,
+  OPT_CHECKSUM,
+  OPT_CHECKSUM_XATTR,
+  OPT_AUTO,
+  OPT_TEE,
+  OPT_EACH,
+};
+
+static const struct option long_options[] = {
+  {"stats", optional_argument, NULL, OPT_STATS},
+  {"stats-interval", required_argument, NULL, OPT_STATS_INTERVAL},
+  {"stats-fd", required_argument, NULL, OPT_STATS_FD},
+  {"journal", required_argument, NULL, OPT_JOURNAL},
+  {"journal-sync", required_argument, NULL, OPT_JOURNAL_SYNC},
+  {"resume", no_argument, NULL, OPT_RESUME},
+  {"cache", required_argument, NULL, OPT_CACHE},
+  {"holes", required_argument, NULL, OPT_HOLES},
+  {"atomic", optional_argument, NULL, OPT_ATOMIC},
+  {"prealloc", optional_argument, NULL, OPT_PREALLOC},
+  {"read-rate", required_argument, NULL, OPT_READ_RATE},
+  {"write-rate", required_argument, NULL, OPT_WRITE_RATE},
+  {"rate-file", required_argument, NULL, OPT_RATE_FILE},
+  {"checksum", required_argument, NULL, OPT_CHECKSUM},
+  {"checksum-xattr", no_argument, NULL, OPT_CHECKSUM_XATTR},
+  {"auto", optional_argument, NULL, OPT_AUTO},
+  {"tee", required_argument, NULL, OPT_TEE},
+  {"each", no_argument, NULL, OPT_EACH},
+  {NULL, 0, NULL, 0},
+};
+
 static void
 parse_options (int argc, char *argv[], struct opt *opt)
 {
   while (1)
     {
-      int c = getopt (argc, argv, "+i:o:f:r:apVh");
+      int c = getopt_long (argc, argv, "+i:o:f:r:aCcpP:b:L:e:sm:j:d:vVh",
+			   long_options, NULL);
       if (c == -1)
 	break;
       switch (c)
@@ -418,6 +1481,24 @@ parse_options (int argc, char *argv[], struct opt *opt)
 	    }
 	  opt->append = 1;
 	  break;
+	case 'C':
+	  if (opt->collapse)
+	    {
+	      fprintf (stderr, _("cannot set collapse mode twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->collapse = 1;
+	  break;
+	case 'c':
+	  if (opt->clone)
+	    {
+	      fprintf (stderr, _("cannot set clone mode twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->clone = 1;
+	  break;
 	case 'p':
 	  if (opt->punchhole)
 	    {
@@ -428,180 +1509,5454 @@ parse_options (int argc, char *argv[], struct opt *opt)
 	    }
 	  opt->punchhole = 1;
 	  break;
-	case 'V':
-	  print_version (stdout);
-	  exit (EXIT_SUCCESS);
-	case 'h':
-	  print_version (stdout);
-	  print_usage (stdout, argc, argv);
-	  exit (EXIT_SUCCESS);
-	default:
-	  print_usage (stderr, argc, argv);
-	  exit (EXIT_FAILURE);
-	}
-    }
-}
-
-static void
-check_stdio (struct opt *opt)
-{
-  // IDENTIFY STDIN / STDOUT
-  struct stat st_stdin;
-  struct stat st_stdout;
-
-  if (fstat (STDIN_FILENO, &st_stdin) == -1)
-    {
-      perror ("fstat");
-      exit (EXIT_FAILURE);
-    }
-  if (fstat (STDOUT_FILENO, &st_stdout) == -1)
-    {
-      perror ("fstat");
-      exit (EXIT_FAILURE);
-    }
-  if (S_ISREG (st_stdin.st_mode))
-    {
-      opt->file_input = getfilename (STDIN_FILENO);
-      opt->file_stdin = 1;
-    }
-  if (S_ISREG (st_stdout.st_mode))
-    {
-      opt->file_output = getfilename (STDOUT_FILENO);
-      opt->file_stdin = 1;
-      int flags = fcntl (STDOUT_FILENO, F_GETFL);
-      if (flags == -1)
-	{
-	  perror ("fcntl(STDOUT_FILENO, F_GETFL)");
-	  exit (EXIT_FAILURE);
-	}
-      opt->append = (flags & O_APPEND) != 0;
-    }
-}
-
-static void
-setopenflags (int fd, int flags)
-{
-  int curflags = fcntl (fd, F_GETFL);
-  if (curflags == -1)
-    {
-      perror ("fcntl(..., F_GETFL)\n");
-      exit (EXIT_FAILURE);
-    }
-  curflags |= flags;
-  if (fcntl (fd, F_SETFL, flags) == -1)
-    {
-      perror (_("cannot set append mode on <stdout>\n"));
-      exit (EXIT_FAILURE);
-    }
-}
-
-static void
-open_iofile (struct opt *opt, int fds[2])
-{
-  if (opt->file_input && !opt->file_stdin)
-    {
-      int flags = O_RDONLY | O_CLOEXEC;
-      if (opt->punchhole)
-	{
-	  flags &= ~O_ACCMODE;
-	  flags |= O_RDWR;
-	}
-      fds[0] = open (opt->file_input, flags);
-      if (fds[0] == -1)
-	{
-	  perror (opt->file_input);
-	  exit (EXIT_FAILURE);
-	}
-    }
-  else
-    {
-      fds[0] = STDIN_FILENO;
-      if (opt->punchhole)
-	{
-	  fprintf (stderr,
-		   _("cannot set punchhole mode for outer redirect\n"));
-	  exit (EXIT_FAILURE);
-	}
-    }
-  if (opt->file_output && !opt->file_stdout)
-    {
-      int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
-      if (opt->append)
-	flags |= O_APPEND;
-      fds[1] = open (opt->file_output, flags, 0666);
-      if (fds[1] == -1)
-	{
-	  perror (opt->file_output);
-	  exit (EXIT_FAILURE);
-	}
-    }
-  else
-    {
-      fds[1] = STDOUT_FILENO;
-      if (opt->append)
-	setopenflags (fds[1], O_APPEND);
-    }
-}
-
-int
-main (int argc, char *argv[])
-{
-  setlocale (LC_ALL, "");
-  bindtextdomain (PACKAGE, LOCALEDIR);
-  textdomain (PACKAGE);
-  struct opt opt = OPT_INITIALIZER;
-
-  check_stdio (&opt);
-  parse_redirect (argc, argv, &opt);
-  parse_options (argc, argv, &opt);
-
-  int fds[2];
-  open_iofile (&opt, fds);
-
-  struct stat st[3];
-  if (fstat (fds[0], st + 0) == -1)
-    {
-      perror ("fstat");
-      exit (EXIT_FAILURE);
-    }
-  if (fstat (fds[1], st + 1) == -1)
-    {
-      perror ("fstat");
-      exit (EXIT_FAILURE);
-    }
-  if (opt.file_rename != NULL)
-    {
-      if (!S_ISREG (st[1].st_mode))
-	{
-	  fprintf (stderr, _("cannot rename non regular output\n"));
-	  exit (EXIT_FAILURE);
-	}
-      if (lstat (opt.file_rename, st + 2) == -1)
-	{
-	  if (errno != ENOENT)
+	case 'P':
+	  if (opt->punch_batch != 0)
 	    {
-	      perror ("lstat");
+	      fprintf (stderr,
+		       _("cannot set punchhole batch size twice or more\n"));
+	      print_usage (stderr, argc, argv);
 	      exit (EXIT_FAILURE);
 	    }
-	  char *file = strdup (opt.file_rename);
-	  if (file == NULL)
+	  if (parse_size (optarg, &opt->punch_batch) == -1
+	      || opt->punch_batch == 0 || opt->punch_batch > (uintmax_t) OFF_MAX)
 	    {
-	      perror ("strdup");
+	      fprintf (stderr, _("invalid punchhole batch size: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
 	      exit (EXIT_FAILURE);
 	    }
-	  char *dir = dirname (file);
-	  if (stat (dir, st + 2) == -1)
+	  break;
+	case 'b':
+	  if (opt->bufsize != 0)
 	    {
-	      perror (dir);
+	      fprintf (stderr, _("cannot set buffer size twice or more\n"));
+	      print_usage (stderr, argc, argv);
 	      exit (EXIT_FAILURE);
 	    }
-	  if (!S_ISDIR (st[2].st_mode))
+	  if (parse_size (optarg, &opt->bufsize) == -1 || opt->bufsize == 0)
 	    {
-	      errno = ENOTDIR;
-	      perror (dir);
+	      fprintf (stderr, _("invalid buffer size: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
 	      exit (EXIT_FAILURE);
 	    }
-	  free (dir);
+	  break;
+	case 'L':
+	  if (opt->pipe_max != 0)
+	    {
+	      fprintf (stderr, _("cannot set pipe size limit twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (parse_size (optarg, &opt->pipe_max) == -1 || opt->pipe_max == 0
+	      || opt->pipe_max > INT_MAX)
+	    {
+	      fprintf (stderr, _("invalid pipe size limit: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'e':
+	  if (opt->engine != NULL)
+	    {
+	      fprintf (stderr, _("cannot set engine twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (strcmp (optarg, "auto") != 0 && strcmp (optarg, "select") != 0
+	      && strcmp (optarg, "uring") != 0
+	      && strcmp (optarg, "splice") != 0
+	      && strcmp (optarg, "thread") != 0)
+	    {
+	      fprintf (stderr, _("unknown engine: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->engine = optarg;
+	  break;
+	case 's':
+	  if (opt->spill)
+	    {
+	      fprintf (stderr, _("cannot set spill mode twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->spill = 1;
+	  break;
+	case 'm':
+	  if (opt->spill_memory != 0)
+	    {
+	      fprintf (stderr,
+		       _("cannot set spill memory size twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (parse_size (optarg, &opt->spill_memory) == -1
+	      || opt->spill_memory == 0)
+	    {
+	      fprintf (stderr, _("invalid spill memory size: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'j':
+	  {
+	    if (opt->jobs != 0)
+	      {
+		fprintf (stderr, _("cannot set jobs twice or more\n"));
+		print_usage (stderr, argc, argv);
+		exit (EXIT_FAILURE);
+	      }
+	    char *end;
+	    long jobs = strtol (optarg, &end, 10);
+	    if (!isdigit (*optarg) || *end != '\0' || jobs < 1
+		|| jobs > MAX_JOBS)
+	      {
+		fprintf (stderr, _("invalid jobs: %s\n"), optarg);
+		print_usage (stderr, argc, argv);
+		exit (EXIT_FAILURE);
+	      }
+	    opt->jobs = jobs;
+	  }
+	  break;
+	case 'd':
+	  // an empty delimiter is NUL
+	  if (strlen (optarg) > 1)
+	    {
+	      fprintf (stderr, _("invalid delimiter: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->delim = *optarg;
+	  break;
+	case 'v':
+	  if (opt->verbose)
+	    {
+	      fprintf (stderr, _("cannot set verbose mode twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->verbose = 1;
+	  break;
+	case OPT_STATS:
+	  if (opt->stats != NULL)
+	    {
+	      fprintf (stderr, _("cannot set statistics twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (optarg != NULL && strcmp (optarg, "text") != 0
+	      && strcmp (optarg, "json") != 0)
+	    {
+	      fprintf (stderr, _("unknown statistics format: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->stats = optarg == NULL ? "text" : optarg;
+	  break;
+	case OPT_STATS_INTERVAL:
+	  {
+	    if (opt->stats_interval != 0)
+	      {
+		fprintf (stderr,
+			 _("cannot set statistics interval twice or more\n"));
+		print_usage (stderr, argc, argv);
+		exit (EXIT_FAILURE);
+	      }
+	    char *end;
+	    errno = 0;
+	    opt->stats_interval = strtod (optarg, &end);
+	    if (errno != 0 || *end != '\0' || !(opt->stats_interval > 0))
+	      {
+		fprintf (stderr, _("invalid statistics interval: %s\n"),
+			 optarg);
+		print_usage (stderr, argc, argv);
+		exit (EXIT_FAILURE);
+	      }
+	  }
+	  break;
+	case OPT_STATS_FD:
+	  {
+	    if (opt->stats_fd != -1)
+	      {
+		fprintf (stderr,
+			 _("cannot set statistics descriptor twice or more\n"));
+		print_usage (stderr, argc, argv);
+		exit (EXIT_FAILURE);
+	      }
+	    char *end;
+	    long fd = strtol (optarg, &end, 10);
+	    if (!isdigit (*optarg) || *end != '\0' || fd > INT_MAX
+		|| fcntl (fd, F_GETFD) == -1)
+	      {
+		fprintf (stderr, _("invalid statistics descriptor: %s\n"),
+			 optarg);
+		print_usage (stderr, argc, argv);
+		exit (EXIT_FAILURE);
+	      }
+	    opt->stats_fd = fd;
+	  }
+	  break;
+	case OPT_JOURNAL:
+	  if (opt->journal != NULL)
+	    {
+	      fprintf (stderr, _("cannot set journal file twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->journal = optarg;
+	  break;
+	case OPT_JOURNAL_SYNC:
+	  if (opt->journal_sync != 0)
+	    {
+	      fprintf (stderr,
+		       _("cannot set journal sync size twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (parse_size (optarg, &opt->journal_sync) == -1
+	      || opt->journal_sync == 0
+	      || opt->journal_sync > (uintmax_t) OFF_MAX)
+	    {
+	      fprintf (stderr, _("invalid journal sync size: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_RESUME:
+	  if (opt->resume)
+	    {
+	      fprintf (stderr, _("cannot set resume mode twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->resume = 1;
+	  break;
+	case OPT_CACHE:
+	  if (opt->cache != -1)
+	    {
+	      fprintf (stderr, _("cannot set cache policy twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (strcmp (optarg, "normal") == 0)
+	    opt->cache = CACHE_NORMAL;
+	  else if (strcmp (optarg, "sequential") == 0)
+	    opt->cache = CACHE_SEQUENTIAL;
+	  else if (strcmp (optarg, "dontneed") == 0)
+	    opt->cache = CACHE_DONTNEED;
+	  else if (strcmp (optarg, "direct") == 0)
+	    opt->cache = CACHE_DIRECT;
+	  else
+	    {
+	      fprintf (stderr, _("unknown cache policy: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_HOLES:
+	  if (opt->holes != -1)
+	    {
+	      fprintf (stderr, _("cannot set holes policy twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (strcmp (optarg, "read") == 0)
+	    opt->holes = HOLES_READ;
+	  else if (strcmp (optarg, "zero") == 0)
+	    opt->holes = HOLES_ZERO;
+	  else if (strcmp (optarg, "skip") == 0)
+	    opt->holes = HOLES_SKIP;
+	  else
+	    {
+	      fprintf (stderr, _("unknown holes policy: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_ATOMIC:
+	  if (opt->atomic != -1)
+	    {
+	      fprintf (stderr, _("cannot set atomic mode twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (optarg == NULL || strcmp (optarg, "rename") == 0)
+	    opt->atomic = ATOMIC_RENAME;
+	  else if (strcmp (optarg, "exchange") == 0)
+	    opt->atomic = ATOMIC_EXCHANGE;
+	  else
+	    {
+	      fprintf (stderr, _("unknown atomic mode: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_PREALLOC:
+	  if (opt->prealloc)
+	    {
+	      fprintf (stderr, _("cannot set preallocation twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (optarg != NULL && (parse_size (optarg, &opt->prealloc_size) == -1
+				 || opt->prealloc_size == 0))
+	    {
+	      fprintf (stderr, _("invalid preallocation size: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->prealloc = 1;
+	  break;
+	case OPT_READ_RATE:
+	case OPT_WRITE_RATE:
+	  {
+	    int i = c == OPT_WRITE_RATE;
+	    if (opt->rate_bytes[i] != 0 || opt->rate_ops[i] != 0)
+	      {
+		fprintf (stderr, _("cannot set %s rate twice or more\n"),
+			 i == 0 ? "read" : "write");
+		print_usage (stderr, argc, argv);
+		exit (EXIT_FAILURE);
+	      }
+	    if (parse_rate (optarg, &opt->rate_bytes[i], &opt->rate_ops[i]) ==
+		-1 || (opt->rate_bytes[i] == 0 && opt->rate_ops[i] == 0))
+	      {
+		fprintf (stderr, _("invalid rate: %s\n"), optarg);
+		print_usage (stderr, argc, argv);
+		exit (EXIT_FAILURE);
+	      }
+	  }
+	  break;
+	case OPT_RATE_FILE:
+	  if (opt->rate_file != NULL)
+	    {
+	      fprintf (stderr, _("cannot set rate file twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->rate_file = optarg;
+	  break;
+	case OPT_CHECKSUM:
+	  if (opt->checksum != -1)
+	    {
+	      fprintf (stderr, _("cannot set checksum twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  for (int k = CHECKSUM_CRC32C; k <= CHECKSUM_SHA256; k++)
+	    if (strcmp (optarg, checksum_name (k)) == 0)
+	      opt->checksum = k;
+	  if (opt->checksum == -1)
+	    {
+	      fprintf (stderr, _("unknown checksum: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (!checksum_supported (opt->checksum))
+	    {
+	      fprintf (stderr, _("checksum is not supported: %s\n"), optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_CHECKSUM_XATTR:
+	  opt->checksum_xattr = 1;
+	  break;
+	case OPT_AUTO:
+	  if (opt->auto_size != 0)
+	    {
+	      fprintf (stderr, _("cannot set auto mode twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->auto_size = DEFAULT_AUTO_SAMPLE;
+	  if (optarg != NULL && (parse_size (optarg, &opt->auto_size) == -1
+				 || opt->auto_size == 0))
+	    {
+	      fprintf (stderr, _("invalid sample size: %s\n"), optarg);
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case OPT_TEE:
+	  {
+	    const char **files = realloc (opt->tee_output,
+					  sizeof (char *) * (opt->ntee + 1));
+	    if (files == NULL)
+	      {
+		perror ("realloc");
+		exit (EXIT_FAILURE);
+	      }
+	    files[opt->ntee++] = optarg;
+	    opt->tee_output = files;
+	  }
+	  break;
+	case OPT_EACH:
+	  if (opt->each)
+	    {
+	      fprintf (stderr, _("cannot set each mode twice or more\n"));
+	      print_usage (stderr, argc, argv);
+	      exit (EXIT_FAILURE);
+	    }
+	  opt->each = 1;
+	  break;
+	case 'V':
+	  print_version (stdout);
+	  exit (EXIT_SUCCESS);
+	case 'h':
+	  print_version (stdout);
+	  print_usage (stdout, argc, argv);
+	  exit (EXIT_SUCCESS);
+	default:
+	  print_usage (stderr, argc, argv);
+	  exit (EXIT_FAILURE);
+	}
+    }
+  if (opt->stats == NULL && (opt->stats_interval != 0 || opt->stats_fd != -1))
+    opt->stats = "text";
+  if (opt->stats_fd == -1)
+    opt->stats_fd = STDERR_FILENO;
+  if (opt->journal == NULL && (opt->journal_sync != 0 || opt->resume))
+    {
+      fprintf (stderr, _("no journal file specified\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->journal != NULL && (opt->append || opt->punchhole
+				|| opt->collapse))
+    {
+      fprintf (stderr,
+	       _
+	       ("cannot use journal with append, collapse or punchhole mode\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->each && opt->journal != NULL)
+    {
+      fprintf (stderr, _("cannot use journal with each mode\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->each && opt->file_rename != NULL
+      && strstr (opt->file_rename, "{}") == NULL)
+    {
+      fprintf (stderr, _("rename file of each mode must contain {}\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  // collapse mode appends the output after the input
+  if (opt->collapse)
+    opt->append = 1;
+  // the journal records the boundaries of the chunks of parallel mode
+  if (opt->journal != NULL && opt->jobs == 0)
+    opt->jobs = 1;
+  if (opt->journal != NULL && opt->journal_sync == 0)
+    opt->journal_sync = DEFAULT_JOURNAL_SYNC;
+  if (opt->cache == -1)
+    opt->cache = CACHE_NORMAL;
+  if (opt->cache == CACHE_DIRECT && opt->engine != NULL
+      && (strcmp (opt->engine, "uring") == 0
+	  || strcmp (opt->engine, "splice") == 0
+	  || strcmp (opt->engine, "thread") == 0))
+    {
+      fprintf (stderr, _("cannot use direct cache policy with %s engine\n"),
+	       opt->engine);
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->holes == -1)
+    opt->holes = HOLES_READ;
+  if (opt->atomic == -1)
+    opt->atomic = ATOMIC_NONE;
+  // punching the input would break the promise of unchanged files
+  if (opt->atomic != ATOMIC_NONE && (opt->append || opt->collapse
+				     || opt->punchhole
+				     || opt->journal != NULL))
+    {
+      fprintf (stderr,
+	       _
+	       ("cannot use atomic mode with append, collapse, punchhole or journal\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->holes != HOLES_READ && opt->jobs > 0)
+    {
+      fprintf (stderr, _("cannot use holes policy with parallel mode\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  // the splice engine cannot tell skipped input from consumed input
+  if (opt->holes != HOLES_READ && opt->engine != NULL
+      && (strcmp (opt->engine, "uring") == 0
+	  || strcmp (opt->engine, "thread") == 0
+	  || (opt->holes == HOLES_SKIP && strcmp (opt->engine, "splice") == 0)))
+    {
+      fprintf (stderr, _("cannot use %s holes policy with %s engine\n"),
+	       opt->holes == HOLES_ZERO ? "zero" : "skip", opt->engine);
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->auto_size != 0
+      && (opt->spill || opt->atomic != ATOMIC_NONE || opt->append
+	  || opt->jobs > 0))
+    {
+      fprintf (stderr,
+	       _
+	       ("cannot use auto mode with spill, atomic, append, collapse or parallel mode\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->checksum_xattr && opt->checksum == -1)
+    {
+      fprintf (stderr, _("checksum-xattr needs checksum\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  // parallel mode reads the chunks out of order
+  if (opt->checksum != -1 && opt->jobs > 0)
+    {
+      fprintf (stderr, _("cannot use checksum with parallel mode\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->checksum != -1 && opt->engine != NULL
+      && (strcmp (opt->engine, "uring") == 0
+	  || strcmp (opt->engine, "splice") == 0))
+    {
+      fprintf (stderr, _("cannot use checksum with %s engine\n"),
+	       opt->engine);
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  // fan-out duplicates the input in pipes with the splice engine
+  if (opt->ntee > 0
+      && (opt->jobs > 0 || opt->each || opt->spill || opt->auto_size != 0))
+    {
+      fprintf (stderr,
+	       _
+	       ("cannot use fan-out with spill, auto, each, journal or parallel mode\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->ntee > 0
+      && (opt->cache != CACHE_NORMAL || opt->holes != HOLES_READ
+	  || opt->checksum != -1 || rate_limited (opt)))
+    {
+      fprintf (stderr,
+	       _
+	       ("cannot use fan-out with cache or holes policy, checksum or rate limits\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->ntee > 0 && opt->engine != NULL
+      && strcmp (opt->engine, "auto") != 0
+      && strcmp (opt->engine, "splice") != 0)
+    {
+      fprintf (stderr, _("cannot use fan-out with %s engine\n"),
+	       opt->engine);
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (rate_limited (opt) && opt->engine != NULL
+      && (strcmp (opt->engine, "uring") == 0
+	  || strcmp (opt->engine, "splice") == 0
+	  || strcmp (opt->engine, "thread") == 0))
+    {
+      fprintf (stderr, _("cannot use rate limits with %s engine\n"),
+	       opt->engine);
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->bufsize == 0)
+    {
+      const char *env = getenv ("OW_BUFSIZE");
+      if (env != NULL && (parse_size (env, &opt->bufsize) == -1
+			  || opt->bufsize == 0))
+	{
+	  fprintf (stderr, _("invalid buffer size: %s\n"), env);
+	  exit (EXIT_FAILURE);
+	}
+    }
+}
+
+static void
+check_stdio (struct opt *opt)
+{
+  // IDENTIFY STDIN / STDOUT
+  struct stat st_stdin;
+  struct stat st_stdout;
+
+  if (fstat (STDIN_FILENO, &st_stdin) == -1)
+    {
+      perror ("fstat");
+      exit (EXIT_FAILURE);
+    }
+  if (fstat (STDOUT_FILENO, &st_stdout) == -1)
+    {
+      perror ("fstat");
+      exit (EXIT_FAILURE);
+    }
+  if (S_ISREG (st_stdin.st_mode))
+    {
+      opt->file_input = getfilename (STDIN_FILENO);
+      opt->file_stdin = 1;
+    }
+  if (S_ISREG (st_stdout.st_mode))
+    {
+      opt->file_output = getfilename (STDOUT_FILENO);
+      opt->file_stdout = 1;
+      int flags = fcntl (STDOUT_FILENO, F_GETFL);
+      if (flags == -1)
+	{
+	  perror ("fcntl(STDOUT_FILENO, F_GETFL)");
+	  exit (EXIT_FAILURE);
+	}
+      opt->append = (flags & O_APPEND) != 0;
+    }
+}
+
+static void
+setopenflags (int fd, int flags)
+{
+  int curflags = fcntl (fd, F_GETFL);
+  if (curflags == -1)
+    {
+      perror ("fcntl(..., F_GETFL)\n");
+      exit (EXIT_FAILURE);
+    }
+  curflags |= flags;
+  if (fcntl (fd, F_SETFL, flags) == -1)
+    {
+      perror (_("cannot set append mode on <stdout>\n"));
+      exit (EXIT_FAILURE);
+    }
+}
+
+static size_t
+pipe_max_size (void)
+{
+  FILE *fp = fopen ("/proc/sys/fs/pipe-max-size", "r");
+  if (fp == NULL)
+    return DEFAULT_PIPE_MAX;
+  size_t size;
+  if (fscanf (fp, "%zu", &size) != 1 || size == 0 || size > INT_MAX)
+    size = DEFAULT_PIPE_MAX;
+  fclose (fp);
+  return size;
+}
+
+// Set the capacity of the pipe when possible, and return the capacity.
+static size_t
+setpipesize (int fd, size_t size)
+{
+  int ret = fcntl (fd, F_SETPIPE_SZ, size);
+  if (ret == -1)
+    ret = fcntl (fd, F_GETPIPE_SZ);
+  if (ret == -1)
+    {
+      perror ("fcntl(..., F_GETPIPE_SZ)");
+      exit (EXIT_FAILURE);
+    }
+  return ret;
+}
+
+// Builtin commands run in ow itself.  Names start with ':', and the
+// options follow gzip, zstd, tr and grep.
+static const struct
+{
+  const char *name;
+  enum codec_kind kind;
+  int decompress;
+  const char *library;
+} builtins[] = {
+  {":gzip", CODEC_GZIP, 0, "zlib"},
+  {":gunzip", CODEC_GZIP, 1, "zlib"},
+  {":zcat", CODEC_GZIP, 1, "zlib"},
+  {":zstd", CODEC_ZSTD, 0, "libzstd"},
+  {":unzstd", CODEC_ZSTD, 1, "libzstd"},
+  {":zstdcat", CODEC_ZSTD, 1, "libzstd"},
+  {":tr", CODEC_TR, 0, NULL},
+  {":dos2unix", CODEC_CRLF, 0, NULL},
+  {":grep", CODEC_GREP, 0, NULL},
+};
+
+// Parse the options and operands of a builtin filter.
+static void
+parse_filter (char *const argv[], struct codec *c)
+{
+  const char *name = argv[0];
+  int i = 1;
+  for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+    {
+      if (strcmp (argv[i], "--") == 0)
+	{
+	  i++;
+	  break;
+	}
+      for (const char *p = argv[i] + 1; *p != '\0'; p++)
+	{
+	  if (*p == 'd' && c->kind == CODEC_TR)
+	    c->delete = 1;
+	  else if (*p == 'v' && c->kind == CODEC_GREP)
+	    c->invert = 1;
+	  // fixed string is implied
+	  else if (*p != 'F' || c->kind != CODEC_GREP)
+	    {
+	      fprintf (stderr, _("%s: invalid option -- '%c'\n"), name, *p);
+	      exit (EXIT_FAILURE);
+	    }
+	}
+    }
+  int narg = c->kind == CODEC_CRLF ? 0
+    : c->kind == CODEC_GREP || c->delete ? 1 : 2;
+  for (int n = 0; n < narg; n++)
+    {
+      if (argv[i] == NULL)
+	{
+	  fprintf (stderr, _("%s: missing operand\n"), name);
+	  exit (EXIT_FAILURE);
+	}
+      c->arg[n] = argv[i++];
+    }
+  if (argv[i] != NULL)
+    {
+      fprintf (stderr, _("%s: extra operand: %s\n"), name, argv[i]);
+      exit (EXIT_FAILURE);
+    }
+  // check the sets and the string before the files are opened
+  if (codec_init (c) == -1)
+    {
+      fprintf (stderr, "%s: %s\n", name, _(c->error));
+      exit (EXIT_FAILURE);
+    }
+  codec_end (c);
+}
+
+// Parse the builtin command of argv into c.  Returns 0 when argv is not
+// a builtin command.
+static int
+parse_builtin (char *const argv[], struct codec *c)
+{
+  const char *name = argv[0];
+  if (name == NULL || name[0] != ':' || name[1] == '\0')
+    return 0;
+  size_t k = 0;
+  while (k < sizeof (builtins) / sizeof (builtins[0])
+	 && strcmp (builtins[k].name, name) != 0)
+    k++;
+  if (k == sizeof (builtins) / sizeof (builtins[0]))
+    {
+      fprintf (stderr, _("unknown builtin command: %s\n"), name);
+      exit (EXIT_FAILURE);
+    }
+  if (builtins[k].library != NULL && !codec_supported (builtins[k].kind))
+    {
+      fprintf (stderr, _("builtin command is not supported: %s (without %s)\n"),
+	       name, builtins[k].library);
+      exit (EXIT_FAILURE);
+    }
+  memset (c, 0, sizeof (*c));
+  c->kind = builtins[k].kind;
+  c->decompress = builtins[k].decompress;
+  c->level = -1;
+  if (codec_inplace (c->kind))
+    {
+      parse_filter (argv, c);
+      return 1;
+    }
+  long max_level = c->kind == CODEC_GZIP ? 9 : 19;
+  for (int i = 1; argv[i] != NULL; i++)
+    {
+      const char *arg = argv[i];
+      char *end;
+      if (arg[0] != '-' || arg[1] == '\0')
+	{
+	  fprintf (stderr, _("%s: file operand is not supported: %s\n"),
+		   name, arg);
+	  exit (EXIT_FAILURE);
+	}
+      if (isdigit ((unsigned char) arg[1]))
+	{
+	  long level = strtol (arg + 1, &end, 10);
+	  if (*end != '\0' || level < 1 || level > max_level)
+	    {
+	      fprintf (stderr, _("%s: invalid compression level: %s\n"),
+		       name, arg);
+	      exit (EXIT_FAILURE);
+	    }
+	  c->level = level;
+	  continue;
+	}
+      for (const char *p = arg + 1; *p != '\0'; p++)
+	{
+	  // stdout, quiet and keep are implied
+	  if (*p == 'c' || *p == 'q' || *p == 'k')
+	    continue;
+	  if (*p == 'd')
+	    {
+	      c->decompress = 1;
+	      continue;
+	    }
+	  if (*p != 'T' || c->kind != CODEC_ZSTD)
+	    {
+	      fprintf (stderr, _("%s: invalid option -- '%c'\n"), name, *p);
+	      exit (EXIT_FAILURE);
+	    }
+	  const char *t = p[1] != '\0' ? p + 1 : argv[++i];
+	  long threads = t == NULL ? -1 : strtol (t, &end, 10);
+	  if (t == NULL || *t == '\0' || *end != '\0' || threads < 0
+	      || threads > MAX_JOBS)
+	    {
+	      fprintf (stderr, _("%s: invalid number of threads: %s\n"), name,
+		       t == NULL ? "" : t);
+	      exit (EXIT_FAILURE);
+	    }
+	  // 0 is the number of processors as zstd
+	  c->threads = threads == 0 ? sysconf (_SC_NPROCESSORS_ONLN) : threads;
+	  break;
+	}
+    }
+  return 1;
+}
+
+// Run the builtin command between stdin and stdout, as a stage of a
+// pipeline or a command of parallel mode.
+static void run_builtin (char *const[]) __attribute__((noreturn));
+
+static void
+run_builtin (char *const argv[])
+{
+  // close as exec does, or the pipes of other commands never get EOF
+  DIR *dir = opendir ("/proc/self/fd");
+  if (dir != NULL)
+    {
+      struct dirent *ent;
+      while ((ent = readdir (dir)) != NULL)
+	{
+	  int fd = atoi (ent->d_name);
+	  if (fd > STDERR_FILENO && fd != dirfd (dir)
+	      && (fcntl (fd, F_GETFD) & FD_CLOEXEC))
+	    close (fd);
+	}
+      closedir (dir);
+    }
+  struct codec c;
+  parse_builtin (argv, &c);
+  if (codec_init (&c) == -1)
+    {
+      fprintf (stderr, "%s: %s\n", argv[0], c.error);
+      exit (EXIT_FAILURE);
+    }
+  size_t size = DEFAULT_BUFSIZE;
+  char *ibuf = malloc (size);
+  char *obuf = malloc (size);
+  if (ibuf == NULL || obuf == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  size_t ihead = 0;
+  size_t ilen = 0;
+  int ieof = 0;
+  int stalled = 0;
+  int done = 0;
+  while (!done)
+    {
+      // a filter leaves a partial line for the next input
+      if ((ilen == 0 || stalled) && !ieof)
+	{
+	  memmove (ibuf, ibuf + ihead, ilen);
+	  ihead = 0;
+	  if (ilen == size)
+	    {
+	      size *= 2;
+	      if ((ibuf = realloc (ibuf, size)) == NULL
+		  || (obuf = realloc (obuf, size)) == NULL)
+		{
+		  perror ("realloc");
+		  exit (EXIT_FAILURE);
+		}
+	    }
+	  ssize_t sz = read (STDIN_FILENO, ibuf + ilen, size - ilen);
+	  if (sz == -1 && errno == EINTR)
+	    continue;
+	  if (sz == -1)
+	    {
+	      perror ("read");
+	      exit (EXIT_FAILURE);
+	    }
+	  ieof = sz == 0;
+	  ilen += sz;
+	}
+      size_t isize = ilen;
+      size_t osize = size;
+      int ret = codec_step (&c, ibuf + ihead, &isize, obuf, &osize, ieof);
+      if (ret == -1)
+	{
+	  fprintf (stderr, "%s: %s\n", argv[0], c.error);
+	  exit (EXIT_FAILURE);
+	}
+      done = ret;
+      stalled = isize == 0 && osize == 0;
+      ihead += isize;
+      ilen -= isize;
+      for (size_t off = 0; off < osize;)
+	{
+	  ssize_t sz = write (STDOUT_FILENO, obuf + off, osize - off);
+	  if (sz == -1 && errno == EINTR)
+	    continue;
+	  if (sz == -1)
+	    {
+	      perror ("write");
+	      exit (EXIT_FAILURE);
+	    }
+	  off += sz;
+	}
+    }
+  codec_end (&c);
+  exit (EXIT_SUCCESS);
+}
+
+// Split the command at pipe_token into the stages of a pipeline, and
+// return the number of stages.  With stages NULL, only counts them.
+static int
+split_stages (char **args, char **stages[])
+{
+  int nstage = 1;
+  int end = 0;
+  for (; args[end] != NULL; end++)
+    if (args[end] == pipe_token)
+      nstage++;
+  if (stages == NULL)
+    return nstage;
+  stages[0] = args;
+  for (int i = 0, k = 1; i < end; i++)
+    if (args[i] == pipe_token)
+      {
+	args[i] = NULL;
+	stages[k++] = args + i + 1;
+      }
+  return nstage;
+}
+
+// Run the stages of the pipeline from fd_in to fd_out, connected with
+// pipes of psize bytes.
+static void
+spawn_pipeline (char **const stages[], int nstage, int fd_in, int fd_out,
+		size_t psize, pid_t pids[])
+{
+  int in = fd_in;
+  for (int k = 0; k < nstage; k++)
+    {
+      int pfds[2] = { -1, fd_out };
+      if (k < nstage - 1)
+	{
+	  if (pipe2 (pfds, O_CLOEXEC) == -1)
+	    {
+	      perror ("pipe");
+	      exit (EXIT_FAILURE);
+	    }
+	  setpipesize (pfds[1], psize);
+	}
+      pids[k] = fork ();
+      if (pids[k] == -1)
+	{
+	  perror ("fork");
+	  exit (EXIT_FAILURE);
+	}
+      if (pids[k] == 0)
+	{
+	  // parallel mode ignores SIGPIPE
+	  signal (SIGPIPE, SIG_DFL);
+	  dup2 (in, STDIN_FILENO);
+	  dup2 (pfds[1], STDOUT_FILENO);
+	  if (stages[k][0][0] == ':' && stages[k][0][1] != '\0')
+	    run_builtin (stages[k]);
+	  execvp (stages[k][0], stages[k]);
+	  perror (stages[k][0]);
+	  exit (EXIT_FAILURE);
+	}
+      if (in != fd_in)
+	close (in);
+      if (pfds[1] != fd_out)
+	close (pfds[1]);
+      in = pfds[0];
+    }
+}
+
+// Wait for the stages of the pipeline.  Returns the exit status of the
+// last stage as shell.
+static int
+wait_pipeline (const pid_t pids[], int nstage)
+{
+  int ret_status = EXIT_FAILURE;
+  for (int k = 0; k < nstage; k++)
+    {
+      int status;
+      if (waitpid (pids[k], &status, 0) == -1)
+	{
+	  perror ("waitpid");
+	  exit (EXIT_FAILURE);
+	}
+      if (k == nstage - 1 && WIFEXITED (status))
+	ret_status = WEXITSTATUS (status);
+    }
+  return ret_status;
+}
+
+// Output position of collapse mode, the input size rounded up to the
+// block size of the file.
+static off_t
+collapse_base (const struct stat st[2])
+{
+  off_t blksize = st[1].st_blksize;
+  return (st[0].st_size + blksize - 1) / blksize * blksize;
+}
+
+// File published by atomic mode: the rename file if any, or the output.
+static const char *
+atomic_target (const struct opt *opt)
+{
+  return opt->file_rename != NULL ? opt->file_rename : opt->file_output;
+}
+
+// Directory and base name of a path.  Returns the allocation to free.
+static char *
+split_path (const char *path, const char **dir, const char **base)
+{
+  size_t len = strlen (path);
+  char *buf = malloc (len * 2 + 2);
+  if (buf == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  memcpy (buf, path, len + 1);
+  memcpy (buf + len + 1, path, len + 1);
+  *base = basename (buf + len + 1);
+  *dir = dirname (buf);
+  return buf;
+}
+
+// Temporary output file of atomic mode, in the directory of the file to
+// publish so that it can be renamed there.  It has no name until it is
+// published, or a hidden one on file systems without O_TMPFILE.  It takes
+// the mode and owner of the file it replaces.
+static int
+open_tmpfile (struct opt *opt)
+{
+  const char *target = atomic_target (opt);
+  const char *dir;
+  const char *base;
+  char *buf = split_path (target, &dir, &base);
+  int fd = open (dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+  if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL))
+    {
+      char *name;
+      if (asprintf (&name, "%s/.%s.XXXXXX", dir, base) == -1)
+	{
+	  perror ("asprintf");
+	  exit (EXIT_FAILURE);
+	}
+      fd = mkostemp (name, O_CLOEXEC);
+      if (fd != -1)
+	opt->file_temp = name;
+    }
+  if (fd == -1)
+    {
+      perror (dir);
+      exit (EXIT_FAILURE);
+    }
+  free (buf);
+  struct stat st;
+  if (stat (target, &st) == 0)
+    {
+      if (fchmod (fd, st.st_mode & 07777) == -1)
+	{
+	  perror (target);
+	  exit (EXIT_FAILURE);
+	}
+      // only a privileged user can give the file away
+      if (fchown (fd, st.st_uid, st.st_gid) == -1 && opt->verbose)
+	fprintf (stderr, _("atomic: owner of %s is not kept\n"), target);
+    }
+  else if (errno != ENOENT || opt->atomic == ATOMIC_EXCHANGE)
+    {
+      perror (target);
+      exit (EXIT_FAILURE);
+    }
+  else if (opt->file_temp != NULL)
+    {
+      mode_t mask = umask (0);
+      umask (mask);
+      if (fchmod (fd, 0666 & ~mask) == -1)
+	{
+	  perror (opt->file_temp);
+	  exit (EXIT_FAILURE);
+	}
+    }
+  return fd;
+}
+
+static void
+open_iofile (struct opt *opt, int fds[2])
+{
+  if (opt->file_input && !opt->file_stdin)
+    {
+      int flags = O_RDONLY | O_CLOEXEC;
+      if (opt->punchhole)
+	{
+	  flags &= ~O_ACCMODE;
+	  flags |= O_RDWR;
+	}
+      fds[0] = open (opt->file_input, flags);
+      if (fds[0] == -1)
+	{
+	  perror (opt->file_input);
+	  exit (EXIT_FAILURE);
+	}
+    }
+  else
+    {
+      fds[0] = STDIN_FILENO;
+      if (opt->punchhole)
+	{
+	  fprintf (stderr,
+		   _("cannot set punchhole mode for outer redirect\n"));
+	  exit (EXIT_FAILURE);
+	}
+    }
+  if (opt->atomic != ATOMIC_NONE)
+    {
+      if (opt->file_output == NULL)
+	{
+	  fprintf (stderr, _("cannot use atomic mode without output file\n"));
+	  exit (EXIT_FAILURE);
+	}
+      fds[1] = open_tmpfile (opt);
+    }
+  else if (opt->file_output && !opt->file_stdout)
+    {
+      int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+      if (opt->append)
+	flags |= O_APPEND;
+      fds[1] = open (opt->file_output, flags, 0666);
+      if (fds[1] == -1)
+	{
+	  perror (opt->file_output);
+	  exit (EXIT_FAILURE);
+	}
+    }
+  else
+    {
+      fds[1] = STDOUT_FILENO;
+      if (opt->append)
+	setopenflags (fds[1], O_APPEND);
+    }
+}
+
+// Ring buffer of the relay.  Data is never moved; I/O across the wrap
+// point uses two iovecs.
+struct ringbuf
+{
+  char *buf;
+  size_t size;
+  size_t head;
+  size_t len;
+  size_t align;
+};
+
+static void
+ringbuf_init (struct ringbuf *rb, size_t size)
+{
+  int ret = posix_memalign ((void **) &rb->buf, sysconf (_SC_PAGESIZE), size);
+  if (ret != 0)
+    {
+      errno = ret;
+      perror ("posix_memalign");
+      exit (EXIT_FAILURE);
+    }
+  rb->size = size;
+  rb->head = 0;
+  rb->len = 0;
+  rb->align = 1;
+}
+
+// Keep the data at file position pos at the same offset in a block of
+// align bytes, so that whole blocks can be read or written directly.
+static void
+ringbuf_align (struct ringbuf *rb, size_t align, off_t pos)
+{
+  rb->align = align;
+  rb->head = pos % align;
+}
+
+static void
+ringbuf_free (struct ringbuf *rb)
+{
+  free (rb->buf);
+}
+
+// Free space of the ring buffer (up to max bytes) for reading into.
+static int
+ringbuf_rvec (const struct ringbuf *rb, struct iovec iov[2], size_t max)
+{
+  size_t tail = (rb->head + rb->len) % rb->size;
+  size_t room = rb->size - rb->len;
+  if (room > max)
+    room = max;
+  if (room == 0)
+    return 0;
+  iov[0].iov_base = rb->buf + tail;
+  iov[0].iov_len = rb->size - tail < room ? rb->size - tail : room;
+  if (iov[0].iov_len == room)
+    return 1;
+  iov[1].iov_base = rb->buf;
+  iov[1].iov_len = room - iov[0].iov_len;
+  return 2;
+}
+
+// Held data of the ring buffer (up to max bytes) for writing out.
+static int
+ringbuf_wvec (const struct ringbuf *rb, struct iovec iov[2], size_t max)
+{
+  size_t len = rb->len < max ? rb->len : max;
+  if (len == 0)
+    return 0;
+  iov[0].iov_base = rb->buf + rb->head;
+  iov[0].iov_len = rb->size - rb->head < len ? rb->size - rb->head : len;
+  if (iov[0].iov_len == len)
+    return 1;
+  iov[1].iov_base = rb->buf;
+  iov[1].iov_len = len - iov[0].iov_len;
+  return 2;
+}
+
+static void
+ringbuf_produce (struct ringbuf *rb, size_t size)
+{
+  rb->len += size;
+}
+
+static void
+ringbuf_consume (struct ringbuf *rb, size_t size)
+{
+  rb->len -= size;
+  rb->head = (rb->head + size) % rb->size;
+  if (rb->len == 0)
+    rb->head %= rb->align;
+}
+
+// Ring buffer shared by two threads, one producing and one consuming.
+// Each side advances only its own count of bytes, and the data before a
+// count is published to the other side by the release of the count.
+struct spsc
+{
+  char *buf;
+  size_t size;
+  atomic_size_t put;
+  atomic_size_t taken;
+};
+
+static void
+spsc_init (struct spsc *q, size_t size)
+{
+  int ret = posix_memalign ((void **) &q->buf, sysconf (_SC_PAGESIZE), size);
+  if (ret != 0)
+    {
+      errno = ret;
+      perror ("posix_memalign");
+      exit (EXIT_FAILURE);
+    }
+  q->size = size;
+  atomic_init (&q->put, 0);
+  atomic_init (&q->taken, 0);
+}
+
+static void
+spsc_free (struct spsc *q)
+{
+  free (q->buf);
+}
+
+static size_t
+spsc_len (struct spsc *q)
+{
+  size_t taken = atomic_load_explicit (&q->taken, memory_order_acquire);
+  return atomic_load_explicit (&q->put, memory_order_acquire) - taken;
+}
+
+// Free space of the queue (up to max bytes) for the producer to read into.
+static int
+spsc_rvec (struct spsc *q, struct iovec iov[2], size_t max)
+{
+  size_t put = atomic_load_explicit (&q->put, memory_order_relaxed);
+  size_t taken = atomic_load_explicit (&q->taken, memory_order_acquire);
+  size_t tail = put % q->size;
+  size_t room = q->size - (put - taken);
+  if (room > max)
+    room = max;
+  if (room == 0)
+    return 0;
+  iov[0].iov_base = q->buf + tail;
+  iov[0].iov_len = q->size - tail < room ? q->size - tail : room;
+  if (iov[0].iov_len == room)
+    return 1;
+  iov[1].iov_base = q->buf;
+  iov[1].iov_len = room - iov[0].iov_len;
+  return 2;
+}
+
+// Held data of the queue (up to max bytes) for the consumer to write out.
+static int
+spsc_wvec (struct spsc *q, struct iovec iov[2], size_t max)
+{
+  size_t taken = atomic_load_explicit (&q->taken, memory_order_relaxed);
+  size_t len = atomic_load_explicit (&q->put, memory_order_acquire) - taken;
+  size_t head = taken % q->size;
+  if (len > max)
+    len = max;
+  if (len == 0)
+    return 0;
+  iov[0].iov_base = q->buf + head;
+  iov[0].iov_len = q->size - head < len ? q->size - head : len;
+  if (iov[0].iov_len == len)
+    return 1;
+  iov[1].iov_base = q->buf;
+  iov[1].iov_len = len - iov[0].iov_len;
+  return 2;
+}
+
+static void
+spsc_produce (struct spsc *q, size_t size)
+{
+  atomic_fetch_add_explicit (&q->put, size, memory_order_release);
+}
+
+static void
+spsc_consume (struct spsc *q, size_t size)
+{
+  atomic_fetch_add_explicit (&q->taken, size, memory_order_release);
+}
+
+// Spill of the output.  When the output buffer is full and the read
+// position does not allow writing, the command output goes behind the
+// buffer into a memfd, and into an unlinked temporary file once the
+// memory size is exceeded.  The buffer is refilled from the spill as it
+// is written out.
+struct spill
+{
+  int fd;
+  int disk:1;
+  int busy:1;
+  int verbose:1;
+  size_t memory;
+  off_t rpos;
+  off_t wpos;
+  off_t punched;
+  uintmax_t total;
+  uintmax_t peak;
+};
+
+static void
+spill_init (struct spill *sp, size_t memory, int verbose)
+{
+  sp->fd = -1;
+  sp->disk = 0;
+  sp->busy = 0;
+  sp->verbose = verbose;
+  sp->memory = memory;
+  sp->rpos = 0;
+  sp->wpos = 0;
+  sp->punched = 0;
+  sp->total = 0;
+  sp->peak = 0;
+}
+
+static size_t
+spill_len (const struct spill *sp)
+{
+  return sp->wpos - sp->rpos;
+}
+
+static int
+spill_tmpfile (void)
+{
+  const char *dir = getenv ("TMPDIR");
+  if (dir == NULL || *dir == '\0')
+    dir = P_tmpdir;
+  int fd = open (dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR))
+    return fd;
+  size_t sz = snprintf (NULL, 0, "%s/owXXXXXX", dir);
+  char path[sz + 1];
+  snprintf (path, sz + 1, "%s/owXXXXXX", dir);
+  fd = mkostemp (path, O_CLOEXEC);
+  if (fd != -1)
+    unlink (path);
+  return fd;
+}
+
+// Prepare the spill to store size bytes more at wpos.
+static void
+spill_reserve (struct spill *sp, size_t size)
+{
+  if (sp->fd == -1)
+    {
+      sp->fd = memfd_create ("ow-spill", MFD_CLOEXEC);
+      if (sp->fd == -1)
+	{
+	  perror ("memfd_create");
+	  exit (EXIT_FAILURE);
+	}
+    }
+  if (sp->disk || spill_len (sp) + size <= sp->memory)
+    return;
+  int fd = spill_tmpfile ();
+  if (fd == -1)
+    {
+      perror (_("spill temporary file"));
+      exit (EXIT_FAILURE);
+    }
+  if (lseek (fd, sp->rpos, SEEK_SET) == -1)
+    {
+      perror ("lseek");
+      exit (EXIT_FAILURE);
+    }
+  off_t off = sp->rpos;
+  while (off < sp->wpos)
+    {
+      ssize_t sz = sendfile (fd, sp->fd, &off, sp->wpos - off);
+      if (sz == -1)
+	{
+	  perror ("sendfile");
+	  exit (EXIT_FAILURE);
+	}
+    }
+  close (sp->fd);
+  sp->fd = fd;
+  sp->disk = 1;
+  sp->punched = sp->rpos;
+  if (sp->verbose)
+    fprintf (stderr, _("spill: moved to temporary file at %zu bytes\n"),
+	     spill_len (sp));
+}
+
+static void
+spill_stored (struct spill *sp, size_t size)
+{
+  sp->wpos += size;
+  sp->total += size;
+  if (sp->peak < spill_len (sp))
+    sp->peak = spill_len (sp);
+}
+
+// Store the command output from the pipe without blocking.
+static ssize_t
+spill_splice (struct spill *sp, int fd, size_t size)
+{
+  spill_reserve (sp, size);
+  off_t off = sp->wpos;
+  ssize_t sz = splice (fd, NULL, sp->fd, &off, size, SPLICE_F_NONBLOCK);
+  if (sz > 0)
+    spill_stored (sp, sz);
+  return sz;
+}
+
+// Store the output of a builtin command.
+static void
+spill_write (struct spill *sp, const void *buf, size_t size)
+{
+  spill_reserve (sp, size);
+  for (size_t off = 0; off < size;)
+    {
+      ssize_t sz = pwrite (sp->fd, (const char *) buf + off, size - off,
+			   sp->wpos);
+      if (sz == -1)
+	{
+	  perror ("write");
+	  exit (EXIT_FAILURE);
+	}
+      spill_stored (sp, sz);
+      off += sz;
+    }
+}
+
+// Move held data to the output buffer, releasing the consumed area.
+static void
+spill_refill (struct spill *sp, struct ringbuf *rb)
+{
+  struct iovec iov[2];
+  int iovcnt = ringbuf_rvec (rb, iov, spill_len (sp));
+  if (iovcnt == 0)
+    return;
+  ssize_t sz = preadv (sp->fd, iov, iovcnt, sp->rpos);
+  if (sz == -1)
+    {
+      perror ("read");
+      exit (EXIT_FAILURE);
+    }
+  ringbuf_produce (rb, sz);
+  sp->rpos += sz;
+  if (sp->busy)
+    return;
+  if (sp->rpos == sp->wpos)
+    {
+      if (sp->disk)
+	{
+	  close (sp->fd);
+	  sp->fd = -1;
+	  sp->disk = 0;
+	}
+      else if (ftruncate (sp->fd, 0) == -1)
+	{
+	  perror ("ftruncate");
+	  exit (EXIT_FAILURE);
+	}
+      sp->rpos = 0;
+      sp->wpos = 0;
+      sp->punched = 0;
+      return;
+    }
+  off_t end = sp->rpos / sysconf (_SC_PAGESIZE) * sysconf (_SC_PAGESIZE);
+  if (end > sp->punched
+      && fallocate (sp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		    sp->punched, end - sp->punched) == 0)
+    sp->punched = end;
+}
+
+static void
+spill_free (struct spill *sp)
+{
+  if (sp->fd != -1)
+    close (sp->fd);
+  if (sp->verbose && sp->total > 0)
+    fprintf (stderr, _("spill: %ju bytes spilled, %ju bytes at peak\n"),
+	     sp->total, sp->peak);
+}
+
+enum stats_call
+{
+  CALL_READ,
+  CALL_WRITE,
+  CALL_SPLICE,
+  CALL_WAIT,
+  CALL_FALLOCATE,
+  CALL_FTRUNCATE,
+  CALL_MAX,
+};
+
+enum stats_time
+{
+  TIME_NONE,
+  TIME_READ,
+  TIME_WRITE,
+  TIME_COMMAND,
+  TIME_WINDOW,
+  TIME_MAX,
+};
+
+// Statistics of the relay for --stats.  Blocked times are in
+// nanoseconds: reading the input file, writing the output file, waiting
+// for the command, and waiting with output held by the read position.
+struct stats
+{
+  uint64_t start;
+  uintmax_t read;
+  uintmax_t piped_in;
+  uintmax_t piped_out;
+  uintmax_t written;
+  uintmax_t calls[CALL_MAX];
+  uint64_t blocked[TIME_MAX];
+  size_t isize_max;
+  size_t osize_max;
+  uintmax_t window_max;
+};
+
+static volatile sig_atomic_t stats_signaled;
+static volatile sig_atomic_t stats_alarmed;
+
+static void
+stats_handler (int sig)
+{
+  if (sig == SIGUSR1)
+    stats_signaled = 1;
+  else
+    stats_alarmed = 1;
+}
+
+struct relay
+{
+  const struct opt *opt;
+  int fds[2];
+  int pfds[2];
+  struct stat st[2];
+  const char *cmd;
+  char **const *stages;
+  int nstage;
+  const pid_t *pids;
+  const int *tfds;
+  int ntee;
+  struct codec *codec;
+  int status;
+  size_t bufsize;
+  int overwrite;
+  off_t ipos;
+  off_t opos;
+  int ieof;
+  int oeof;
+  int iclosed;
+  struct spill spill;
+  size_t psize[2];
+  size_t pmax;
+  int pfull[2];
+  off_t punch_pos;
+  off_t punch_end;
+  off_t punch_batch;
+  uintmax_t punch_calls;
+  uintmax_t punch_bytes;
+  off_t data_pos;
+  off_t data_end;
+  uintmax_t hole_bytes;
+  size_t wbatch;
+  off_t prealloc;
+  struct cache cache[2];
+  int jfd;
+  uint64_t jseq;
+  off_t jipos;
+  off_t joff;
+  off_t jlen;
+  off_t jfree;
+  struct stats stats;
+};
+
+// Start time of a system call, if statistics are taken.
+static uint64_t
+relay_clock (const struct relay *r)
+{
+  return r->opt->stats == NULL ? 0 : clock_ns ();
+}
+
+// Account a system call started at start, blocking for time.
+static void
+relay_call (struct relay *r, enum stats_call call, enum stats_time time,
+	    uint64_t start)
+{
+  r->stats.calls[call]++;
+  if (start != 0 && time != TIME_NONE)
+    r->stats.blocked[time] += clock_ns () - start;
+}
+
+static void
+stats_print (const struct opt *opt, const struct stats *st)
+{
+  int fd = opt->stats_fd;
+  double elapsed = (clock_ns () - st->start) / 1e9;
+  if (strcmp (opt->stats, "json") == 0)
+    {
+      dprintf (fd, "{\"elapsed\":%.6f,\"read\":%ju,\"piped_in\":%ju,"
+	       "\"piped_out\":%ju,\"written\":%ju,", elapsed, st->read,
+	       st->piped_in, st->piped_out, st->written);
+      dprintf (fd, "\"calls\":{\"read\":%ju,\"write\":%ju,\"splice\":%ju,"
+	       "\"wait\":%ju,\"fallocate\":%ju,\"ftruncate\":%ju},",
+	       st->calls[CALL_READ], st->calls[CALL_WRITE],
+	       st->calls[CALL_SPLICE], st->calls[CALL_WAIT],
+	       st->calls[CALL_FALLOCATE], st->calls[CALL_FTRUNCATE]);
+      dprintf (fd, "\"blocked\":{\"read\":%.6f,\"write\":%.6f,"
+	       "\"command\":%.6f,\"window\":%.6f},",
+	       st->blocked[TIME_READ] / 1e9, st->blocked[TIME_WRITE] / 1e9,
+	       st->blocked[TIME_COMMAND] / 1e9,
+	       st->blocked[TIME_WINDOW] / 1e9);
+      dprintf (fd, "\"peak\":{\"isize\":%zu,\"osize\":%zu,"
+	       "\"window\":%ju}}\n", st->isize_max, st->osize_max,
+	       st->window_max);
+      return;
+    }
+  dprintf (fd, _("stats: %.3fs: read %ju, piped %ju/%ju, written %ju bytes\n"),
+	   elapsed, st->read, st->piped_in, st->piped_out, st->written);
+  dprintf (fd,
+	   _
+	   ("stats: calls: %ju read, %ju write, %ju splice, %ju wait, %ju fallocate, %ju ftruncate\n"),
+	   st->calls[CALL_READ], st->calls[CALL_WRITE], st->calls[CALL_SPLICE],
+	   st->calls[CALL_WAIT], st->calls[CALL_FALLOCATE],
+	   st->calls[CALL_FTRUNCATE]);
+  dprintf (fd,
+	   _
+	   ("stats: blocked: %.3fs read, %.3fs write, %.3fs command, %.3fs window\n"),
+	   st->blocked[TIME_READ] / 1e9, st->blocked[TIME_WRITE] / 1e9,
+	   st->blocked[TIME_COMMAND] / 1e9, st->blocked[TIME_WINDOW] / 1e9);
+  dprintf (fd, _("stats: peak: isize %zu, osize %zu, window %ju bytes\n"),
+	   st->isize_max, st->osize_max, st->window_max);
+}
+
+// Add the statistics of a file of each mode.
+static void
+stats_add (struct stats *sum, const struct stats *st)
+{
+  sum->read += st->read;
+  sum->piped_in += st->piped_in;
+  sum->piped_out += st->piped_out;
+  sum->written += st->written;
+  for (int i = 0; i < CALL_MAX; i++)
+    sum->calls[i] += st->calls[i];
+  for (int i = 0; i < TIME_MAX; i++)
+    sum->blocked[i] += st->blocked[i];
+  if (sum->isize_max < st->isize_max)
+    sum->isize_max = st->isize_max;
+  if (sum->osize_max < st->osize_max)
+    sum->osize_max = st->osize_max;
+  if (sum->window_max < st->window_max)
+    sum->window_max = st->window_max;
+}
+
+// Statistics of a worker of each mode so far, for the parent.  It is
+// smaller than PIPE_BUF, so that the reports are written at once.
+struct each_report
+{
+  pid_t pid;
+  struct stats stats;
+};
+
+// Report the statistics, or pass them to the parent in each mode.
+static void
+relay_stats (const struct relay *r)
+{
+  if (r->opt->stats_pipe == -1)
+    {
+      stats_print (r->opt, &r->stats);
+      return;
+    }
+  struct each_report rep = {.pid = getpid (),.stats = r->stats };
+  if (write (r->opt->stats_pipe, &rep, sizeof (rep)) == -1)
+    perror ("write");
+}
+
+// Called on each step of the relay with the held input and output size.
+static void
+relay_step (struct relay *r, size_t isize, size_t osize)
+{
+  if (r->opt->stats == NULL)
+    return;
+  struct stats *st = &r->stats;
+  if (st->isize_max < isize)
+    st->isize_max = isize;
+  if (st->osize_max < osize)
+    st->osize_max = osize;
+  if (r->overwrite && !r->opt->append && r->ipos > r->opos
+      && st->window_max < (uintmax_t) (r->ipos - r->opos))
+    st->window_max = r->ipos - r->opos;
+  if (stats_signaled || stats_alarmed)
+    {
+      stats_signaled = 0;
+      stats_alarmed = 0;
+      relay_stats (r);
+    }
+}
+
+static void
+stats_sigaction (int flags)
+{
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = stats_handler;
+  sa.sa_flags = flags;
+  sigemptyset (&sa.sa_mask);
+  if (sigaction (SIGUSR1, &sa, NULL) == -1
+      || sigaction (SIGALRM, &sa, NULL) == -1)
+    {
+      perror ("sigaction");
+      exit (EXIT_FAILURE);
+    }
+}
+
+// Report the statistics on SIGUSR1 and every interval.
+static void
+stats_start (const struct opt *opt)
+{
+  stats_sigaction (SA_RESTART);
+  if (opt->stats_interval > 0)
+    {
+      struct itimerval it;
+      it.it_interval.tv_sec = opt->stats_interval;
+      it.it_interval.tv_usec =
+	(opt->stats_interval - it.it_interval.tv_sec) * 1000000;
+      if (it.it_interval.tv_sec == 0 && it.it_interval.tv_usec == 0)
+	it.it_interval.tv_usec = 1;
+      it.it_value = it.it_interval;
+      if (setitimer (ITIMER_REAL, &it, NULL) == -1)
+	{
+	  perror ("setitimer");
+	  exit (EXIT_FAILURE);
+	}
+    }
+}
+
+static void
+relay_stats_init (struct relay *r)
+{
+  if (r->opt->stats == NULL)
+    return;
+  r->stats.start = clock_ns ();
+  // the parent of each mode reports
+  if (r->opt->stats_pipe == -1)
+    stats_start (r->opt);
+}
+
+// Report the read and written size of each stage of the pipeline.
+static void
+relay_stagestat (const struct relay *r)
+{
+  if (r->pids == NULL || r->nstage <= 1)
+    return;
+  for (int k = 0; k < r->nstage; k++)
+    {
+      uintmax_t rchar = 0;
+      uintmax_t wchar = 0;
+      size_t sz = snprintf (NULL, 0, "/proc/%d/io", (int) r->pids[k]);
+      char path[sz + 1];
+      snprintf (path, sz + 1, "/proc/%d/io", (int) r->pids[k]);
+      FILE *fp = fopen (path, "r");
+      if (fp != NULL)
+	{
+	  char line[64];
+	  while (fgets (line, sizeof (line), fp) != NULL)
+	    if (sscanf (line, "rchar: %ju", &rchar) != 1)
+	      sscanf (line, "wchar: %ju", &wchar);
+	  fclose (fp);
+	}
+      fprintf (stderr, _("stage %d: %s (read = %ju/written = %ju)\n"),
+	       k + 1, r->stages[k][0], rchar, wchar);
+    }
+}
+
+static void relay_exceeded (const struct relay *, size_t, size_t)
+  __attribute__((noreturn));
+
+static void
+relay_exceeded (const struct relay *r, size_t isize, size_t osize)
+{
+  fprintf (stderr, _("buffer exceeded\n"));
+  // a builtin command has no pipes
+  if (r->codec != NULL)
+    {
+      fprintf (stderr, _("%s(%ju/%ju) -> %s (buffer = %zu)\n"),
+	       r->opt->file_input ==
+	       NULL ? _("<stdin>") : getrelative (r->opt->file_input),
+	       (uintmax_t) r->ipos, (uintmax_t) r->st[0].st_size, r->cmd,
+	       isize);
+      fprintf (stderr, _("%s(%ju/%ju) <- %s (buffer = %zu)\n"),
+	       r->opt->file_output ==
+	       NULL ? _("<stdout>") : getrelative (r->opt->file_output),
+	       (uintmax_t) r->opos, (uintmax_t) r->st[1].st_size, r->cmd,
+	       osize);
+    }
+  else
+    {
+      fprintf (stderr,
+	       _("%s(%ju/%ju) -> %s (buffer = %zu/pipe buffer = %zu)\n"),
+	       r->opt->file_input ==
+	       NULL ? _("<stdin>") : getrelative (r->opt->file_input),
+	       (uintmax_t) r->ipos, (uintmax_t) r->st[0].st_size, r->cmd,
+	       isize, r->psize[0]);
+      fprintf (stderr,
+	       _("%s(%ju/%ju) <- %s (buffer = %zu/pipe buffer = %zu)\n"),
+	       r->opt->file_output ==
+	       NULL ? _("<stdout>") : getrelative (r->opt->file_output),
+	       (uintmax_t) r->opos, (uintmax_t) r->st[1].st_size, r->cmd,
+	       osize, r->psize[1]);
+    }
+  relay_stagestat (r);
+  if (r->opt->stats != NULL)
+    relay_stats (r);
+  exit (EXIT_FAILURE);
+}
+
+// Number of bytes which may be written at output position pos without
+// overwriting input data which is not read yet.
+static size_t
+relay_wlimit (const struct relay *r, off_t pos, size_t size)
+{
+  off_t ipos = r->ipos;
+  if (r->jfd != -1)
+    {
+      // with journal, only input before the last checkpoint is free
+      if (!r->overwrite || r->jipos >= r->st[0].st_size)
+	return size;
+      ipos = r->jipos;
+    }
+  else if (r->ieof || !r->overwrite || r->opt->append)
+    return size;
+  if (ipos <= pos)
+    return 0;
+  return (uintmax_t) (ipos - pos) < size ? (size_t) (ipos - pos) : size;
+}
+
+// Number of bytes to write now at output position pos out of size
+// allowed bytes, by the batches of relay_wsched.
+static size_t
+relay_wbatch (const struct relay *r, off_t pos, size_t size, int flush)
+{
+  if (r->wbatch == 0 || size == 0)
+    return size;
+  off_t blksize = r->st[1].st_blksize;
+  off_t end = (pos + (off_t) size) / blksize * blksize;
+  if (end > pos && (end - pos >= (off_t) r->wbatch || flush))
+    return end - pos;
+  return flush ? size : 0;
+}
+
+// Number of bytes to write now at output position pos out of len held
+// bytes.  To a regular file, the allowed bytes are written in batches of
+// wbatch bytes ending at a block boundary, so that small and unaligned
+// writes are coalesced.  With flush (at the end of the output, or with a
+// full buffer), the allowed bytes are written anyway.
+static size_t
+relay_wsched (const struct relay *r, off_t pos, size_t len, int flush)
+{
+  return relay_wbatch (r, pos, relay_wlimit (r, pos, len), flush);
+}
+
+// Preallocate the output file for the expected output, by the given size
+// or the rest of the input.  The size of the file is kept, and the blocks
+// left after the end of output are freed when it is truncated.
+static void
+relay_prealloc (struct relay *r)
+{
+  if (!r->opt->prealloc || !S_ISREG (r->st[1].st_mode))
+    return;
+  off_t size = r->opt->prealloc_size;
+  if (size == 0 && S_ISREG (r->st[0].st_mode))
+    size = r->st[0].st_size - r->ipos;
+  if (size <= 0)
+    return;
+  if (fallocate (r->fds[1], FALLOC_FL_KEEP_SIZE, r->opos, size) == -1)
+    {
+      if (errno != EOPNOTSUPP && errno != ENOSYS)
+	{
+	  perror ("fallocate");
+	  exit (EXIT_FAILURE);
+	}
+      if (r->opt->verbose)
+	fprintf (stderr, _("prealloc: %s\n"), strerror (errno));
+      return;
+    }
+  r->stats.calls[CALL_FALLOCATE]++;
+  r->prealloc = size;
+  if (r->opt->verbose)
+    fprintf (stderr, _("prealloc: %jd bytes\n"), (intmax_t) size);
+}
+
+// Apply the page cache policy behind and ahead of the positions.
+static void
+relay_cache (struct relay *r)
+{
+  cache_update (&r->cache[0], r->ipos);
+  cache_update (&r->cache[1], r->opos);
+}
+
+// Double pipe i up to the limit.  Returns -1 if it cannot grow.
+static int
+relay_pipegrow (struct relay *r, int i)
+{
+  if (r->psize[i] >= r->pmax || (i == 0 && r->iclosed))
+    return -1;
+  size_t size = r->psize[i] * 2 < r->pmax ? r->psize[i] * 2 : r->pmax;
+  int ret = fcntl (r->pfds[i], F_SETPIPE_SZ, size);
+  if (ret == -1)
+    {
+      // e.g. EPERM over the pipe size limit of the user
+      r->pmax = r->psize[i];
+      return -1;
+    }
+  r->psize[i] = ret;
+  if (r->opt->verbose)
+    fprintf (stderr, _("pipe: %s pipe grown to %d bytes\n"),
+	     i == 0 ? _("input") : _("output"), ret);
+  return 0;
+}
+
+// Pipe i was seen full (or not) by the relay.  A pipe which is often
+// full is grown up to the limit, so that the command and ow switch less.
+static void
+relay_pipestat (struct relay *r, int i, int full)
+{
+  if (!full)
+    {
+      if (r->pfull[i] > 0)
+	r->pfull[i]--;
+      return;
+    }
+  if (++r->pfull[i] < PIPE_GROW_COUNT)
+    return;
+  r->pfull[i] = 0;
+  relay_pipegrow (r, i);
+}
+
+// The window is closed and the command has taken no input for the stall
+// timeout.  If its output pipe is filled too, the command is blocked
+// writing the output the relay waits for, so the output pipe grows, or
+// the buffer is exceeded.
+static void
+relay_stalled (struct relay *r, size_t isize, size_t osize)
+{
+  int pending;
+  if (ioctl (r->pfds[1], FIONREAD, &pending) == -1)
+    {
+      perror ("ioctl(..., FIONREAD)");
+      exit (EXIT_FAILURE);
+    }
+  if ((size_t) pending < r->psize[1] / 2)
+    return;
+  if (relay_pipegrow (r, 1) == -1)
+    relay_exceeded (r, isize, osize);
+}
+
+static void
+relay_punch (struct relay *r, off_t pos, off_t end)
+{
+  if (fallocate
+      (r->fds[0], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos,
+       end - pos) == -1)
+    {
+      perror ("fallocate");
+      exit (EXIT_FAILURE);
+    }
+  r->punch_pos = end;
+  r->punch_calls++;
+  r->stats.calls[CALL_FALLOCATE]++;
+  r->punch_bytes += end - pos;
+}
+
+// Input is consumed up to end (called before ipos is advanced).  Whole
+// blocks are punched in batches of punch_batch bytes.  When the output
+// overwrites the input, it may be written below ipos at any time, so
+// blocks are punched only above ipos and as soon as they are consumed.
+static void
+relay_punchhole (struct relay *r, off_t end)
+{
+  if (!r->opt->punchhole)
+    return;
+  off_t blksize = r->st[0].st_blksize;
+  off_t batch = r->punch_batch;
+  r->punch_end = end;
+  end = end / blksize * blksize;
+  if (r->overwrite && !r->opt->append)
+    {
+      off_t ipos = (r->ipos + blksize - 1) / blksize * blksize;
+      if (r->punch_pos < ipos)
+	r->punch_pos = ipos;
+      batch = 1;
+    }
+  if (end > r->punch_pos && end - r->punch_pos >= batch)
+    relay_punch (r, r->punch_pos, end);
+}
+
+// Punch the rest of the consumed input, including the last partial block.
+static void
+relay_punchflush (struct relay *r)
+{
+  if (!r->opt->punchhole)
+    return;
+  if (!(r->overwrite && !r->opt->append) && r->punch_end > r->punch_pos)
+    relay_punch (r, r->punch_pos, r->punch_end);
+  if (r->opt->verbose)
+    fprintf (stderr, _("punchhole: %ju calls, %ju bytes freed\n"),
+	     r->punch_calls, r->punch_bytes);
+}
+
+// Size of the hole of the input at pos with a holes policy, or 0 in
+// data.  In data, rsize is limited to the start of the next hole.  The
+// data segment is looked up again only when pos leaves it.
+static off_t
+relay_hole (struct relay *r, off_t pos, size_t *rsize)
+{
+  if (r->opt->holes == HOLES_READ || !S_ISREG (r->st[0].st_mode))
+    return 0;
+  off_t size = r->st[0].st_size;
+  if (pos >= r->data_end && pos < size)
+    {
+      off_t data = lseek (r->fds[0], pos, SEEK_DATA);
+      off_t end = data == -1 ? data : lseek (r->fds[0], data, SEEK_HOLE);
+      // a hole up to the end of file
+      if (data == -1 && errno == ENXIO)
+	data = end = size;
+      if (end == -1 || lseek (r->fds[0], pos, SEEK_SET) == -1)
+	{
+	  perror ("lseek");
+	  exit (EXIT_FAILURE);
+	}
+      r->data_pos = data < size ? data : size;
+      r->data_end = end < size ? end : size;
+    }
+  if (pos < r->data_pos)
+    return r->data_pos - pos;
+  if (pos < r->data_end && (uintmax_t) (r->data_end - pos) < *rsize)
+    *rsize = r->data_end - pos;
+  return 0;
+}
+
+// Pass the hole of the input at ipos as zeros in the buffer, or skip it.
+static void
+relay_fillhole (struct relay *r, struct ringbuf *rb, off_t hole)
+{
+  off_t size = hole;
+  if (r->opt->holes == HOLES_ZERO)
+    {
+      struct iovec iov[2];
+      int iovcnt = ringbuf_rvec (rb, iov, (uintmax_t) hole < SIZE_MAX
+				 ? (size_t) hole : SIZE_MAX);
+      size = 0;
+      for (int i = 0; i < iovcnt; i++)
+	{
+	  memset (iov[i].iov_base, 0, iov[i].iov_len);
+	  size += iov[i].iov_len;
+	}
+      sum_iov (0, iov, iovcnt, size);
+      ringbuf_produce (rb, size);
+    }
+  relay_punchhole (r, r->ipos + size);
+  r->ipos += size;
+  r->hole_bytes += size;
+  if (lseek (r->fds[0], r->ipos, SEEK_SET) == -1)
+    {
+      perror ("lseek");
+      exit (EXIT_FAILURE);
+    }
+}
+
+// Read the input at ipos into rb, or pass a hole of it, and set ieof at
+// the end of the input.
+static void
+relay_read (struct relay *r, struct ringbuf *rb)
+{
+  struct iovec iov[2];
+  size_t rsize = SIZE_MAX;
+  if (r->overwrite && r->opt->append
+      && (uintmax_t) (r->st[0].st_size - r->ipos) < rsize)
+    rsize = r->st[0].st_size - r->ipos;
+  off_t hole = relay_hole (r, r->ipos, &rsize);
+  if (hole > 0)
+    {
+      relay_fillhole (r, rb, hole);
+      return;
+    }
+  rate_wait (0);
+  int iovcnt = ringbuf_rvec (rb, iov, rate_size (0, rsize));
+  uint64_t t = relay_clock (r);
+  ssize_t sz = iovcnt == 0 ? 0
+    : r->cache[0].policy == CACHE_DIRECT
+    ? cache_io (&r->cache[0], iov, iovcnt, r->ipos)
+    : readv (r->fds[0], iov, iovcnt);
+  relay_call (r, CALL_READ, TIME_READ, t);
+  rate_take (0, sz);
+  sum_iov (0, iov, iovcnt, sz);
+  if (sz == -1)
+    {
+      perror ("read");
+      exit (EXIT_FAILURE);
+    }
+  if (sz == 0)
+    r->ieof = 1;
+  else
+    {
+      relay_punchhole (r, r->ipos + sz);
+      r->ipos += sz;
+      ringbuf_produce (rb, sz);
+      r->stats.read += sz;
+    }
+}
+
+// Write up to size bytes of rb to the output at opos.
+static void
+relay_write (struct relay *r, struct ringbuf *rb, size_t size)
+{
+  struct iovec iov[2];
+  rate_wait (1);
+  uint64_t t = relay_clock (r);
+  int iovcnt = ringbuf_wvec (rb, iov, rate_size (1, size));
+  ssize_t sz = r->cache[1].policy == CACHE_DIRECT
+    ? cache_io (&r->cache[1], iov, iovcnt, r->opos)
+    : writev (r->fds[1], iov, iovcnt);
+  relay_call (r, CALL_WRITE, TIME_WRITE, t);
+  rate_take (1, sz);
+  sum_iov (1, iov, iovcnt, sz);
+  if (sz == -1)
+    {
+      perror ("write");
+      exit (EXIT_FAILURE);
+    }
+  ringbuf_consume (rb, sz);
+  r->opos += sz;
+  r->stats.written += sz;
+}
+
+static void
+relay_select (struct relay *r)
+{
+  struct ringbuf ib;
+  struct ringbuf ob;
+  ringbuf_init (&ib, r->bufsize);
+  ringbuf_init (&ob, r->bufsize);
+  if (r->cache[0].policy == CACHE_DIRECT)
+    ringbuf_align (&ib, DIRECT_ALIGN, r->ipos);
+  if (r->cache[1].policy == CACHE_DIRECT)
+    ringbuf_align (&ob, DIRECT_ALIGN, r->opos);
+  // a pipe write larger than PIPE_BUF would block after select
+  for (int i = 0; i < 2; i++)
+    {
+      int flags = fcntl (r->pfds[i], F_GETFL);
+      if (flags == -1
+	  || fcntl (r->pfds[i], F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+	  perror ("fcntl");
+	  exit (EXIT_FAILURE);
+	}
+    }
+  while (1)
+    {
+      fd_set rfds, wfds;
+      int maxfd = -1;
+      struct iovec iov[2];
+      FD_ZERO (&rfds);
+      FD_ZERO (&wfds);
+      // REFILL
+      if (spill_len (&r->spill) > 0 && ob.len < ob.size)
+	spill_refill (&r->spill, &ob);
+      // CLOSE
+      if (r->ieof && ib.len == 0 && !r->iclosed)
+	{
+	  close (r->pfds[0]);
+	  r->iclosed = 1;
+	}
+      if (r->oeof && ob.len == 0)
+	break;
+      relay_step (r, ib.len, ob.len + spill_len (&r->spill));
+      relay_cache (r);
+      if (!r->ieof && ib.len < ib.size)
+	{
+	  FD_SET (r->fds[0], &rfds);
+	  if (maxfd < r->fds[0])
+	    maxfd = r->fds[0];
+	}
+      if (ib.len > 0)
+	{
+	  FD_SET (r->pfds[0], &wfds);
+	  if (maxfd < r->pfds[0])
+	    maxfd = r->pfds[0];
+	}
+      int ospill = r->opt->spill && (spill_len (&r->spill) > 0
+				     || (ob.len == ob.size
+					 && relay_wlimit (r, r->opos,
+							  ob.len) == 0));
+      if (!r->oeof && (ob.len < ob.size || ospill))
+	{
+	  FD_SET (r->pfds[1], &rfds);
+	  if (maxfd < r->pfds[1])
+	    maxfd = r->pfds[1];
+	}
+      int oflush = r->oeof || ob.len == ob.size;
+      if (ob.len > 0 && relay_wsched (r, r->opos, ob.len, oflush) > 0)
+	{
+	  FD_SET (r->fds[1], &wfds);
+	  if (maxfd < r->fds[1])
+	    maxfd = r->fds[1];
+	}
+      if (maxfd == -1)
+	{
+	  if (r->ieof && ib.len == 0 && r->oeof && ob.len == 0)
+	    break;
+	  relay_exceeded (r, ib.len, ob.len + spill_len (&r->spill));
+	}
+      enum stats_time wait = ob.len > 0
+	&& relay_wlimit (r, r->opos, ob.len) == 0 ? TIME_WINDOW : TIME_COMMAND;
+      uint64_t t = relay_clock (r);
+      int ret = select (maxfd + 1, &rfds, &wfds, NULL, NULL);
+      relay_call (r, CALL_WAIT, wait, t);
+      if (ret == -1 && errno == EINTR)
+	continue;
+      if (ret == -1)
+	{
+	  perror ("select");
+	  exit (EXIT_FAILURE);
+	}
+      if (FD_ISSET (r->pfds[0], &wfds))
+	{
+	  ssize_t sz =
+	    writev (r->pfds[0], iov, ringbuf_wvec (&ib, iov, SIZE_MAX));
+	  relay_call (r, CALL_WRITE, TIME_NONE, 0);
+	  if (sz == -1 && errno == EAGAIN)
+	    {
+	      relay_pipestat (r, 0, 1);
+	      continue;
+	    }
+	  // the command quit without reading all of its input
+	  if (sz == -1 && errno == EPIPE)
+	    {
+	      ringbuf_consume (&ib, ib.len);
+	      r->ieof = 1;
+	      continue;
+	    }
+	  if (sz == -1)
+	    {
+	      perror ("write");
+	      exit (EXIT_FAILURE);
+	    }
+	  relay_pipestat (r, 0, (size_t) sz < ib.len);
+	  ringbuf_consume (&ib, sz);
+	  r->stats.piped_in += sz;
+	  continue;
+	}
+      if (FD_ISSET (r->pfds[1], &rfds))
+	{
+	  ssize_t sz = ospill
+	    ? spill_splice (&r->spill, r->pfds[1], ob.size)
+	    : readv (r->pfds[1], iov, ringbuf_rvec (&ob, iov, SIZE_MAX));
+	  relay_call (r, ospill ? CALL_SPLICE : CALL_READ, TIME_NONE, 0);
+	  if (sz == -1 && errno == EAGAIN)
+	    continue;
+	  if (sz == -1)
+	    {
+	      perror (ospill ? "splice" : "read");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (sz == 0)
+	    r->oeof = 1;
+	  else
+	    relay_pipestat (r, 1, (size_t) sz >= r->psize[1]);
+	  if (sz > 0 && !ospill)
+	    ringbuf_produce (&ob, sz);
+	  r->stats.piped_out += sz;
+	  continue;
+	}
+      if (FD_ISSET (r->fds[0], &rfds))
+	{
+	  relay_read (r, &ib);
+	  continue;
+	}
+      if (FD_ISSET (r->fds[1], &wfds))
+	{
+	  relay_write (r, &ob, relay_wsched (r, r->opos, ob.len, oflush));
+	  continue;
+	}
+    }
+  ringbuf_free (&ib);
+  ringbuf_free (&ob);
+}
+
+enum thread_id
+{
+  THREAD_MAIN,
+  THREAD_INPUT,
+  THREAD_OUTPUT,
+};
+
+// Relay of thread engine.  The input thread reads the file into iq, and
+// the output thread writes oq to the file, while the main thread moves
+// the data between the queues and the pipes of the command.  The relay
+// belongs to the main thread; the others publish their positions and
+// counts, and the main thread publishes the end of the output window.
+struct trelay
+{
+  struct relay *r;
+  struct spsc iq;
+  struct spsc oq;
+  int efd[3];
+  atomic_int waiting[3];
+  _Atomic off_t rpos;
+  _Atomic off_t wpos;
+  _Atomic off_t wend;
+  atomic_int ieof;
+  atomic_int oeof;
+  atomic_int odone;
+  atomic_uint_fast64_t calls[2];
+  atomic_uint_fast64_t blocked[2];
+};
+
+// Block thread id until another thread changes the state.  The first
+// call only raises the waiting flag, and the caller checks the state
+// again, so that a change after the check always wakes the thread.
+static void
+thread_idle (struct trelay *t, enum thread_id id, int *idle)
+{
+  if (!*idle)
+    {
+      atomic_store (&t->waiting[id], 1);
+      atomic_thread_fence (memory_order_seq_cst);
+      *idle = 1;
+      return;
+    }
+  eventfd_t val;
+  if (eventfd_read (t->efd[id], &val) == -1)
+    {
+      perror ("eventfd_read");
+      exit (EXIT_FAILURE);
+    }
+  *idle = 0;
+}
+
+// Wake thread id after a change of the state, if it waits for one.
+static void
+thread_wake (struct trelay *t, enum thread_id id)
+{
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_exchange (&t->waiting[id], 0)
+      && eventfd_write (t->efd[id], 1) == -1)
+    {
+      perror ("eventfd_write");
+      exit (EXIT_FAILURE);
+    }
+}
+
+// Account a system call of the input (0) or output (1) thread.
+static void
+thread_call (struct trelay *t, int i, uint64_t start)
+{
+  atomic_fetch_add_explicit (&t->calls[i], 1, memory_order_relaxed);
+  if (start != 0)
+    atomic_fetch_add_explicit (&t->blocked[i], clock_ns () - start,
+			       memory_order_relaxed);
+}
+
+static void *
+thread_input (void *arg)
+{
+  struct trelay *t = arg;
+  struct relay *r = t->r;
+  off_t pos = atomic_load (&t->rpos);
+  int idle = 0;
+  while (1)
+    {
+      size_t rsize = SIZE_MAX;
+      if (r->overwrite && r->opt->append
+	  && (uintmax_t) (r->st[0].st_size - pos) < rsize)
+	rsize = r->st[0].st_size - pos;
+      struct iovec iov[2];
+      int iovcnt = spsc_rvec (&t->iq, iov, rsize);
+      if (iovcnt == 0 && rsize > 0)
+	{
+	  thread_idle (t, THREAD_INPUT, &idle);
+	  continue;
+	}
+      uint64_t start = relay_clock (r);
+      ssize_t sz = iovcnt == 0 ? 0 : readv (r->fds[0], iov, iovcnt);
+      thread_call (t, 0, start);
+      if (sz == -1)
+	{
+	  perror ("read");
+	  exit (EXIT_FAILURE);
+	}
+      sum_iov (0, iov, iovcnt, sz);
+      if (sz == 0)
+	{
+	  atomic_store (&t->ieof, 1);
+	  thread_wake (t, THREAD_MAIN);
+	  return NULL;
+	}
+      spsc_produce (&t->iq, sz);
+      pos += sz;
+      atomic_store (&t->rpos, pos);
+      thread_wake (t, THREAD_MAIN);
+    }
+}
+
+static void *
+thread_output (void *arg)
+{
+  struct trelay *t = arg;
+  struct relay *r = t->r;
+  off_t pos = atomic_load (&t->wpos);
+  int idle = 0;
+  while (1)
+    {
+      // the output is complete once the end is seen before the length
+      int done = atomic_load (&t->oeof);
+      size_t len = spsc_len (&t->oq);
+      if (done && len == 0)
+	break;
+      off_t end = atomic_load (&t->wend);
+      size_t size = end <= pos ? 0 : (uintmax_t) (end - pos) < len
+	? (size_t) (end - pos) : len;
+      size = relay_wbatch (r, pos, size, done || len == t->oq.size);
+      if (size == 0)
+	{
+	  thread_idle (t, THREAD_OUTPUT, &idle);
+	  continue;
+	}
+      struct iovec iov[2];
+      int iovcnt = spsc_wvec (&t->oq, iov, size);
+      uint64_t start = relay_clock (r);
+      ssize_t sz = writev (r->fds[1], iov, iovcnt);
+      thread_call (t, 1, start);
+      if (sz == -1)
+	{
+	  perror ("write");
+	  exit (EXIT_FAILURE);
+	}
+      sum_iov (1, iov, iovcnt, sz);
+      spsc_consume (&t->oq, sz);
+      pos += sz;
+      atomic_store (&t->wpos, pos);
+      thread_wake (t, THREAD_MAIN);
+    }
+  atomic_store (&t->odone, 1);
+  thread_wake (t, THREAD_MAIN);
+  return NULL;
+}
+
+// Take the progress of the threads into the relay.  New input is punched
+// before the end of the output window moves over it.
+static void
+thread_fold (struct trelay *t)
+{
+  struct relay *r = t->r;
+  // the position is final once the end is seen before it
+  int ieof = atomic_load (&t->ieof);
+  off_t pos = atomic_load (&t->rpos);
+  if (pos > r->ipos)
+    {
+      relay_punchhole (r, pos);
+      r->stats.read += pos - r->ipos;
+      r->ipos = pos;
+    }
+  r->ieof = ieof;
+  pos = atomic_load (&t->wpos);
+  r->stats.written += pos - r->opos;
+  r->opos = pos;
+  r->stats.calls[CALL_READ] += atomic_exchange (&t->calls[0], 0);
+  r->stats.calls[CALL_WRITE] += atomic_exchange (&t->calls[1], 0);
+  r->stats.blocked[TIME_READ] += atomic_exchange (&t->blocked[0], 0);
+  r->stats.blocked[TIME_WRITE] += atomic_exchange (&t->blocked[1], 0);
+  off_t end = r->ieof || !r->overwrite || r->opt->append ? OFF_MAX : r->ipos;
+  if (atomic_load (&t->wend) != end)
+    {
+      atomic_store (&t->wend, end);
+      thread_wake (t, THREAD_OUTPUT);
+    }
+}
+
+static void
+thread_start (struct trelay *t, pthread_t * th, void *(*fn) (void *))
+{
+  // signals are handled by the main thread
+  sigset_t set, old;
+  sigfillset (&set);
+  pthread_sigmask (SIG_SETMASK, &set, &old);
+  int ret = pthread_create (th, NULL, fn, t);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (ret != 0)
+    {
+      errno = ret;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+}
+
+// Relay with the file I/O in threads of its own, so that a slow disk read
+// or write does not hold the pipes of the command, and the other way.
+static void
+relay_thread (struct relay *r)
+{
+  struct trelay t = {.r = r };
+  spsc_init (&t.iq, r->bufsize);
+  spsc_init (&t.oq, r->bufsize);
+  for (int i = 0; i < 3; i++)
+    {
+      t.efd[i] = eventfd (0, EFD_CLOEXEC
+			  | (i == THREAD_MAIN ? EFD_NONBLOCK : 0));
+      if (t.efd[i] == -1)
+	{
+	  perror ("eventfd");
+	  exit (EXIT_FAILURE);
+	}
+      atomic_init (&t.waiting[i], 0);
+    }
+  atomic_init (&t.rpos, r->ipos);
+  atomic_init (&t.wpos, r->opos);
+  atomic_init (&t.wend, r->ipos);
+  atomic_init (&t.ieof, 0);
+  atomic_init (&t.oeof, 0);
+  atomic_init (&t.odone, 0);
+  for (int i = 0; i < 2; i++)
+    {
+      atomic_init (&t.calls[i], 0);
+      atomic_init (&t.blocked[i], 0);
+      int flags = fcntl (r->pfds[i], F_GETFL);
+      if (flags == -1
+	  || fcntl (r->pfds[i], F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+	  perror ("fcntl");
+	  exit (EXIT_FAILURE);
+	}
+    }
+  pthread_t th[2];
+  thread_start (&t, &th[0], thread_input);
+  thread_start (&t, &th[1], thread_output);
+  while (1)
+    {
+      fd_set rfds, wfds;
+      int maxfd = t.efd[THREAD_MAIN];
+      struct iovec iov[2];
+      FD_ZERO (&rfds);
+      FD_ZERO (&wfds);
+      // a change after the fold wakes the select
+      atomic_store (&t.waiting[THREAD_MAIN], 1);
+      atomic_thread_fence (memory_order_seq_cst);
+      thread_fold (&t);
+      size_t ilen = spsc_len (&t.iq);
+      size_t olen = spsc_len (&t.oq);
+      if (r->ieof && ilen == 0 && !r->iclosed)
+	{
+	  close (r->pfds[0]);
+	  r->iclosed = 1;
+	}
+      if (r->oeof && atomic_load (&t.odone))
+	break;
+      relay_step (r, ilen, olen);
+      relay_cache (r);
+      FD_SET (t.efd[THREAD_MAIN], &rfds);
+      if (ilen > 0 && !r->iclosed)
+	{
+	  FD_SET (r->pfds[0], &wfds);
+	  if (maxfd < r->pfds[0])
+	    maxfd = r->pfds[0];
+	}
+      if (!r->oeof && olen < t.oq.size)
+	{
+	  FD_SET (r->pfds[1], &rfds);
+	  if (maxfd < r->pfds[1])
+	    maxfd = r->pfds[1];
+	}
+      // with both queues full and the window closed, nothing moves until
+      // the command takes input, which it may never do
+      int closed = atomic_load (&t.wend) <= atomic_load (&t.wpos);
+      int full = ilen == t.iq.size && olen == t.oq.size && closed;
+      struct timeval tv = {.tv_sec = 0,.tv_usec = STALL_TIMEOUT_MS * 1000 };
+      uint64_t start = relay_clock (r);
+      int ret = select (maxfd + 1, &rfds, &wfds, NULL, full ? &tv : NULL);
+      relay_call (r, CALL_WAIT, TIME_COMMAND, start);
+      if (ret == -1 && errno == EINTR)
+	continue;
+      if (ret == -1)
+	{
+	  perror ("select");
+	  exit (EXIT_FAILURE);
+	}
+      if (ret == 0 && full)
+	relay_stalled (r, ilen, olen);
+      if (FD_ISSET (t.efd[THREAD_MAIN], &rfds))
+	{
+	  eventfd_t val;
+	  eventfd_read (t.efd[THREAD_MAIN], &val);
+	}
+      if (FD_ISSET (r->pfds[0], &wfds))
+	{
+	  ssize_t sz =
+	    writev (r->pfds[0], iov, spsc_wvec (&t.iq, iov, SIZE_MAX));
+	  relay_call (r, CALL_WRITE, TIME_NONE, 0);
+	  // the command quit without reading all of its input, and the
+	  // input thread is cancelled at the end
+	  if (sz == -1 && errno == EPIPE)
+	    {
+	      close (r->pfds[0]);
+	      r->iclosed = 1;
+	      continue;
+	    }
+	  if (sz == -1 && errno != EAGAIN)
+	    {
+	      perror ("write");
+	      exit (EXIT_FAILURE);
+	    }
+	  relay_pipestat (r, 0, sz == -1 || (size_t) sz < ilen);
+	  if (sz > 0)
+	    {
+	      spsc_consume (&t.iq, sz);
+	      r->stats.piped_in += sz;
+	      thread_wake (&t, THREAD_INPUT);
+	    }
+	}
+      if (FD_ISSET (r->pfds[1], &rfds))
+	{
+	  ssize_t sz =
+	    readv (r->pfds[1], iov, spsc_rvec (&t.oq, iov, SIZE_MAX));
+	  relay_call (r, CALL_READ, TIME_NONE, 0);
+	  if (sz == -1 && errno == EAGAIN)
+	    continue;
+	  if (sz == -1)
+	    {
+	      perror ("read");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (sz == 0)
+	    {
+	      r->oeof = 1;
+	      atomic_store (&t.oeof, 1);
+	    }
+	  else
+	    {
+	      relay_pipestat (r, 1, (size_t) sz >= r->psize[1]);
+	      spsc_produce (&t.oq, sz);
+	      r->stats.piped_out += sz;
+	    }
+	  thread_wake (&t, THREAD_OUTPUT);
+	}
+    }
+  pthread_join (th[1], NULL);
+  // the command may leave the rest of the input unread
+  if (!r->ieof)
+    pthread_cancel (th[0]);
+  pthread_join (th[0], NULL);
+  thread_fold (&t);
+  for (int i = 0; i < 3; i++)
+    close (t.efd[i]);
+  spsc_free (&t.iq);
+  spsc_free (&t.oq);
+}
+
+// Relay through a builtin command.  The codec transforms the input buffer
+// into the output buffer in place of the command and its pipes, so the
+// output is written as soon as the window of same input and output file
+// allows.
+static void
+relay_codec (struct relay *r)
+{
+  struct codec *c = r->codec;
+  if (codec_init (c) == -1)
+    {
+      fprintf (stderr, "%s: %s\n", r->cmd, _(c->error));
+      exit (EXIT_FAILURE);
+    }
+  struct ringbuf ib;
+  struct ringbuf ob;
+  ringbuf_init (&ib, r->bufsize);
+  ringbuf_init (&ob, r->bufsize);
+  if (r->cache[0].policy == CACHE_DIRECT)
+    ringbuf_align (&ib, DIRECT_ALIGN, r->ipos);
+  if (r->cache[1].policy == CACHE_DIRECT)
+    ringbuf_align (&ob, DIRECT_ALIGN, r->opos);
+  char *sbuf = NULL;
+  int done = 0;
+  while (1)
+    {
+      struct iovec iov[2];
+      int progress = 0;
+      // REFILL
+      if (spill_len (&r->spill) > 0 && ob.len < ob.size)
+	spill_refill (&r->spill, &ob);
+      if (done && ob.len == 0)
+	break;
+      relay_step (r, ib.len, ob.len + spill_len (&r->spill));
+      relay_cache (r);
+      size_t wsize = relay_wsched (r, r->opos, ob.len,
+				   done || ob.len == ob.size);
+      if (wsize > 0)
+	{
+	  relay_write (r, &ob, wsize);
+	  progress = 1;
+	}
+      int ospill = r->opt->spill && (spill_len (&r->spill) > 0
+				     || (ob.len == ob.size
+					 && relay_wlimit (r, r->opos,
+							  ob.len) == 0));
+      if (!done && (ob.len < ob.size || ospill))
+	{
+	  struct iovec in[2];
+	  void *out;
+	  size_t osize;
+	  int icnt = ringbuf_wvec (&ib, in, SIZE_MAX);
+	  size_t isize = icnt == 0 ? 0 : in[0].iov_len;
+	  if (ospill)
+	    {
+	      if (sbuf == NULL && (sbuf = malloc (r->bufsize)) == NULL)
+		{
+		  perror ("malloc");
+		  exit (EXIT_FAILURE);
+		}
+	      out = sbuf;
+	      osize = r->bufsize;
+	    }
+	  else
+	    {
+	      ringbuf_rvec (&ob, iov, SIZE_MAX);
+	      out = iov[0].iov_base;
+	      osize = iov[0].iov_len;
+	    }
+	  int finish = r->ieof && isize == ib.len;
+	  uint64_t t = relay_clock (r);
+	  int ret = codec_step (c, icnt == 0 ? NULL : in[0].iov_base, &isize,
+				out, &osize, finish);
+	  if (t != 0)
+	    r->stats.blocked[TIME_COMMAND] += clock_ns () - t;
+	  // the output before a broken input is still written
+	  if (ret == -1)
+	    {
+	      fprintf (stderr, "%s: %s\n", r->cmd, _(c->error));
+	      r->status = EXIT_FAILURE;
+	      ret = 1;
+	    }
+	  done = ret;
+	  ringbuf_consume (&ib, isize);
+	  if (ospill)
+	    spill_write (&r->spill, sbuf, osize);
+	  else
+	    ringbuf_produce (&ob, osize);
+	  r->stats.piped_in += isize;
+	  r->stats.piped_out += osize;
+	  if (isize > 0 || osize > 0 || done)
+	    progress = 1;
+	}
+      if (!r->ieof && ib.len < ib.size)
+	{
+	  relay_read (r, &ib);
+	  progress = 1;
+	}
+      if (!progress)
+	relay_exceeded (r, ib.len, ob.len + spill_len (&r->spill));
+    }
+  r->oeof = 1;
+  codec_end (c);
+  free (sbuf);
+  ringbuf_free (&ib);
+  ringbuf_free (&ob);
+}
+
+// Relay through a builtin filter.  Its output is never longer than its
+// input, so it runs in place on one buffer, and the output is always
+// behind the read position of same input and output file.  Only a
+// partial line is held over to the next read.
+static void
+relay_filter (struct relay *r)
+{
+  struct codec *c = r->codec;
+  if (codec_init (c) == -1)
+    {
+      fprintf (stderr, "%s: %s\n", r->cmd, _(c->error));
+      exit (EXIT_FAILURE);
+    }
+  // the ring buffer is used from its start as a linear one
+  struct ringbuf b;
+  ringbuf_init (&b, r->bufsize);
+  int done = 0;
+  while (!done)
+    {
+      relay_step (r, b.len, 0);
+      relay_cache (r);
+      if (!r->ieof && b.len < b.size)
+	relay_read (r, &b);
+      size_t isize = b.len;
+      size_t osize = b.len;
+      uint64_t t = relay_clock (r);
+      int ret = codec_step (c, b.buf, &isize, b.buf, &osize, r->ieof);
+      if (t != 0)
+	r->stats.blocked[TIME_COMMAND] += clock_ns () - t;
+      // the output before a broken input is still written
+      if (ret == -1)
+	{
+	  fprintf (stderr, "%s: %s\n", r->cmd, _(c->error));
+	  r->status = EXIT_FAILURE;
+	  ret = 1;
+	}
+      // a line longer than the buffer
+      if (isize == 0 && !ret && b.len == b.size)
+	relay_exceeded (r, b.len, osize);
+      done = ret;
+      r->stats.piped_in += isize;
+      r->stats.piped_out += osize;
+      // the output at the start of the buffer, which does not wrap
+      struct ringbuf ob = b;
+      ob.head = 0;
+      ob.len = osize;
+      while (ob.len > 0)
+	relay_write (r, &ob, ob.len);
+      memmove (b.buf, b.buf + isize, b.len - isize);
+      b.len -= isize;
+    }
+  r->oeof = 1;
+  codec_end (c);
+  ringbuf_free (&b);
+}
+
+// splice refuses O_APPEND, so the output is written at the end position
+// explicitly.  Returns the file status flags for relay_setappend.
+static int
+relay_noappend (const struct relay *r)
+{
+  int flags = fcntl (r->fds[1], F_GETFL);
+  if (flags == -1)
+    {
+      perror ("fcntl(..., F_GETFL)");
+      exit (EXIT_FAILURE);
+    }
+  if ((flags & O_APPEND) != 0 && S_ISREG (r->st[1].st_mode)
+      && fcntl (r->fds[1], F_SETFL, flags & ~O_APPEND) == -1)
+    {
+      perror ("fcntl(..., F_SETFL)");
+      exit (EXIT_FAILURE);
+    }
+  return flags;
+}
+
+// Restore O_APPEND cleared by relay_noappend.
+static void
+relay_setappend (const struct relay *r, int flags)
+{
+  if ((flags & O_APPEND) != 0 && S_ISREG (r->st[1].st_mode)
+      && fcntl (r->fds[1], F_SETFL, flags) == -1)
+    {
+      perror ("fcntl(..., F_SETFL)");
+      exit (EXIT_FAILURE);
+    }
+}
+
+// Relay without copying through user space.  The input file is spliced
+// into the command pipe and the command output is spliced into the
+// output file.  Spliced pipe buffers still refer to the page cache of
+// the input file, so the read position (for the overwrite window and
+// punchhole) is what the command has consumed from the pipe, not what
+// has been spliced.
+static void
+relay_splice (struct relay *r)
+{
+  int flags = relay_noappend (r);
+  int iseek = S_ISREG (r->st[0].st_mode);
+  int oseek = S_ISREG (r->st[1].st_mode);
+  long pagesize = sysconf (_SC_PAGESIZE);
+  off_t ioff = r->ipos;
+  int idone = 0;
+  int pending = 0;
+  // the window is closed with the same input left since stalled
+  uint64_t stalled = 0;
+  int stall_pending = -1;
+  // holes are spliced from /dev/zero
+  int zfd = -1;
+  if (r->opt->holes == HOLES_ZERO
+      && (zfd = open ("/dev/zero", O_RDONLY | O_CLOEXEC)) == -1)
+    {
+      perror ("/dev/zero");
+      exit (EXIT_FAILURE);
+    }
+  while (1)
+    {
+      fd_set rfds, wfds;
+      int maxfd = -1;
+      FD_ZERO (&rfds);
+      FD_ZERO (&wfds);
+      // CONSUMED POSITION
+      if (!r->iclosed && ioctl (r->pfds[0], FIONREAD, &pending) == -1)
+	{
+	  perror ("ioctl(..., FIONREAD)");
+	  exit (EXIT_FAILURE);
+	}
+      off_t ipos = ioff - pending;
+      if (ipos > r->ipos)
+	relay_punchhole (r, idone && pending == 0
+			 ? ipos : ipos / pagesize * pagesize);
+      r->ipos = ipos;
+      // CLOSE
+      if (idone && pending == 0 && !r->iclosed)
+	{
+	  close (r->pfds[0]);
+	  r->iclosed = 1;
+	  r->ieof = 1;
+	}
+      if (r->oeof)
+	break;
+      relay_step (r, pending, 0);
+      relay_cache (r);
+      if (!idone)
+	{
+	  FD_SET (r->pfds[0], &wfds);
+	  if (maxfd < r->pfds[0])
+	    maxfd = r->pfds[0];
+	}
+      if (relay_wlimit (r, r->opos, SIZE_MAX) > 0)
+	{
+	  FD_SET (r->pfds[1], &rfds);
+	  if (maxfd < r->pfds[1])
+	    maxfd = r->pfds[1];
+	}
+      if (maxfd == -1 && !(idone && !r->iclosed))
+	relay_exceeded (r, pending, 0);
+      // the command consumes the last input without any event, and may
+      // be blocked on its output while the window is closed
+      int closed = relay_wlimit (r, r->opos, SIZE_MAX) == 0;
+      struct timeval tv = {.tv_sec = 0,.tv_usec = 10000 };
+      if (!idone && closed)
+	tv.tv_usec = STALL_TIMEOUT_MS * 1000;
+      enum stats_time wait = closed ? TIME_WINDOW : TIME_COMMAND;
+      uint64_t t = relay_clock (r);
+      int ret = select (maxfd + 1, &rfds, &wfds, NULL,
+			(idone && !r->iclosed) || closed ? &tv : NULL);
+      relay_call (r, CALL_WAIT, wait, t);
+      if (ret == -1 && errno == EINTR)
+	continue;
+      if (ret == -1)
+	{
+	  perror ("select");
+	  exit (EXIT_FAILURE);
+	}
+      // STALL
+      if (!closed || r->iclosed || ret > 0 || pending != stall_pending)
+	{
+	  stalled = clock_ns ();
+	  stall_pending = pending;
+	}
+      else if (clock_ns () - stalled >= STALL_TIMEOUT_MS * 1000000ULL)
+	{
+	  relay_stalled (r, pending, 0);
+	  stalled = clock_ns ();
+	}
+      if (FD_ISSET (r->pfds[1], &rfds))
+	{
+	  off_t off = r->opos;
+	  uint64_t t = relay_clock (r);
+	  ssize_t sz = splice (r->pfds[1], NULL, r->fds[1],
+			       oseek ? &off : NULL,
+			       relay_wlimit (r, r->opos, r->bufsize),
+			       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	  relay_call (r, CALL_SPLICE, TIME_WRITE, t);
+	  if (sz == -1 && errno == EAGAIN)
+	    continue;
+	  if (sz == -1)
+	    {
+	      perror ("splice");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (sz == 0)
+	    r->oeof = 1;
+	  else
+	    relay_pipestat (r, 1, (size_t) sz >= r->psize[1]);
+	  r->opos += sz;
+	  r->stats.piped_out += sz;
+	  r->stats.written += sz;
+	  continue;
+	}
+      if (FD_ISSET (r->pfds[0], &wfds))
+	{
+	  size_t rsize = r->bufsize;
+	  if (r->overwrite && r->opt->append
+	      && (uintmax_t) (r->st[0].st_size - ioff) < rsize)
+	    rsize = r->st[0].st_size - ioff;
+	  off_t hole = relay_hole (r, ioff, &rsize);
+	  if (hole > 0 && (uintmax_t) hole < rsize)
+	    rsize = hole;
+	  off_t off = ioff;
+	  uint64_t t = relay_clock (r);
+	  ssize_t sz = rsize == 0 ? 0
+	    : splice (hole > 0 ? zfd : r->fds[0], iseek
+		      && hole == 0 ? &off : NULL, r->pfds[0], NULL, rsize,
+		      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	  relay_call (r, CALL_SPLICE, hole > 0 ? TIME_NONE : TIME_READ, t);
+	  // /dev/zero cannot be spliced on older kernels, and a pipe
+	  // writable after select takes PIPE_BUF bytes without blocking
+	  if (sz == -1 && errno == EINVAL && hole > 0)
+	    {
+	      static const char zeros[PIPE_BUF];
+	      sz = write (r->pfds[0], zeros, rsize < PIPE_BUF ? rsize
+			  : PIPE_BUF);
+	      relay_call (r, CALL_WRITE, TIME_NONE, 0);
+	    }
+	  if (sz == -1 && errno == EAGAIN)
+	    {
+	      relay_pipestat (r, 0, 1);
+	      continue;
+	    }
+	  // the command quit without reading all of its input
+	  if (sz == -1 && errno == EPIPE)
+	    {
+	      close (r->pfds[0]);
+	      r->iclosed = 1;
+	      r->ieof = 1;
+	      idone = 1;
+	      continue;
+	    }
+	  if (sz == -1)
+	    {
+	      perror ("splice");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (sz == 0)
+	    idone = 1;
+	  else
+	    relay_pipestat (r, 0, (size_t) sz < rsize);
+	  ioff += sz;
+	  if (hole > 0)
+	    r->hole_bytes += sz;
+	  else
+	    r->stats.read += sz;
+	  r->stats.piped_in += sz;
+	  continue;
+	}
+    }
+  if (zfd != -1)
+    close (zfd);
+  relay_setappend (r, flags);
+}
+
+// Relay of fan-out to the input pipes of the command groups, pfds[0] and
+// tfds.  A chunk of input is spliced into the private pipe of an open
+// group and duplicated into the others with tee, then each private pipe
+// is moved into the input pipe of its group as the group takes it.  The
+// next chunk is read when every group has taken the last one, so the
+// slowest group sets the pace, and the input is consumed up to the
+// lowest position of the groups.  A group closing its input early is
+// dropped from the fan-out.
+static void
+relay_tee (struct relay *r)
+{
+  int flags = relay_noappend (r);
+  int n = r->ntee + 1;
+  int cfds[n];
+  int bfds[n][2];
+  size_t held[n];
+  int iseek = S_ISREG (r->st[0].st_mode);
+  int oseek = S_ISREG (r->st[1].st_mode);
+  long pagesize = sysconf (_SC_PAGESIZE);
+  size_t bsize = r->bufsize;
+  off_t ioff = r->ipos;
+  int idone = 0;
+  int nopen = n;
+  // the window is closed at the same input position since stalled
+  uint64_t stalled = 0;
+  off_t stall_pos = -1;
+  char *buf = NULL;
+  for (int k = 0; k < n; k++)
+    {
+      cfds[k] = k == 0 ? r->pfds[0] : r->tfds[k - 1];
+      if (pipe2 (bfds[k], O_CLOEXEC) == -1)
+	{
+	  perror ("pipe");
+	  exit (EXIT_FAILURE);
+	}
+      // same size for all, so that tee takes a whole chunk
+      size_t size = setpipesize (bfds[k][1], r->psize[0]);
+      if (bsize > size)
+	bsize = size;
+      held[k] = 0;
+    }
+  signal (SIGPIPE, SIG_IGN);
+  while (1)
+    {
+      fd_set rfds, wfds;
+      int maxfd = -1;
+      FD_ZERO (&rfds);
+      FD_ZERO (&wfds);
+      // CONSUMED POSITION
+      off_t ipos = ioff;
+      size_t isize = 0;
+      int empty = 1;
+      for (int k = 0; k < n; k++)
+	{
+	  int pending = 0;
+	  if (cfds[k] == -1)
+	    continue;
+	  if (ioctl (cfds[k], FIONREAD, &pending) == -1)
+	    {
+	      perror ("ioctl(..., FIONREAD)");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (ipos > ioff - (off_t) held[k] - pending)
+	    ipos = ioff - held[k] - pending;
+	  if (isize < held[k] + pending)
+	    isize = held[k] + pending;
+	  if (held[k] > 0)
+	    empty = 0;
+	  // CLOSE
+	  if (idone && held[k] == 0 && pending == 0)
+	    {
+	      close (cfds[k]);
+	      cfds[k] = -1;
+	      nopen--;
+	    }
+	}
+      if (nopen == 0)
+	idone = 1;
+      if (ipos > r->ipos)
+	relay_punchhole (r, nopen == 0 ? ipos : ipos / pagesize * pagesize);
+      r->ipos = ipos;
+      if (nopen == 0 && !r->iclosed)
+	{
+	  r->iclosed = 1;
+	  r->ieof = 1;
+	}
+      if (r->oeof && r->iclosed)
+	break;
+      relay_step (r, isize, 0);
+      relay_cache (r);
+      int readable = !idone && empty;
+      if (readable && !iseek)
+	{
+	  FD_SET (r->fds[0], &rfds);
+	  if (maxfd < r->fds[0])
+	    maxfd = r->fds[0];
+	}
+      for (int k = 0; k < n; k++)
+	if (cfds[k] != -1 && held[k] > 0)
+	  {
+	    FD_SET (cfds[k], &wfds);
+	    if (maxfd < cfds[k])
+	      maxfd = cfds[k];
+	  }
+      if (!r->oeof && relay_wlimit (r, r->opos, SIZE_MAX) > 0)
+	{
+	  FD_SET (r->pfds[1], &rfds);
+	  if (maxfd < r->pfds[1])
+	    maxfd = r->pfds[1];
+	}
+      if (maxfd == -1 && !readable && !(idone && !r->iclosed))
+	relay_exceeded (r, isize, 0);
+      // a regular input is read without waiting, the commands consume
+      // the last input without any event, and the first one may be
+      // blocked on its output while the window is closed
+      int closed = relay_wlimit (r, r->opos, SIZE_MAX) == 0;
+      struct timeval tv = {.tv_sec = 0,.tv_usec = readable ? 0 : 10000 };
+      if (!readable && !idone && closed)
+	tv.tv_usec = STALL_TIMEOUT_MS * 1000;
+      enum stats_time wait = closed ? TIME_WINDOW : TIME_COMMAND;
+      uint64_t t = relay_clock (r);
+      int ret = select (maxfd + 1, &rfds, &wfds, NULL,
+			(readable && iseek) || (idone && !r->iclosed)
+			|| closed ? &tv : NULL);
+      relay_call (r, CALL_WAIT, wait, t);
+      if (ret == -1 && errno == EINTR)
+	continue;
+      if (ret == -1)
+	{
+	  perror ("select");
+	  exit (EXIT_FAILURE);
+	}
+      // STALL
+      if (!closed || r->iclosed || ret > 0 || r->ipos != stall_pos)
+	{
+	  stalled = clock_ns ();
+	  stall_pos = r->ipos;
+	}
+      else if (clock_ns () - stalled >= STALL_TIMEOUT_MS * 1000000ULL)
+	{
+	  relay_stalled (r, isize, 0);
+	  stalled = clock_ns ();
+	}
+      if (FD_ISSET (r->pfds[1], &rfds))
+	{
+	  off_t off = r->opos;
+	  uint64_t t = relay_clock (r);
+	  ssize_t sz = splice (r->pfds[1], NULL, r->fds[1],
+			       oseek ? &off : NULL,
+			       relay_wlimit (r, r->opos, r->bufsize),
+			       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	  relay_call (r, CALL_SPLICE, TIME_WRITE, t);
+	  if (sz == -1 && errno != EAGAIN)
+	    {
+	      perror ("splice");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (sz == 0)
+	    r->oeof = 1;
+	  else if (sz > 0)
+	    {
+	      relay_pipestat (r, 1, (size_t) sz >= r->psize[1]);
+	      r->opos += sz;
+	      r->stats.piped_out += sz;
+	      r->stats.written += sz;
+	    }
+	}
+      for (int k = 0; k < n; k++)
+	{
+	  if (cfds[k] == -1 || !FD_ISSET (cfds[k], &wfds))
+	    continue;
+	  uint64_t t = relay_clock (r);
+	  ssize_t sz = splice (bfds[k][0], NULL, cfds[k], NULL, held[k],
+			       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	  relay_call (r, CALL_SPLICE, TIME_NONE, t);
+	  if (sz == -1 && errno == EPIPE)
+	    {
+	      if (r->opt->verbose)
+		fprintf (stderr, _("fan-out: command group %d quit early\n"),
+			 k + 1);
+	      close (cfds[k]);
+	      cfds[k] = -1;
+	      nopen--;
+	      held[k] = 0;
+	      continue;
+	    }
+	  if (sz == -1 && errno != EAGAIN)
+	    {
+	      perror ("splice");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (sz == -1)
+	    {
+	      if (k == 0)
+		relay_pipestat (r, 0, 1);
+	      continue;
+	    }
+	  if (k == 0)
+	    relay_pipestat (r, 0, (size_t) sz < held[k]);
+	  held[k] -= sz;
+	}
+      if (readable && (iseek || FD_ISSET (r->fds[0], &rfds)))
+	{
+	  // the private pipe of the first open group is the source of tee
+	  int src = 0;
+	  while (cfds[src] == -1)
+	    src++;
+	  size_t rsize = bsize;
+	  if (r->overwrite && r->opt->append
+	      && (uintmax_t) (r->st[0].st_size - ioff) < rsize)
+	    rsize = r->st[0].st_size - ioff;
+	  off_t off = ioff;
+	  uint64_t t = relay_clock (r);
+	  ssize_t sz = rsize == 0 ? 0
+	    : splice (r->fds[0], iseek ? &off : NULL, bfds[src][1], NULL,
+		      rsize, SPLICE_F_MOVE);
+	  relay_call (r, CALL_SPLICE, TIME_READ, t);
+	  // an input which cannot be spliced, e.g. /dev/null, is read, and
+	  // the empty pipe takes the chunk without blocking
+	  if (sz == -1 && errno == EINVAL)
+	    {
+	      if (buf == NULL && (buf = malloc (bsize)) == NULL)
+		{
+		  perror ("malloc");
+		  exit (EXIT_FAILURE);
+		}
+	      t = relay_clock (r);
+	      sz = iseek ? pread (r->fds[0], buf, rsize, ioff)
+		: read (r->fds[0], buf, rsize);
+	      relay_call (r, CALL_READ, TIME_READ, t);
+	      if (sz > 0 && write (bfds[src][1], buf, sz) != sz)
+		{
+		  perror ("write");
+		  exit (EXIT_FAILURE);
+		}
+	    }
+	  if (sz == -1 && errno == EINTR)
+	    continue;
+	  if (sz == -1)
+	    {
+	      perror ("splice");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (sz == 0)
+	    idone = 1;
+	  held[src] = sz;
+	  for (int k = src + 1; k < n && sz > 0; k++)
+	    {
+	      if (cfds[k] == -1)
+		continue;
+	      // the private pipe is empty, so it takes the whole chunk
+	      t = relay_clock (r);
+	      ssize_t tsz = tee (bfds[src][0], bfds[k][1], sz, 0);
+	      relay_call (r, CALL_SPLICE, TIME_NONE, t);
+	      if (tsz == -1)
+		{
+		  perror ("tee");
+		  exit (EXIT_FAILURE);
+		}
+	      if (tsz != sz)
+		{
+		  fprintf (stderr, _("tee: short duplication\n"));
+		  exit (EXIT_FAILURE);
+		}
+	      held[k] = sz;
+	    }
+	  ioff += sz;
+	  r->stats.read += sz;
+	  r->stats.piped_in += sz;
+	}
+    }
+  signal (SIGPIPE, SIG_DFL);
+  for (int k = 0; k < n; k++)
+    {
+      close (bfds[k][0]);
+      close (bfds[k][1]);
+    }
+  free (buf);
+  relay_setappend (r, flags);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#define URING_DEPTH 8
+
+enum uring_op
+{
+  URING_IREAD,
+  URING_IWRITE,
+  URING_OREAD,
+  URING_OWRITE,
+  URING_OSPILL,
+};
+
+#define URING_DATA(op, index) ((uint64_t) (index) << 3 | (op))
+
+struct uring_chunk
+{
+  char *buf;
+  off_t off;
+  size_t size;
+  size_t len;
+  size_t sent;
+  size_t done;
+  int busy:1;
+  int ready:1;
+};
+
+struct uring_queue
+{
+  struct uring_chunk chunk[URING_DEPTH];
+  size_t size;
+  unsigned head;
+  unsigned count;
+};
+
+#define URING_CHUNK(q, k) (&(q)->chunk[((q)->head + (k)) % URING_DEPTH])
+
+static void
+uring_queue_init (struct uring_queue *q, size_t size)
+{
+  memset (q, 0, sizeof (*q));
+  q->size = size;
+  for (int i = 0; i < URING_DEPTH; i++)
+    {
+      int ret = posix_memalign ((void **) &q->chunk[i].buf,
+				sysconf (_SC_PAGESIZE), size);
+      if (ret != 0)
+	{
+	  errno = ret;
+	  perror ("posix_memalign");
+	  exit (EXIT_FAILURE);
+	}
+    }
+}
+
+static void
+uring_queue_free (struct uring_queue *q)
+{
+  for (int i = 0; i < URING_DEPTH; i++)
+    free (q->chunk[i].buf);
+}
+
+static size_t
+uring_queue_held (struct uring_queue *q)
+{
+  size_t held = 0;
+  for (unsigned k = 0; k < q->count; k++)
+    {
+      struct uring_chunk *c = URING_CHUNK (q, k);
+      if (!c->busy || c->sent > 0)
+	held += c->len - c->done;
+    }
+  return held;
+}
+
+static void
+uring_submit (struct uring *ring, enum uring_op op, int fd, void *buf,
+	      size_t len, off_t off, unsigned index)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe (ring);
+  if (sqe == NULL)
+    {
+      fprintf (stderr, _("io_uring submission queue exceeded\n"));
+      exit (EXIT_FAILURE);
+    }
+  int opcode = op == URING_IREAD || op == URING_OREAD
+    ? IORING_OP_READ : IORING_OP_WRITE;
+  uring_prep_rw (sqe, opcode, fd, buf, len, off, URING_DATA (op, index));
+}
+
+static void
+uring_cancel (struct uring *ring, enum uring_op op, unsigned index)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe (ring);
+  if (sqe == NULL)
+    {
+      fprintf (stderr, _("io_uring submission queue exceeded\n"));
+      exit (EXIT_FAILURE);
+    }
+  uring_prep_cancel (sqe, URING_DATA (op, index));
+}
+
+// Relay with io_uring.  Reads from a regular input file and writes to a
+// regular output file are issued at explicit offsets, so that up to
+// URING_DEPTH of them are in flight at once.  Pipe and non seekable I/O
+// keeps one request in flight for each direction to preserve ordering.
+// Returns -1 when io_uring is not available.
+static int
+relay_uring (struct relay *r)
+{
+  struct uring ring;
+  if (uring_init (&ring, URING_DEPTH * 4) == -1)
+    return -1;
+  int flags = fcntl (r->fds[1], F_GETFL);
+  if (flags == -1)
+    {
+      perror ("fcntl(..., F_GETFL)");
+      exit (EXIT_FAILURE);
+    }
+  int iseek = S_ISREG (r->st[0].st_mode);
+  int oseek = S_ISREG (r->st[1].st_mode) && (flags & O_APPEND) == 0;
+  struct uring_queue iq;
+  struct uring_queue oq;
+  size_t isize = r->bufsize / URING_DEPTH;
+  size_t osize = r->bufsize / URING_DEPTH;
+  if (isize < (size_t) r->st[0].st_blksize)
+    isize = r->st[0].st_blksize;
+  if (osize < (size_t) r->st[1].st_blksize)
+    osize = r->st[1].st_blksize;
+  uring_queue_init (&iq, isize);
+  uring_queue_init (&oq, osize);
+  off_t ioff = r->ipos;
+  off_t oend = r->opos;
+  int inoread = 0;
+  int iwbusy = 0;
+  int orbusy = 0;
+  unsigned ibusy = 0;
+  unsigned owbusy = 0;
+  unsigned inflight = 0;
+  uintmax_t nsubmit = 0;
+  uintmax_t ncomplete = 0;
+  uintmax_t nbatch = 0;
+  while (1)
+    {
+      int changed = 0;
+      // ACCOUNT INPUT IN FILE ORDER
+      for (unsigned k = 0; k < iq.count; k++)
+	{
+	  struct uring_chunk *c = URING_CHUNK (&iq, k);
+	  if (c->busy)
+	    break;
+	  if (c->ready)
+	    continue;
+	  c->ready = 1;
+	  c->off = r->ipos;
+	  if (c->len == 0)
+	    {
+	      inoread = 1;
+	      continue;
+	    }
+	  relay_punchhole (r, r->ipos + c->len);
+	  r->ipos += c->len;
+	}
+      while (iq.count > 0 && URING_CHUNK (&iq, 0)->ready
+	     && URING_CHUNK (&iq, 0)->done == URING_CHUNK (&iq, 0)->len)
+	{
+	  iq.head = (iq.head + 1) % URING_DEPTH;
+	  iq.count--;
+	}
+      if (inoread && ibusy == 0 && !r->ieof)
+	{
+	  r->ieof = 1;
+	  changed = 1;
+	}
+      // CLOSE
+      if (r->ieof && iq.count == 0 && !iwbusy && !r->iclosed)
+	{
+	  close (r->pfds[0]);
+	  r->iclosed = 1;
+	  changed = 1;
+	}
+      while (oq.count > 0
+	     && URING_CHUNK (&oq, 0)->done == URING_CHUNK (&oq, 0)->len)
+	{
+	  oq.head = (oq.head + 1) % URING_DEPTH;
+	  oq.count--;
+	}
+      // REFILL
+      while (spill_len (&r->spill) > 0 && oq.count < URING_DEPTH)
+	{
+	  struct uring_chunk *c = URING_CHUNK (&oq, oq.count);
+	  struct ringbuf rb = {.buf = c->buf,.size = oq.size };
+	  spill_refill (&r->spill, &rb);
+	  c->off = oend;
+	  c->len = rb.len;
+	  c->sent = 0;
+	  c->done = 0;
+	  c->busy = 0;
+	  oend += rb.len;
+	  oq.count++;
+	}
+      r->opos = oq.count > 0
+	? URING_CHUNK (&oq, 0)->off + (off_t) URING_CHUNK (&oq, 0)->done
+	: oend;
+      if (r->oeof && oq.count == 0 && spill_len (&r->spill) == 0)
+	break;
+      relay_step (r, uring_queue_held (&iq),
+		  uring_queue_held (&oq) + spill_len (&r->spill));
+      relay_cache (r);
+      // SUBMIT
+      if (!iwbusy && iq.count > 0 && !r->iclosed)
+	{
+	  struct uring_chunk *c = URING_CHUNK (&iq, 0);
+	  if (c->ready && c->done < c->len)
+	    {
+	      // writes to the pipe complete in full, so see the pipe here
+	      int pending;
+	      if (ioctl (r->pfds[0], FIONREAD, &pending) == 0)
+		relay_pipestat (r, 0,
+				pending + (c->len - c->done) >= r->psize[0]);
+	      uring_submit (&ring, URING_IWRITE, r->pfds[0], c->buf + c->done,
+			    c->len - c->done, -1, c - iq.chunk);
+	      iwbusy = 1;
+	      inflight++;
+	    }
+	}
+      while (!inoread && iq.count < URING_DEPTH && (iseek || ibusy == 0))
+	{
+	  size_t size = iq.size;
+	  if (r->overwrite && r->opt->append
+	      && r->st[0].st_size - ioff < (off_t) size)
+	    size = r->st[0].st_size - ioff;
+	  if (size == 0)
+	    {
+	      inoread = 1;
+	      changed = 1;
+	      break;
+	    }
+	  struct uring_chunk *c = URING_CHUNK (&iq, iq.count);
+	  c->size = size;
+	  c->len = 0;
+	  c->done = 0;
+	  c->busy = 1;
+	  c->ready = 0;
+	  uring_submit (&ring, URING_IREAD, r->fds[0], c->buf, size,
+			iseek ? ioff : -1, c - iq.chunk);
+	  ioff += size;
+	  iq.count++;
+	  ibusy++;
+	  inflight++;
+	}
+      for (unsigned k = 0; k < oq.count; k++)
+	{
+	  struct uring_chunk *c = URING_CHUNK (&oq, k);
+	  if (c->sent == c->len)
+	    continue;
+	  if (c->busy || (!oseek && owbusy > 0))
+	    break;
+	  size_t wsize = relay_wlimit (r, c->off + c->sent, c->len - c->sent);
+	  if (wsize == 0)
+	    break;
+	  uring_submit (&ring, URING_OWRITE, r->fds[1], c->buf + c->sent,
+			wsize, oseek ? c->off + (off_t) c->sent : -1,
+			c - oq.chunk);
+	  c->size = wsize;
+	  c->sent += wsize;
+	  c->busy = 1;
+	  owbusy++;
+	  inflight++;
+	}
+      int ospill = r->opt->spill && (spill_len (&r->spill) > 0
+				     || (oq.count == URING_DEPTH
+					 && owbusy == 0));
+      if (!r->oeof && !orbusy && ospill)
+	{
+	  struct io_uring_sqe *sqe = uring_get_sqe (&ring);
+	  if (sqe == NULL)
+	    {
+	      fprintf (stderr, _("io_uring submission queue exceeded\n"));
+	      exit (EXIT_FAILURE);
+	    }
+	  spill_reserve (&r->spill, oq.size);
+	  uring_prep_splice (sqe, r->pfds[1], -1, r->spill.fd, r->spill.wpos,
+			     oq.size, URING_DATA (URING_OSPILL, 0));
+	  r->spill.busy = 1;
+	  orbusy = 1;
+	  inflight++;
+	}
+      else if (!r->oeof && !orbusy && oq.count < URING_DEPTH)
+	{
+	  struct uring_chunk *c = URING_CHUNK (&oq, oq.count);
+	  uring_submit (&ring, URING_OREAD, r->pfds[1], c->buf, oq.size, -1,
+			c - oq.chunk);
+	  orbusy = 1;
+	  inflight++;
+	}
+      if (inflight == 0)
+	{
+	  if (changed)
+	    continue;
+	  if (r->ieof && iq.count == 0 && r->oeof && oq.count == 0)
+	    break;
+	  relay_exceeded (r, uring_queue_held (&iq),
+			  uring_queue_held (&oq) + spill_len (&r->spill));
+	}
+      // WAIT
+      enum stats_time wait = owbusy == 0 && oq.count > 0
+	? TIME_WINDOW : TIME_COMMAND;
+      uint64_t t = relay_clock (r);
+      int submitted = uring_enter (&ring, 1);
+      relay_call (r, CALL_WAIT, wait, t);
+      if (submitted == -1)
+	{
+	  perror ("io_uring_enter");
+	  exit (EXIT_FAILURE);
+	}
+      unsigned completed = 0;
+      struct io_uring_cqe *cqe;
+      while ((cqe = uring_peek_cqe (&ring)) != NULL)
+	{
+	  enum uring_op op = cqe->user_data & 7;
+	  unsigned index = cqe->user_data >> 3;
+	  int res = cqe->res;
+	  uring_cqe_seen (&ring);
+	  completed++;
+	  inflight--;
+	  // the command quit without reading all of its input
+	  if (op == URING_IWRITE && res == -EPIPE)
+	    {
+	      relay_call (r, CALL_WRITE, TIME_NONE, 0);
+	      iwbusy = 0;
+	      close (r->pfds[0]);
+	      r->iclosed = 1;
+	      inoread = 1;
+	      continue;
+	    }
+	  if (res < 0)
+	    {
+	      errno = -res;
+	      perror (op == URING_IREAD || op == URING_OREAD ? "read"
+		      : op == URING_OSPILL ? "splice" : "write");
+	      exit (EXIT_FAILURE);
+	    }
+	  struct uring_chunk *c;
+	  switch (op)
+	    {
+	    case URING_IREAD:
+	      relay_call (r, CALL_READ, TIME_NONE, 0);
+	      r->stats.read += res;
+	      c = &iq.chunk[index];
+	      c->busy = 0;
+	      c->len = res;
+	      ibusy--;
+	      if (iseek && (size_t) res < c->size)
+		inoread = 1;
+	      break;
+	    case URING_IWRITE:
+	      relay_call (r, CALL_WRITE, TIME_NONE, 0);
+	      r->stats.piped_in += res;
+	      iq.chunk[index].done += res;
+	      iwbusy = 0;
+	      break;
+	    case URING_OREAD:
+	      relay_call (r, CALL_READ, TIME_NONE, 0);
+	      r->stats.piped_out += res;
+	      orbusy = 0;
+	      if (res == 0)
+		{
+		  r->oeof = 1;
+		  break;
+		}
+	      relay_pipestat (r, 1, (size_t) res >= r->psize[1]
+			      || (size_t) res == oq.size);
+	      c = &oq.chunk[index];
+	      c->off = oend;
+	      c->len = res;
+	      c->sent = 0;
+	      c->done = 0;
+	      c->busy = 0;
+	      oend += res;
+	      oq.count++;
+	      break;
+	    case URING_OSPILL:
+	      relay_call (r, CALL_SPLICE, TIME_NONE, 0);
+	      r->stats.piped_out += res;
+	      orbusy = 0;
+	      r->spill.busy = 0;
+	      if (res == 0)
+		r->oeof = 1;
+	      else
+		spill_stored (&r->spill, res);
+	      break;
+	    case URING_OWRITE:
+	      relay_call (r, CALL_WRITE, TIME_NONE, 0);
+	      r->stats.written += res;
+	      c = &oq.chunk[index];
+	      c->done += res;
+	      if ((size_t) res < c->size)
+		c->sent = c->done;
+	      c->busy = 0;
+	      owbusy--;
+	      break;
+	    }
+	}
+      nsubmit += submitted;
+      ncomplete += completed;
+      nbatch++;
+      if (r->opt->verbose)
+	fprintf (stderr, _("uring: %d submitted, %u completed\n"), submitted,
+		 completed);
+    }
+  // CANCEL REQUESTS LEFT BEHIND THE OUTPUT END
+  if (inflight > 0)
+    {
+      for (unsigned k = 0; k < iq.count; k++)
+	{
+	  struct uring_chunk *c = URING_CHUNK (&iq, k);
+	  if (c->busy)
+	    uring_cancel (&ring, URING_IREAD, c - iq.chunk);
+	}
+      if (iwbusy)
+	uring_cancel (&ring, URING_IWRITE, iq.head);
+      while (inflight > 0)
+	{
+	  if (uring_enter (&ring, 1) == -1)
+	    {
+	      perror ("io_uring_enter");
+	      exit (EXIT_FAILURE);
+	    }
+	  struct io_uring_cqe *cqe;
+	  while ((cqe = uring_peek_cqe (&ring)) != NULL)
+	    {
+	      if (cqe->user_data != UINT64_MAX)
+		inflight--;
+	      uring_cqe_seen (&ring);
+	    }
+	}
+    }
+  if (r->opt->verbose)
+    fprintf (stderr,
+	     _("uring: %ju submissions, %ju completions in %ju batches\n"),
+	     nsubmit, ncomplete, nbatch);
+  uring_queue_free (&iq);
+  uring_queue_free (&oq);
+  uring_exit (&ring);
+  return 0;
+}
+
+#endif
+
+// Chunk of the input in parallel mode.  Each chunk runs its own command,
+// and its output is held in a spill until the output of the preceding
+// chunks is written.
+struct chunk
+{
+  pid_t *pids;
+  int ifd;
+  int ofd;
+  off_t pos;
+  off_t end;
+  struct ringbuf ib;
+  struct spill out;
+};
+
+// End of the chunk starting at start: the record delimiter after size
+// bytes.
+static off_t
+relay_chunkend (const struct relay *r, off_t start, off_t size)
+{
+  off_t end = start + size - 1;
+  char buf[BUFSIZ];
+  while (end < r->st[0].st_size)
+    {
+      ssize_t sz = pread (r->fds[0], buf, sizeof (buf), end);
+      if (sz == -1)
+	{
+	  perror ("read");
+	  exit (EXIT_FAILURE);
+	}
+      if (sz == 0)
+	break;
+      char *p = memchr (buf, r->opt->delim, sz);
+      if (p != NULL)
+	return end + (p - buf) + 1;
+      end += sz;
+    }
+  return r->st[0].st_size;
+}
+
+static struct chunk *
+relay_chunkstart (const struct relay *r, off_t start, off_t end)
+{
+  struct chunk *c = malloc (sizeof (*c));
+  if (c == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  int ipfds[2];
+  int opfds[2];
+  if (pipe2 (ipfds, O_CLOEXEC) == -1 || pipe2 (opfds, O_CLOEXEC) == -1)
+    {
+      perror ("pipe");
+      exit (EXIT_FAILURE);
+    }
+  size_t psize = r->bufsize < r->pmax ? r->bufsize : r->pmax;
+  setpipesize (ipfds[1], psize);
+  setpipesize (opfds[0], psize);
+  c->pids = malloc (sizeof (*c->pids) * r->nstage);
+  if (c->pids == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  spawn_pipeline (r->stages, r->nstage, ipfds[0], opfds[1], psize, c->pids);
+  close (ipfds[0]);
+  close (opfds[1]);
+  c->ifd = ipfds[1];
+  c->ofd = opfds[0];
+  for (int i = 0; i < 2; i++)
+    {
+      int fd = i == 0 ? c->ifd : c->ofd;
+      int flags = fcntl (fd, F_GETFL);
+      if (flags == -1 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+	  perror ("fcntl");
+	  exit (EXIT_FAILURE);
+	}
+    }
+  c->pos = start;
+  c->end = end;
+  ringbuf_init (&c->ib, r->bufsize);
+  if (r->cache[0].policy == CACHE_DIRECT)
+    ringbuf_align (&c->ib, DIRECT_ALIGN, start);
+  spill_init (&c->out, (r->opt->spill_memory == 0
+			? DEFAULT_SPILL_MEMORY
+			: r->opt->spill_memory) / r->opt->jobs, 0);
+  return c;
+}
+
+// The command of the chunk does not want the rest of the input.
+static void
+relay_chunkclose (struct chunk *c)
+{
+  if (c->ifd != -1)
+    {
+      close (c->ifd);
+      c->ifd = -1;
+    }
+  c->pos = c->end;
+  ringbuf_consume (&c->ib, c->ib.len);
+}
+
+// The command of the chunk finished its output.
+static void
+relay_chunkdone (struct relay *r, struct chunk *c)
+{
+  close (c->ofd);
+  c->ofd = -1;
+  relay_chunkclose (c);
+  int status = wait_pipeline (c->pids, r->nstage);
+  if (status != EXIT_SUCCESS)
+    r->status = status;
+}
+
+// Journal of parallel mode.  A checkpoint is taken at a chunk boundary,
+// where the output up to opos is the output of the commands on the input
+// up to ipos.  The output is written to the file only before the input
+// position of the last checkpoint, so that the input after it is kept
+// for resume; the rest of the output is held in the data area of the
+// journal, from wpos at joff, until a later checkpoint frees the input.
+
+#define JOURNAL_HEADER 4096
+#define JOURNAL_SLOT 512
+#define JOURNAL_DATA (JOURNAL_HEADER * 2)
+
+struct checkpoint
+{
+  uint64_t seq;
+  int64_t ipos;
+  int64_t opos;
+  int64_t wpos;
+  int64_t joff;
+  uint64_t sum;
+};
+
+// FNV-1a hash.
+static uint64_t
+journal_hash (uint64_t hash, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+// Header of the journal, which identifies the files and the command.
+static void
+journal_header (const struct relay *r, char *buf, off_t size)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int k = 0; k < r->nstage; k++)
+    for (char **arg = r->stages[k]; *arg != NULL; arg++)
+      hash = journal_hash (hash, *arg, strlen (*arg) + 1);
+  memset (buf, 0, JOURNAL_HEADER);
+  snprintf (buf, JOURNAL_HEADER,
+	    "ow journal 1\ninput %ju %ju %jd\noutput %ju %ju\n"
+	    "command %016" PRIx64 "\n", (uintmax_t) r->st[0].st_dev,
+	    (uintmax_t) r->st[0].st_ino, (intmax_t) size,
+	    (uintmax_t) r->st[1].st_dev, (uintmax_t) r->st[1].st_ino, hash);
+}
+
+static void
+journal_sync (const struct relay *r, int fd)
+{
+  if (fdatasync (fd) == -1)
+    {
+      perror (fd == r->jfd ? r->opt->journal : "fdatasync");
+      exit (EXIT_FAILURE);
+    }
+}
+
+// Write back the output held in the journal as far as the input is free.
+static void
+relay_jflush (struct relay *r)
+{
+  char buf[BUFSIZ * 8];
+  while (r->jlen > 0)
+    {
+      size_t len = relay_wlimit (r, r->opos, r->jlen < (off_t) sizeof (buf)
+				 ? (size_t) r->jlen : sizeof (buf));
+      if (len == 0)
+	break;
+      ssize_t sz = pread (r->jfd, buf, len, r->joff);
+      if (sz <= 0)
+	{
+	  if (sz == 0)
+	    errno = EIO;
+	  perror (r->opt->journal);
+	  exit (EXIT_FAILURE);
+	}
+      if (pwrite (r->fds[1], buf, sz, r->opos) != sz)
+	{
+	  perror ("write");
+	  exit (EXIT_FAILURE);
+	}
+      r->stats.calls[CALL_WRITE]++;
+      r->stats.written += sz;
+      r->opos += sz;
+      r->joff += sz;
+      r->jlen -= sz;
+    }
+  if (lseek (r->fds[1], r->opos, SEEK_SET) == -1)
+    {
+      perror ("lseek");
+      exit (EXIT_FAILURE);
+    }
+}
+
+// Hold the output which cannot be written to the file in the journal.
+static void
+relay_jwrite (struct relay *r, struct ringbuf *ob)
+{
+  struct iovec iov[2];
+  uint64_t t = relay_clock (r);
+  ssize_t sz = pwritev (r->jfd, iov, ringbuf_wvec (ob, iov, ob->len),
+			r->joff + r->jlen);
+  relay_call (r, CALL_WRITE, TIME_WRITE, t);
+  if (sz == -1)
+    {
+      perror (r->opt->journal);
+      exit (EXIT_FAILURE);
+    }
+  ringbuf_consume (ob, sz);
+  r->jlen += sz;
+}
+
+// Take a checkpoint at input position ipos, after all of its output is
+// written to the file or the journal.
+static void
+relay_jcommit (struct relay *r, off_t ipos)
+{
+  if (r->jlen == 0)
+    r->joff = JOURNAL_DATA;
+  journal_sync (r, r->fds[1]);
+  journal_sync (r, r->jfd);
+  struct checkpoint cp = {
+    .seq = ++r->jseq,
+    .ipos = ipos,
+    .opos = r->opos + r->jlen,
+    .wpos = r->opos,
+    .joff = r->joff,
+  };
+  cp.sum = journal_hash (0xcbf29ce484222325ULL, &cp,
+			 offsetof (struct checkpoint, sum));
+  if (pwrite (r->jfd, &cp, sizeof (cp),
+	      JOURNAL_HEADER + cp.seq % 2 * JOURNAL_SLOT) != sizeof (cp))
+    {
+      perror (r->opt->journal);
+      exit (EXIT_FAILURE);
+    }
+  journal_sync (r, r->jfd);
+  // the data before the checkpoint is not needed any more
+  if (r->jlen == 0)
+    {
+      if (ftruncate (r->jfd, JOURNAL_DATA) == -1)
+	{
+	  perror (r->opt->journal);
+	  exit (EXIT_FAILURE);
+	}
+      r->jfree = JOURNAL_DATA;
+    }
+  else if (r->joff > r->jfree)
+    {
+      if (fallocate (r->jfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		     r->jfree, r->joff - r->jfree) == 0)
+	r->jfree = r->joff;
+      r->stats.calls[CALL_FALLOCATE]++;
+    }
+  r->jipos = ipos;
+  if (r->opt->verbose)
+    fprintf (stderr, _("journal: checkpoint at %jd/%jd\n"),
+	     (intmax_t) ipos, (intmax_t) cp.opos);
+  relay_jflush (r);
+}
+
+// Open the journal, or resume from its last checkpoint.
+static void
+relay_jopen (struct relay *r)
+{
+  char header[JOURNAL_HEADER];
+  if (!r->opt->resume)
+    {
+      r->jfd = open (r->opt->journal, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+		     0600);
+      if (r->jfd == -1)
+	{
+	  perror (r->opt->journal);
+	  exit (EXIT_FAILURE);
+	}
+      if (!r->overwrite && S_ISREG (r->st[1].st_mode)
+	  && ftruncate (r->fds[1], 0) == -1)
+	{
+	  perror ("ftruncate");
+	  exit (EXIT_FAILURE);
+	}
+      journal_header (r, header, r->st[0].st_size);
+      if (pwrite (r->jfd, header, sizeof (header), 0) != sizeof (header))
+	{
+	  perror (r->opt->journal);
+	  exit (EXIT_FAILURE);
+	}
+      relay_jcommit (r, r->ipos);
+      return;
+    }
+  r->jfd = open (r->opt->journal, O_RDWR | O_CLOEXEC);
+  if (r->jfd == -1)
+    {
+      perror (r->opt->journal);
+      exit (EXIT_FAILURE);
+    }
+  char expect[JOURNAL_HEADER];
+  uintmax_t dev, ino;
+  intmax_t size;
+  if (pread (r->jfd, header, sizeof (header), 0) != sizeof (header)
+      || sscanf (header, "ow journal 1\ninput %ju %ju %jd", &dev, &ino,
+		 &size) != 3)
+    {
+      fprintf (stderr, _("invalid journal: %s\n"), r->opt->journal);
+      exit (EXIT_FAILURE);
+    }
+  journal_header (r, expect, size);
+  if (memcmp (header, expect, sizeof (header)) != 0)
+    {
+      fprintf (stderr, _("journal of other files or command: %s\n"),
+	       r->opt->journal);
+      exit (EXIT_FAILURE);
+    }
+  struct checkpoint cp = {.seq = 0 };
+  for (int i = 0; i < 2; i++)
+    {
+      struct checkpoint slot;
+      if (pread (r->jfd, &slot, sizeof (slot),
+		 JOURNAL_HEADER + i * JOURNAL_SLOT) == sizeof (slot)
+	  && slot.sum == journal_hash (0xcbf29ce484222325ULL, &slot,
+				       offsetof (struct checkpoint, sum))
+	  && slot.seq % 2 == (unsigned) i && slot.seq > cp.seq)
+	cp = slot;
+    }
+  if (cp.seq == 0)
+    {
+      fprintf (stderr, _("invalid journal: %s\n"), r->opt->journal);
+      exit (EXIT_FAILURE);
+    }
+  r->st[0].st_size = size;
+  r->jseq = cp.seq;
+  r->jipos = cp.ipos;
+  r->ipos = cp.ipos;
+  r->ieof = r->ipos == size;
+  r->opos = cp.wpos;
+  r->joff = cp.joff;
+  r->jlen = cp.opos - cp.wpos;
+  r->jfree = JOURNAL_DATA;
+  relay_jflush (r);
+  if (!r->overwrite && S_ISREG (r->st[1].st_mode)
+      && ftruncate (r->fds[1], r->opos) == -1)
+    {
+      perror ("ftruncate");
+      exit (EXIT_FAILURE);
+    }
+  if (r->opt->verbose)
+    fprintf (stderr, _("journal: resume at %jd/%jd\n"), (intmax_t) cp.ipos,
+	     (intmax_t) cp.opos);
+}
+
+// Relay in parallel mode.  The regular input file is split into chunks
+// at record delimiters, and up to jobs commands run on the chunks at
+// once.  The output is written in input order, behind the read position
+// of the slowest chunk.
+static void
+relay_parallel (struct relay *r)
+{
+  unsigned jobs = r->opt->jobs;
+  off_t size = r->st[0].st_size;
+  off_t csize = size / (jobs * 4);
+  if (csize < MIN_CHUNK_SIZE)
+    csize = MIN_CHUNK_SIZE;
+  if (csize > MAX_CHUNK_SIZE)
+    csize = MAX_CHUNK_SIZE;
+  struct chunk **chunks = NULL;
+  size_t nchunk = 0;
+  size_t nalloc = 0;
+  uintmax_t ntotal = 0;
+  unsigned running = 0;
+  off_t next = r->ipos;
+  struct ringbuf ob;
+  ringbuf_init (&ob, r->bufsize);
+  if (r->cache[1].policy == CACHE_DIRECT)
+    ringbuf_align (&ob, DIRECT_ALIGN, r->opos);
+  struct pollfd pfd[MAX_JOBS * 2 + 1];
+  struct chunk *pchunk[MAX_JOBS * 2 + 1];
+  r->status = EXIT_SUCCESS;
+  // a command may exit without reading all of its chunk
+  signal (SIGPIPE, SIG_IGN);
+  while (1)
+    {
+      // START
+      while (running < jobs && next < size)
+	{
+	  if (nchunk == nalloc)
+	    {
+	      nalloc = nalloc == 0 ? jobs * 2 : nalloc * 2;
+	      chunks = realloc (chunks, sizeof (*chunks) * nalloc);
+	      if (chunks == NULL)
+		{
+		  perror ("realloc");
+		  exit (EXIT_FAILURE);
+		}
+	    }
+	  off_t end = relay_chunkend (r, next, csize);
+	  chunks[nchunk++] = relay_chunkstart (r, next, end);
+	  next = end;
+	  running++;
+	  ntotal++;
+	}
+      // READ
+      off_t ipos = next;
+      for (size_t k = 0; k < nchunk; k++)
+	{
+	  struct chunk *c = chunks[k];
+	  struct iovec iov[2];
+	  int iovcnt = c->ifd == -1 ? 0
+	    : ringbuf_rvec (&c->ib, iov, rate_size (0, c->end - c->pos));
+	  if (iovcnt > 0)
+	    {
+	      rate_wait (0);
+	      uint64_t t = relay_clock (r);
+	      ssize_t sz = r->cache[0].policy == CACHE_DIRECT
+		? cache_io (&r->cache[0], iov, iovcnt, c->pos)
+		: preadv (r->fds[0], iov, iovcnt, c->pos);
+	      relay_call (r, CALL_READ, TIME_READ, t);
+	      rate_take (0, sz);
+	      if (sz == -1)
+		{
+		  perror ("read");
+		  exit (EXIT_FAILURE);
+		}
+	      if (sz == 0)
+		c->end = c->pos;
+	      ringbuf_produce (&c->ib, sz);
+	      c->pos += sz;
+	      r->stats.read += sz;
+	    }
+	  if (c->pos < c->end && c->pos < ipos)
+	    ipos = c->pos;
+	  // CLOSE
+	  if (c->ifd != -1 && c->pos == c->end && c->ib.len == 0)
+	    {
+	      close (c->ifd);
+	      c->ifd = -1;
+	    }
+	}
+      if (ipos > r->ipos)
+	{
+	  relay_punchhole (r, ipos);
+	  r->ipos = ipos;
+	}
+      if (r->ipos == size)
+	r->ieof = 1;
+      // REFILL IN INPUT ORDER
+      while (nchunk > 0)
+	{
+	  struct chunk *c = chunks[0];
+	  if (spill_len (&c->out) > 0 && ob.len < ob.size)
+	    spill_refill (&c->out, &ob);
+	  if (c->ofd != -1 || spill_len (&c->out) > 0)
+	    break;
+	  if (r->jfd != -1)
+	    {
+	      if (ob.len > 0)
+		break;
+	      if (r->status == EXIT_SUCCESS
+		  && (c->end - r->jipos >= (off_t) r->opt->journal_sync
+		      || c->end == size))
+		relay_jcommit (r, c->end);
+	    }
+	  spill_free (&c->out);
+	  ringbuf_free (&c->ib);
+	  free (c->pids);
+	  free (c);
+	  memmove (chunks, chunks + 1, sizeof (*chunks) * --nchunk);
+	}
+      if (nchunk == 0 && next == size && ob.len == 0)
+	break;
+      relay_step (r, 0, ob.len);
+      relay_cache (r);
+      int n = 0;
+      for (size_t k = 0; k < nchunk; k++)
+	{
+	  struct chunk *c = chunks[k];
+	  if (c->ifd != -1 && c->ib.len > 0)
+	    {
+	      pfd[n].fd = c->ifd;
+	      pfd[n].events = POLLOUT;
+	      pchunk[n++] = c;
+	    }
+	  if (c->ofd != -1)
+	    {
+	      pfd[n].fd = c->ofd;
+	      pfd[n].events = POLLIN;
+	      pchunk[n++] = c;
+	    }
+	}
+      if (ob.len > 0 && (r->jfd != -1 || relay_wlimit (r, r->opos, ob.len) > 0))
+	{
+	  pfd[n].fd = r->fds[1];
+	  pfd[n].events = POLLOUT;
+	  pchunk[n++] = NULL;
+	}
+      if (n == 0)
+	relay_exceeded (r, 0, ob.len);
+      enum stats_time wait = ob.len > 0
+	&& relay_wlimit (r, r->opos, ob.len) == 0 ? TIME_WINDOW : TIME_COMMAND;
+      uint64_t t = relay_clock (r);
+      int ret = poll (pfd, n, -1);
+      relay_call (r, CALL_WAIT, wait, t);
+      if (ret == -1 && errno == EINTR)
+	continue;
+      if (ret == -1)
+	{
+	  perror ("poll");
+	  exit (EXIT_FAILURE);
+	}
+      for (int i = 0; i < n; i++)
+	{
+	  struct chunk *c = pchunk[i];
+	  struct iovec iov[2];
+	  if (pfd[i].revents == 0)
+	    continue;
+	  if (c == NULL)
+	    {
+	      if (r->jfd != -1
+		  && (r->jlen > 0 || relay_wlimit (r, r->opos, ob.len) == 0))
+		{
+		  relay_jwrite (r, &ob);
+		  continue;
+		}
+	      size_t wsize = relay_wlimit (r, r->opos, ob.len);
+	      rate_wait (1);
+	      uint64_t t = relay_clock (r);
+	      int iovcnt = ringbuf_wvec (&ob, iov, rate_size (1, wsize));
+	      ssize_t sz = r->cache[1].policy == CACHE_DIRECT
+		? cache_io (&r->cache[1], iov, iovcnt, r->opos)
+		: writev (r->fds[1], iov, iovcnt);
+	      relay_call (r, CALL_WRITE, TIME_WRITE, t);
+	      rate_take (1, sz);
+	      if (sz == -1)
+		{
+		  perror ("write");
+		  exit (EXIT_FAILURE);
+		}
+	      ringbuf_consume (&ob, sz);
+	      r->opos += sz;
+	      r->stats.written += sz;
+	    }
+	  else if (pfd[i].fd == c->ofd)
+	    {
+	      ssize_t sz = spill_splice (&c->out, c->ofd, r->bufsize);
+	      relay_call (r, CALL_SPLICE, TIME_NONE, 0);
+	      if (sz == -1 && errno == EAGAIN)
+		continue;
+	      if (sz == -1)
+		{
+		  perror ("splice");
+		  exit (EXIT_FAILURE);
+		}
+	      if (sz == 0)
+		{
+		  relay_chunkdone (r, c);
+		  running--;
+		}
+	      r->stats.piped_out += sz;
+	    }
+	  else if (c->ifd != -1)
+	    {
+	      ssize_t sz =
+		writev (c->ifd, iov, ringbuf_wvec (&c->ib, iov, SIZE_MAX));
+	      relay_call (r, CALL_WRITE, TIME_NONE, 0);
+	      if (sz == -1 && errno == EAGAIN)
+		continue;
+	      if (sz == -1 && errno == EPIPE)
+		{
+		  relay_chunkclose (c);
+		  continue;
+		}
+	      if (sz == -1)
+		{
+		  perror ("write");
+		  exit (EXIT_FAILURE);
+		}
+	      ringbuf_consume (&c->ib, sz);
+	      r->stats.piped_in += sz;
+	    }
+	}
+    }
+  if (r->opt->verbose)
+    fprintf (stderr, _("parallel: %ju chunks of %ju bytes in %u jobs\n"),
+	     ntotal, (uintmax_t) csize, jobs);
+  free (chunks);
+  ringbuf_free (&ob);
+}
+
+static void
+relay (struct relay *r)
+{
+  const char *engine = r->opt->engine == NULL ? "auto" : r->opt->engine;
+  spill_init (&r->spill, r->opt->spill_memory == 0
+	      ? DEFAULT_SPILL_MEMORY : r->opt->spill_memory, r->opt->verbose);
+  r->punch_pos = r->ipos;
+  r->punch_end = r->ipos;
+  r->punch_batch = r->opt->punch_batch == 0
+    ? DEFAULT_PUNCH_BATCH : r->opt->punch_batch;
+  relay_stats_init (r);
+  if (r->opt->journal != NULL)
+    relay_jopen (r);
+  cache_init (&r->cache[0], r->fds[0], 0, r->opt->cache, r->ipos);
+  cache_init (&r->cache[1], r->fds[1], 1, r->opt->cache, r->opos);
+  if (S_ISREG (r->st[1].st_mode))
+    {
+      size_t blksize = r->st[1].st_blksize;
+      size_t batch = r->bufsize / 2 < WRITE_BATCH ? r->bufsize / 2
+	: WRITE_BATCH;
+      r->wbatch = batch > blksize ? batch / blksize * blksize : blksize;
+    }
+  relay_prealloc (r);
+  // direct transfers need the aligned buffers of select engine
+  if (r->cache[0].policy == CACHE_DIRECT || r->cache[1].policy == CACHE_DIRECT)
+    engine = "select";
+  // holes are filled or skipped in the buffers of select engine
+  if (r->opt->holes != HOLES_READ && strcmp (engine, "splice") != 0)
+    engine = "select";
+  // rates limit the reads and writes of select engine
+  if (rate_limited (r->opt))
+    engine = "select";
+  // checksums are taken in the buffers of select and thread engines
+  if (sum_enabled && strcmp (engine, "thread") != 0)
+    engine = "select";
+  // a command may exit without reading all of its input, and the file is
+  // still collapsed or restored after it
+  if (r->opt->collapse)
+    signal (SIGPIPE, SIG_IGN);
+  if (r->opt->jobs > 0)
+    relay_parallel (r);
+  else if (r->ntee > 0)
+    relay_tee (r);
+  else if (r->codec != NULL && codec_inplace (r->codec->kind))
+    relay_filter (r);
+  else if (r->codec != NULL)
+    relay_codec (r);
+  else if (strcmp (engine, "splice") == 0)
+    {
+      if (r->opt->spill)
+	{
+	  fprintf (stderr, _("cannot use spill mode with splice engine\n"));
+	  exit (EXIT_FAILURE);
+	}
+      relay_splice (r);
+    }
+  else if (strcmp (engine, "thread") == 0)
+    {
+      if (r->opt->spill)
+	{
+	  fprintf (stderr, _("cannot use spill mode with thread engine\n"));
+	  exit (EXIT_FAILURE);
+	}
+      relay_thread (r);
+    }
+#ifdef HAVE_LINUX_IO_URING_H
+  else if (strcmp (engine, "select") == 0 || relay_uring (r) == -1)
+    {
+      if (strcmp (engine, "uring") == 0)
+	{
+	  perror ("io_uring_setup");
+	  exit (EXIT_FAILURE);
+	}
+      relay_select (r);
+    }
+#else
+  else if (strcmp (engine, "uring") == 0)
+    {
+      fprintf (stderr, _("io_uring is not supported\n"));
+      exit (EXIT_FAILURE);
+    }
+  else
+    relay_select (r);
+#endif
+  if (r->opt->collapse)
+    signal (SIGPIPE, SIG_DFL);
+  relay_punchflush (r);
+  if (r->opt->verbose && r->opt->holes != HOLES_READ)
+    fprintf (stderr, _("holes: %ju bytes %s\n"), r->hole_bytes,
+	     r->opt->holes == HOLES_ZERO ? _("zeroed") : _("skipped"));
+  cache_close (&r->cache[0]);
+  cache_close (&r->cache[1]);
+  spill_free (&r->spill);
+  if (r->opt->verbose)
+    relay_stagestat (r);
+}
+
+// Move the output down over the input in the file, and punch the moved
+// data behind.  A chunk is not larger than the distance, so the written
+// data is never punched.
+static void
+collapse_shift (struct relay *r, off_t base, off_t size)
+{
+  // the input is closed, and the output may be in append mode
+  char path[32];
+  snprintf (path, sizeof (path), "/proc/self/fd/%d", r->fds[1]);
+  int fd = open (path, O_RDWR | O_CLOEXEC);
+  if (fd == -1)
+    {
+      perror (r->opt->file_output);
+      exit (EXIT_FAILURE);
+    }
+  if (fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+		 base) == 0)
+    r->stats.calls[CALL_FALLOCATE]++;
+  size_t len = (uintmax_t) base < r->bufsize ? (size_t) base : r->bufsize;
+  char *buf = malloc (len);
+  if (buf == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  for (off_t pos = 0; pos < size;)
+    {
+      ssize_t sz = pread (fd, buf, size - pos < (off_t) len
+			  ? (size_t) (size - pos) : len, base + pos);
+      r->stats.calls[CALL_READ]++;
+      if (sz <= 0)
+	{
+	  if (sz == 0)
+	    errno = EIO;
+	  perror ("read");
+	  exit (EXIT_FAILURE);
+	}
+      if (pwrite (fd, buf, sz, pos) != sz)
+	{
+	  perror ("write");
+	  exit (EXIT_FAILURE);
+	}
+      r->stats.calls[CALL_WRITE]++;
+      if (fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		     base + pos, sz) == 0)
+	r->stats.calls[CALL_FALLOCATE]++;
+      pos += sz;
+    }
+  free (buf);
+  if (ftruncate (fd, size) == -1)
+    {
+      perror ("ftruncate");
+      exit (EXIT_FAILURE);
+    }
+  r->stats.calls[CALL_FTRUNCATE]++;
+  close (fd);
+}
+
+// Remove the input before the output in collapse mode.  The output starts
+// at a block boundary, so that the file system removes the input blocks
+// without moving data.  Otherwise the output is shifted in the file.
+static void
+relay_collapse (struct relay *r)
+{
+  off_t base = r->st[1].st_size;
+  off_t size = r->opos - base;
+  // the range must end before the end of file
+  if (base == 0 || size == 0)
+    {
+      if (ftruncate (r->fds[1], size) == -1)
+	{
+	  perror ("ftruncate");
+	  exit (EXIT_FAILURE);
+	}
+      r->stats.calls[CALL_FTRUNCATE]++;
+      return;
+    }
+  r->stats.calls[CALL_FALLOCATE]++;
+  if (fallocate (r->fds[1], FALLOC_FL_COLLAPSE_RANGE, 0, base) == 0)
+    {
+      if (r->opt->verbose)
+	fprintf (stderr, _("collapse: %jd bytes collapsed\n"),
+		 (intmax_t) base);
+      return;
+    }
+  if (errno != EOPNOTSUPP && errno != EINVAL && errno != ENOSYS)
+    {
+      perror ("fallocate");
+      exit (EXIT_FAILURE);
+    }
+  if (r->opt->verbose)
+    fprintf (stderr, _("collapse: %s, %jd bytes shifted\n"),
+	     strerror (errno), (intmax_t) size);
+  collapse_shift (r, base, size);
+}
+
+// Publish the temporary output file of atomic mode at once, after its
+// data is on the disk.  The name refers to either the old or the new file
+// at any time.  With the rename file, the output file is removed as it
+// would be renamed.
+static void
+publish_output (const struct opt *opt, int fd)
+{
+  const char *target = atomic_target (opt);
+  if (fsync (fd) == -1)
+    {
+      perror (target);
+      exit (EXIT_FAILURE);
+    }
+  char *name = (char *) opt->file_temp;
+  if (name == NULL)
+    {
+      char path[32];
+      snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);
+      const char *dir;
+      const char *base;
+      char *buf = split_path (target, &dir, &base);
+      for (unsigned i = 0;; i++)
+	{
+	  if (asprintf (&name, "%s/.%s.%d.%u", dir, base, (int) getpid (),
+			i) == -1)
+	    {
+	      perror ("asprintf");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (linkat (AT_FDCWD, path, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == 0)
+	    break;
+	  if (errno != EEXIST)
+	    {
+	      perror (target);
+	      exit (EXIT_FAILURE);
+	    }
+	  free (name);
+	}
+      free (buf);
+    }
+  struct stat st[2];
+  int remove = opt->file_rename != NULL && opt->file_output != NULL
+    && stat (opt->file_output, st + 0) == 0
+    && !(stat (target, st + 1) == 0 && st[0].st_dev == st[1].st_dev
+	 && st[0].st_ino == st[1].st_ino);
+  if (renameat2 (AT_FDCWD, name, AT_FDCWD, target,
+		 opt->atomic == ATOMIC_EXCHANGE ? RENAME_EXCHANGE : 0) == -1)
+    {
+      perror (target);
+      unlink (name);
+      exit (EXIT_FAILURE);
+    }
+  // the old file is exchanged to the temporary name
+  if (opt->atomic == ATOMIC_EXCHANGE && unlink (name) == -1)
+    {
+      perror (name);
+      exit (EXIT_FAILURE);
+    }
+  if (remove && unlink (opt->file_output) == -1)
+    {
+      perror (opt->file_output);
+      exit (EXIT_FAILURE);
+    }
+  if (opt->verbose)
+    fprintf (stderr, _("atomic: %s %s\n"),
+	     opt->atomic == ATOMIC_EXCHANGE ? _("exchanged") : _("renamed"),
+	     target);
+  if (name != opt->file_temp)
+    free (name);
+}
+
+// Drop the temporary output file of atomic mode, leaving the old file.
+static void
+discard_output (const struct opt *opt)
+{
+  if (opt->file_temp != NULL && unlink (opt->file_temp) == -1)
+    perror (opt->file_temp);
+}
+
+// Truncate the output on same input file and rename it, unless the command
+// failed without any output.
+static void
+finish_output (struct relay *r, int status)
+{
+  const struct opt *opt = r->opt;
+  // free the preallocated blocks after the end of file
+  struct stat st;
+  if (r->prealloc > 0
+      && (fstat (r->fds[1], &st) == -1
+	  || ftruncate (r->fds[1], st.st_size) == -1))
+    {
+      perror (opt->file_output);
+      exit (EXIT_FAILURE);
+    }
+  if (status == EXIT_SUCCESS)
+    sum_finish (opt, r->fds[1]);
+  if (opt->atomic != ATOMIC_NONE)
+    {
+      if (status == EXIT_SUCCESS)
+	publish_output (opt, r->fds[1]);
+      else
+	discard_output (opt);
+      close (r->fds[1]);
+      return;
+    }
+  if (r->jfd != -1 && status != EXIT_SUCCESS)
+    {
+      fprintf (stderr, _("journal is kept to resume: %s\n"), opt->journal);
+      return;
+    }
+  // without punchhole mode, the input is intact, and the padding and the
+  // output after it are cut off
+  if (opt->collapse && !opt->punchhole && status != EXIT_SUCCESS)
+    {
+      if (ftruncate (r->fds[1], r->st[0].st_size) == -1)
+	{
+	  perror (opt->file_output);
+	  exit (EXIT_FAILURE);
+	}
+      return;
+    }
+  if (r->opos == 0 && status != EXIT_SUCCESS)
+    return;
+  if (r->overwrite)
+    {
+      if (ftruncate (r->fds[1], r->opos) == -1)
+	{
+	  perror (opt->file_output);
+	  exit (EXIT_FAILURE);
+	}
+      r->stats.calls[CALL_FTRUNCATE]++;
+    }
+  if (opt->collapse && status == EXIT_SUCCESS)
+    relay_collapse (r);
+  if (r->jfd != -1)
+    {
+      journal_sync (r, r->fds[1]);
+      if (unlink (opt->journal) == -1)
+	{
+	  perror (opt->journal);
+	  exit (EXIT_FAILURE);
+	}
+      close (r->jfd);
+    }
+  close (r->fds[1]);
+  if (opt->file_rename != NULL)
+    {
+      if (opt->file_output != NULL
+	  && rename (opt->file_output, opt->file_rename) == -1)
+	{
+	  perror (opt->file_rename);
+	  exit (EXIT_FAILURE);
+	}
+    }
+}
+
+// File of each mode.
+struct each
+{
+  char *name;
+  off_t size;
+  pid_t pid;
+  int asked;
+  struct stats stats;
+};
+
+static int
+each_compare (const void *a, const void *b)
+{
+  const struct each *x = a;
+  const struct each *y = b;
+  return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+// NUL separated file names on stdin.
+static char **
+each_readnames (int *nfile)
+{
+  size_t size = 0;
+  size_t len = 0;
+  char *buf = NULL;
+  while (1)
+    {
+      if (len == size)
+	{
+	  size = size == 0 ? BUFSIZ : size * 2;
+	  buf = realloc (buf, size + 1);
+	  if (buf == NULL)
+	    {
+	      perror ("realloc");
+	      exit (EXIT_FAILURE);
+	    }
+	}
+      ssize_t sz = read (STDIN_FILENO, buf + len, size - len);
+      if (sz == -1)
+	{
+	  perror ("read");
+	  exit (EXIT_FAILURE);
+	}
+      if (sz == 0)
+	break;
+      len += sz;
+    }
+  buf[len] = '\0';
+  char **names = malloc (sizeof (*names) * (len / 2 + 1));
+  if (names == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  *nfile = 0;
+  for (size_t i = 0; i < len; i += strlen (buf + i) + 1)
+    if (buf[i] != '\0')
+      names[(*nfile)++] = buf + i;
+  return names;
+}
+
+// Rename file of each mode: {} is replaced with the file name.
+static char *
+each_rename (const char *pattern, const char *name)
+{
+  size_t len = 0;
+  for (const char *p = pattern; *p != '\0'; p++)
+    if (p[0] == '{' && p[1] == '}')
+      {
+	len += strlen (name);
+	p++;
+      }
+    else
+      len++;
+  char *file = malloc (len + 1);
+  if (file == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  char *q = file;
+  for (const char *p = pattern; *p != '\0'; p++)
+    if (p[0] == '{' && p[1] == '}')
+      {
+	q = stpcpy (q, name);
+	p++;
+      }
+    else
+      *q++ = *p;
+  *q = '\0';
+  return file;
+}
+
+// Keep the last reports of the workers.  Returns the number of the
+// answers to asked reports.
+static int
+each_drain (int fd, struct each *files, int nfile)
+{
+  struct each_report rep;
+  int answered = 0;
+  while (read (fd, &rep, sizeof (rep)) == sizeof (rep))
+    for (int i = 0; i < nfile; i++)
+      if (files[i].pid == rep.pid)
+	{
+	  files[i].stats = rep.stats;
+	  answered += files[i].asked;
+	  files[i].asked = 0;
+	  break;
+	}
+  return answered;
+}
+
+// Report the statistics combined over the files, as of their last
+// reports.
+static void
+each_print (const struct opt *opt, uint64_t start, const struct each *files,
+	    int nfile)
+{
+  struct stats sum;
+  memset (&sum, 0, sizeof (sum));
+  sum.start = start;
+  for (int i = 0; i < nfile; i++)
+    stats_add (&sum, &files[i].stats);
+  stats_print (opt, &sum);
+}
+
+// Each mode.  The command runs on each file, as same input and output
+// file, in up to jobs worker processes, largest file first.  The parent
+// waits for all of them, and exits with the largest exit status.
+// Returns in the worker with the options for its file.
+static void
+run_each (struct opt *opt, int *argc, char *argv[], int stdio_append)
+{
+  int sep = -1;
+  for (int i = optind; i < *argc; i++)
+    if (strcmp (argv[i], "--") == 0)
+      sep = i;
+  if ((opt->file_input != NULL && !opt->file_stdin)
+      || (opt->file_output != NULL && !opt->file_stdout))
+    {
+      fprintf (stderr, _("cannot use input or output file with each mode\n"));
+      print_usage (stderr, *argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  if ((sep == -1 ? *argc : sep) <= optind)
+    {
+      fprintf (stderr, _("no command specified for each mode\n"));
+      print_usage (stderr, *argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  int nname = *argc - sep - 1;
+  char **names = argv + sep + 1;
+  if (sep == -1)
+    {
+      if (isatty (STDIN_FILENO))
+	{
+	  fprintf (stderr, _("no file specified for each mode\n"));
+	  print_usage (stderr, *argc, argv);
+	  exit (EXIT_FAILURE);
+	}
+      names = each_readnames (&nname);
+    }
+  if (nname == 0)
+    {
+      fprintf (stderr, _("no file specified for each mode\n"));
+      print_usage (stderr, *argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  int ret_status = EXIT_SUCCESS;
+  int nfile = 0;
+  struct each *files = malloc (sizeof (*files) * (nname + 1));
+  if (files == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  for (int i = 0; i < nname; i++)
+    {
+      struct stat st;
+      if (stat (names[i], &st) == -1)
+	{
+	  perror (names[i]);
+	  ret_status = EXIT_FAILURE;
+	  continue;
+	}
+      memset (&files[nfile], 0, sizeof (files[nfile]));
+      files[nfile].name = names[i];
+      files[nfile].size = st.st_size;
+      files[nfile++].pid = -1;
+    }
+  qsort (files, nfile, sizeof (*files), each_compare);
+  int sfds[2] = { -1, -1 };
+  uint64_t start = clock_ns ();
+  if (opt->stats != NULL)
+    {
+      if (pipe2 (sfds, O_CLOEXEC) == -1)
+	{
+	  perror ("pipe");
+	  exit (EXIT_FAILURE);
+	}
+      int flags = fcntl (sfds[0], F_GETFL);
+      if (flags == -1 || fcntl (sfds[0], F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+	  perror ("fcntl");
+	  exit (EXIT_FAILURE);
+	}
+      stats_start (opt);
+      // wait is interrupted to report while the workers run
+      stats_sigaction (0);
+    }
+  unsigned jobs = opt->jobs == 0 ? 1 : opt->jobs;
+  unsigned running = 0;
+  int asking = 0;
+  int next = 0;
+  while (next < nfile || running > 0)
+    {
+      while (running < jobs && next < nfile)
+	{
+	  struct each *f = &files[next++];
+	  f->pid = fork ();
+	  if (f->pid == -1)
+	    {
+	      perror ("fork");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (f->pid == 0)
+	    {
+	      if (sfds[0] != -1)
+		{
+		  close (sfds[0]);
+		  stats_sigaction (SA_RESTART);
+		}
+	      opt->stats_pipe = sfds[1];
+	      opt->file_input = f->name;
+	      opt->file_output = f->name;
+	      opt->file_stdin = 0;
+	      opt->file_stdout = 0;
+	      if (stdio_append)
+		opt->append = 0;
+	      if (opt->file_rename != NULL)
+		opt->file_rename = each_rename (opt->file_rename, f->name);
+	      opt->jobs = 0;
+	      opt->each = 0;
+	      if (sep != -1)
+		{
+		  argv[sep] = NULL;
+		  *argc = sep;
+		}
+	      return;
+	    }
+	  running++;
+	}
+      // the running workers report on the request to the parent, and
+      // their reports are printed together with those of the others
+      if (sfds[0] != -1 && asking == 0 && (stats_signaled || stats_alarmed))
+	{
+	  stats_signaled = 0;
+	  stats_alarmed = 0;
+	  for (int i = 0; i < next; i++)
+	    if (files[i].pid != -1 && kill (files[i].pid, SIGUSR1) == 0)
+	      {
+		files[i].asked = 1;
+		asking++;
+	      }
+	  if (asking == 0)
+	    each_print (opt, start, files, nfile);
+	}
+      int status;
+      pid_t pid;
+      if (asking > 0)
+	{
+	  struct pollfd pfd = {.fd = sfds[0],.events = POLLIN };
+	  int ret = poll (&pfd, 1, EACH_REPORT_MS);
+	  if (ret == -1 && errno != EINTR)
+	    {
+	      perror ("poll");
+	      exit (EXIT_FAILURE);
+	    }
+	  int answered = each_drain (sfds[0], files, next);
+	  // a worker out of the relay is reported as of its last report
+	  if (ret == 0)
+	    for (int i = 0; i < next; i++)
+	      if (files[i].asked)
+		{
+		  files[i].asked = 0;
+		  answered++;
+		}
+	  if (answered > 0 && (asking -= answered) == 0)
+	    each_print (opt, start, files, nfile);
+	  pid = waitpid (-1, &status, WNOHANG);
+	  if (pid == 0)
+	    continue;
+	}
+      else
+	pid = wait (&status);
+      if (pid == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror ("wait");
+	  exit (EXIT_FAILURE);
+	}
+      // the last report of the worker is written before its exit
+      int answered = sfds[0] == -1 ? 0 : each_drain (sfds[0], files, next);
+      for (int i = 0; i < next; i++)
+	if (files[i].pid == pid)
+	  {
+	    int code = WIFEXITED (status) ? WEXITSTATUS (status)
+	      : 128 + WTERMSIG (status);
+	    if (code != EXIT_SUCCESS)
+	      fprintf (stderr, _("%s: exit status %d\n"), files[i].name,
+		       code);
+	    if (code > ret_status)
+	      ret_status = code;
+	    answered += files[i].asked;
+	    files[i].asked = 0;
+	    files[i].pid = -1;
+	    running--;
+	  }
+      if (answered > 0 && (asking -= answered) == 0)
+	each_print (opt, start, files, nfile);
+    }
+  if (opt->verbose)
+    fprintf (stderr, _("each: %d files in %u jobs\n"), nfile, jobs);
+  if (sfds[0] != -1)
+    each_print (opt, start, files, nfile);
+  exit (ret_status);
+}
+
+// Whether the command may run on the files directly, with nothing for
+// the relay to do.
+static int
+exec_direct (const struct opt *opt, int overwrite, int builtin)
+{
+  return !overwrite && !opt->punchhole
+    && (opt->file_rename == NULL || opt->atomic != ATOMIC_NONE)
+    && opt->jobs == 0 && opt->stats == NULL && opt->cache == CACHE_NORMAL
+    && opt->holes == HOLES_READ && !opt->prealloc && !rate_limited (opt)
+    && opt->checksum == -1 && opt->ntee == 0 && !builtin;
+}
+
+// Run the command on size bytes of the input at pos, and count its
+// output.  The sample is cut off, so the errors of the command are
+// ignored and its stderr is discarded.  Sets the elapsed time to ns.
+static off_t
+auto_sample (char **const stages[], int nstage, int fd, off_t pos,
+	     off_t size, uint64_t *ns)
+{
+  int ipfds[2];
+  int opfds[2];
+  if (pipe2 (ipfds, O_CLOEXEC) == -1 || pipe2 (opfds, O_CLOEXEC) == -1)
+    {
+      perror ("pipe");
+      exit (EXIT_FAILURE);
+    }
+  // a write larger than the room of the pipe would block after poll
+  int flags = fcntl (ipfds[1], F_GETFL);
+  if (flags == -1 || fcntl (ipfds[1], F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+      perror ("fcntl");
+      exit (EXIT_FAILURE);
+    }
+  int err = fcntl (STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+  int null = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (err == -1 || null == -1)
+    {
+      perror ("/dev/null");
+      exit (EXIT_FAILURE);
+    }
+  void (*sigpipe) (int) = signal (SIGPIPE, SIG_IGN);
+  pid_t pids[nstage];
+  uint64_t start = clock_ns ();
+  dup2 (null, STDERR_FILENO);
+  spawn_pipeline (stages, nstage, ipfds[0], opfds[1], DEFAULT_BUFSIZE, pids);
+  dup2 (err, STDERR_FILENO);
+  close (err);
+  close (null);
+  close (ipfds[0]);
+  close (opfds[1]);
+  char *buf = malloc (DEFAULT_BUFSIZE * 2);
+  if (buf == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  char *sink = buf + DEFAULT_BUFSIZE;
+  size_t off = 0;
+  size_t len = 0;
+  off_t end = pos + size;
+  off_t osize = 0;
+  while (opfds[0] != -1)
+    {
+      if (ipfds[1] != -1 && len == 0 && pos < end)
+	{
+	  ssize_t sz = pread (fd, buf, end - pos < DEFAULT_BUFSIZE
+			      ? (size_t) (end - pos) : DEFAULT_BUFSIZE, pos);
+	  if (sz == -1)
+	    {
+	      perror ("read");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (sz == 0)
+	    end = pos;
+	  pos += sz;
+	  off = 0;
+	  len = sz;
+	}
+      if (ipfds[1] != -1 && len == 0 && pos >= end)
+	{
+	  close (ipfds[1]);
+	  ipfds[1] = -1;
+	}
+      struct pollfd pfd[2] = {
+	{.fd = opfds[0],.events = POLLIN},
+	{.fd = ipfds[1],.events = POLLOUT},
+      };
+      if (poll (pfd, 2, -1) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror ("poll");
+	  exit (EXIT_FAILURE);
+	}
+      if (pfd[1].revents != 0)
+	{
+	  ssize_t sz = write (ipfds[1], buf + off, len);
+	  if (sz == -1 && errno != EAGAIN)
+	    {
+	      // the command stopped reading the sample
+	      close (ipfds[1]);
+	      ipfds[1] = -1;
+	    }
+	  else if (sz > 0)
+	    {
+	      off += sz;
+	      len -= sz;
+	    }
+	}
+      if (pfd[0].revents != 0)
+	{
+	  ssize_t sz = read (opfds[0], sink, DEFAULT_BUFSIZE);
+	  if (sz == -1 && errno != EINTR)
+	    {
+	      perror ("read");
+	      exit (EXIT_FAILURE);
+	    }
+	  if (sz == 0)
+	    {
+	      close (opfds[0]);
+	      opfds[0] = -1;
+	    }
+	  else if (sz > 0)
+	    osize += sz;
+	}
+    }
+  if (ipfds[1] != -1)
+    close (ipfds[1]);
+  wait_pipeline (pids, nstage);
+  *ns = clock_ns () - start;
+  signal (SIGPIPE, sigpipe);
+  free (buf);
+  return osize;
+}
+
+// Choose the strategy of auto mode for the command on same input and
+// output file, from the ratio of output to input on a sample: overwrite
+// in place when the command shrinks the data, with spill mode as a guard
+// against a local growth; spill mode when the output grows within the
+// spill memory; otherwise a temporary file published by atomic mode, or
+// spill mode to its temporary file when the file system has no room for
+// the whole output or punchhole mode frees the input.  An input not
+// larger than the sample is not sampled, and uses spill mode.  Returns
+// whether the output still overwrites the input.
+static int
+auto_strategy (struct opt *opt, char **const stages[], int nstage,
+	       int fds[2], struct stat st[2], int overwrite, int builtin)
+{
+  if (!overwrite)
+    {
+      fprintf (stderr, _("auto: %s, the output is another file\n"),
+	       exec_direct (opt, overwrite, builtin)
+	       ? _("direct exec") : _("relay"));
+      return overwrite;
+    }
+  off_t pos = pump_pos (fds[0]);
+  off_t rest = st[0].st_size - pos;
+  off_t size = (uintmax_t) rest < opt->auto_size ? rest
+    : (off_t) opt->auto_size;
+  if (size == 0)
+    {
+      fprintf (stderr, _("auto: overwrite, the input is empty\n"));
+      return overwrite;
+    }
+  // spill mode cannot run on the splice and thread engines
+  int guard = opt->engine == NULL || (strcmp (opt->engine, "splice") != 0
+				      && strcmp (opt->engine, "thread") != 0);
+  if ((uintmax_t) rest <= opt->auto_size)
+    {
+      // the sample would run the command on the whole input twice, and
+      // spill mode holds any output, in its temporary file if needed
+      opt->spill = guard;
+      fprintf (stderr, _("auto: %s, the input is not larger than the "
+			 "sample\n"), guard ? _("spill") : _("overwrite"));
+      return overwrite;
+    }
+  uint64_t ns;
+  off_t osize = auto_sample (stages, nstage, fds[0], pos, size, &ns);
+  double ratio = (double) osize / size;
+  double secs = ns / 1e9;
+  fprintf (stderr,
+	   _("auto: sample of %jd bytes gives %jd bytes (ratio %.3f) "
+	     "in %.3fs (%.1f MB/s)\n"), (intmax_t) size, (intmax_t) osize,
+	   ratio, secs, secs > 0 ? size / secs / 1e6 : 0);
+  if (ratio <= 1)
+    {
+      opt->spill = guard;
+      fprintf (stderr, _("auto: overwrite in place%s, the command %s\n"),
+	       guard ? _(" with spill guard") : "",
+	       ratio < 1 ? _("shrinks the data")
+	       : _("keeps the size of the data"));
+      return overwrite;
+    }
+  double grow = (ratio - 1) * rest;
+  size_t memory = opt->spill_memory == 0 ? DEFAULT_SPILL_MEMORY
+    : opt->spill_memory;
+  struct statvfs vfs;
+  int room = fstatvfs (fds[1], &vfs) == 0
+    && (double) vfs.f_bavail * vfs.f_frsize > ratio * rest;
+  // punchhole mode frees the input, which must be kept until the
+  // temporary file is published
+  int spill = grow <= memory || !room || opt->file_output == NULL
+    || opt->punchhole;
+  if (spill && guard)
+    {
+      opt->spill = 1;
+      fprintf (stderr, _("auto: spill, the output grows by about %.0f "
+			 "bytes %s\n"), grow,
+	       grow <= memory ? _("within the spill memory")
+	       : opt->punchhole ? _("and punchhole mode frees the input")
+	       : _("and no temporary file can hold the output"));
+      return overwrite;
+    }
+  if (spill)
+    {
+      fprintf (stderr, _("auto: overwrite, the output grows by about %.0f "
+			 "bytes but spill mode cannot run on %s engine\n"),
+	       grow, opt->engine);
+      return overwrite;
+    }
+  // the output goes to a temporary file instead of the input file
+  close (fds[1]);
+  opt->atomic = ATOMIC_RENAME;
+  fds[1] = open_tmpfile (opt);
+  if (fstat (fds[1], st + 1) == -1)
+    {
+      perror ("fstat");
+      exit (EXIT_FAILURE);
+    }
+  fprintf (stderr, _("auto: temporary file, the output grows by about "
+		     "%.0f bytes\n"), grow);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  setlocale (LC_ALL, "");
+  bindtextdomain (PACKAGE, LOCALEDIR);
+  textdomain (PACKAGE);
+  struct opt opt = OPT_INITIALIZER;
+
+  check_stdio (&opt);
+  int stdio_append = opt.append;
+  parse_redirect (argc, argv, &opt);
+  parse_options (argc, argv, &opt);
+  if (opt.each)
+    run_each (&opt, &argc, argv, stdio_append);
+
+  // with --tee, "&" separates the command groups of fan-out, and the
+  // groups after the first one are cut off argv
+  int ntee = 0;
+  char **groups[opt.ntee + 1];
+  for (int i = optind; i < argc && opt.ntee > 0; i++)
+    // _("\\&...") or _("\\\\&...") is escaped argument
+    if (argv[i][0] == '\\'
+	&& (argv[i][1] == '&' || (argv[i][1] == '\\' && argv[i][2] == '&')))
+      argv[i]++;
+    else if (strcmp (argv[i], "&") == 0)
+      {
+	if (ntee == opt.ntee)
+	  {
+	    fprintf (stderr, _("no tee file specified for command group\n"));
+	    print_usage (stderr, argc, argv);
+	    exit (EXIT_FAILURE);
+	  }
+	argv[i] = NULL;
+	groups[ntee++] = argv + i + 1;
+      }
+  if (ntee != opt.ntee)
+    {
+      fprintf (stderr, _("no command group specified for tee file\n"));
+      print_usage (stderr, argc, argv);
+      exit (EXIT_FAILURE);
+    }
+  for (int i = optind; i < argc && ntee > 0; i++)
+    if (argv[i] == NULL)
+      {
+	argc = i;
+	break;
+      }
+  for (int k = 0; k < ntee; k++)
+    if (argc <= optind || groups[k][0] == NULL)
+      {
+	fprintf (stderr, _("no command specified for command group\n"));
+	print_usage (stderr, argc, argv);
+	exit (EXIT_FAILURE);
+      }
+
+  int nstage = split_stages (argv + optind, NULL);
+  char **stages[nstage];
+  split_stages (argv + optind, stages);
+  for (int k = 0; k < nstage && nstage > 1; k++)
+    if (stages[k][0] == NULL)
+      {
+	fprintf (stderr, _("no command specified for pipeline\n"));
+	print_usage (stderr, argc, argv);
+	exit (EXIT_FAILURE);
+      }
+  // a single builtin command runs in the relay, others in their stage
+  struct codec codec;
+  int builtin = 0;
+  for (int k = 0; k < nstage && argc > optind; k++)
+    if (parse_builtin (stages[k], &codec) && nstage == 1 && opt.jobs == 0
+	&& ntee == 0)
+      builtin = 1;
+
+  int fds[2];
+  open_iofile (&opt, fds);
+  rate_init (&opt);
+  sum_init (&opt);
+
+  struct stat st[3];
+  if (fstat (fds[0], st + 0) == -1)
+    {
+      perror ("fstat");
+      exit (EXIT_FAILURE);
+    }
+  if (fstat (fds[1], st + 1) == -1)
+    {
+      perror ("fstat");
+      exit (EXIT_FAILURE);
+    }
+  if (opt.file_rename != NULL)
+    {
+      if (!S_ISREG (st[1].st_mode))
+	{
+	  fprintf (stderr, _("cannot rename non regular output\n"));
+	  exit (EXIT_FAILURE);
+	}
+      if (lstat (opt.file_rename, st + 2) == -1)
+	{
+	  if (errno != ENOENT)
+	    {
+	      perror ("lstat");
+	      exit (EXIT_FAILURE);
+	    }
+	  char *file = strdup (opt.file_rename);
+	  if (file == NULL)
+	    {
+	      perror ("strdup");
+	      exit (EXIT_FAILURE);
+	    }
+	  char *dir = dirname (file);
+	  if (stat (dir, st + 2) == -1)
+	    {
+	      perror (dir);
+	      exit (EXIT_FAILURE);
+	    }
+	  if (!S_ISDIR (st[2].st_mode))
+	    {
+	      errno = ENOTDIR;
+	      perror (dir);
+	      exit (EXIT_FAILURE);
+	    }
+	  free (file);
 	  if (st[1].st_dev != st[2].st_dev)
 	    {
 	      errno = EXDEV;
@@ -633,218 +6988,247 @@ main (int argc, char *argv[])
 
   int overwrite = st[0].st_dev == st[1].st_dev && st[0].st_ino == st[1].st_ino
     && S_ISREG (st[0].st_mode) && S_ISREG (st[1].st_mode);
+  if (opt.auto_size != 0 && argc > optind)
+    overwrite = auto_strategy (&opt, stages, nstage, fds, st, overwrite,
+			       builtin);
+  int ofds[ntee];
+  for (int k = 0; k < ntee; k++)
+    {
+      struct stat tst;
+      ofds[k] = open (opt.tee_output[k], O_WRONLY | O_CREAT | O_CLOEXEC,
+		      0666);
+      if (ofds[k] == -1)
+	{
+	  perror (opt.tee_output[k]);
+	  exit (EXIT_FAILURE);
+	}
+      if (fstat (ofds[k], &tst) == -1)
+	{
+	  perror ("fstat");
+	  exit (EXIT_FAILURE);
+	}
+      // not truncated until it is known not to be the input
+      if (S_ISREG (tst.st_mode)
+	  && ((tst.st_dev == st[0].st_dev && tst.st_ino == st[0].st_ino)
+	      || (tst.st_dev == st[1].st_dev && tst.st_ino == st[1].st_ino)))
+	{
+	  fprintf (stderr, _("cannot use input or output file as tee file\n"));
+	  exit (EXIT_FAILURE);
+	}
+      if (S_ISREG (tst.st_mode) && ftruncate (ofds[k], 0) == -1)
+	{
+	  perror ("ftruncate");
+	  exit (EXIT_FAILURE);
+	}
+    }
   if (opt.append && !S_ISREG (st[1].st_mode))
     {
       fprintf (stderr, _("cannot append to non regular file\n"));
       print_usage (stderr, argc, argv);
       exit (EXIT_FAILURE);
     }
-  if (argc <= optind && !opt.punchhole && opt.file_rename == NULL)
+  if (opt.collapse)
     {
-      if (!opt.append && S_ISREG (st[1].st_mode))
+      if (!overwrite || argc <= optind)
 	{
-	  if (ftruncate (fds[1], 0) == -1)
-	    {
-	      perror ("ftruncate");
-	      exit (EXIT_FAILURE);
-	    }
+	  fprintf (stderr,
+		   _
+		   ("collapse mode needs a command and same input and output file\n"));
+	  print_usage (stderr, argc, argv);
+	  exit (EXIT_FAILURE);
+	}
+      // the output starts at a block boundary after the input
+      st[1].st_size = collapse_base (st);
+      if (ftruncate (fds[1], st[1].st_size) == -1)
+	{
+	  perror ("ftruncate");
+	  exit (EXIT_FAILURE);
 	}
-      pump (fds);
-    }
-  if (!overwrite && !opt.punchhole && opt.file_rename == NULL)
-    {
-      dup2 (fds[0], STDIN_FILENO);
-      dup2 (fds[1], STDOUT_FILENO);
-      execvp (argv[optind], argv + optind);
-      perror (argv[optind]);
-      exit (EXIT_FAILURE);
-    }
-  int ipfds[2];
-  int opfds[2];
-  if (pipe2 (ipfds, O_CLOEXEC) == -1)
-    {
-      perror ("pipe");
-      exit (EXIT_FAILURE);
-    }
-  if (pipe2 (opfds, O_CLOEXEC) == -1)
-    {
-      perror ("pipe");
-      exit (EXIT_FAILURE);
-    }
-  pid_t pid = fork ();
-  if (pid == -1)
-    {
-      perror ("fork");
-      exit (EXIT_FAILURE);
     }
-  if (pid == 0)
+  if (opt.jobs > 0)
     {
-      close (ipfds[1]);
-      close (opfds[0]);
       if (argc <= optind)
 	{
-	  int pfds[2] = { ipfds[0], opfds[1] };
-	  pump (pfds);
+	  fprintf (stderr, _("no command specified for parallel mode\n"));
+	  print_usage (stderr, argc, argv);
+	  exit (EXIT_FAILURE);
 	}
-      dup2 (ipfds[0], STDIN_FILENO);
-      dup2 (opfds[1], STDOUT_FILENO);
-      execvp (argv[optind], argv + optind);
-      perror (argv[optind]);
-      exit (EXIT_FAILURE);
-    }
-  close (ipfds[0]);
-  close (opfds[1]);
-  char ibuf[st[0].st_blksize];
-  char obuf[st[1].st_blksize];
-  size_t isize = 0;
-  size_t osize = 0;
-  off_t ipos = 0;
-  off_t opos = opt.append ? st[1].st_size : 0;
-  int ieof = 0;
-  int oeof = 0;
-  int iclosed = 0;
-  while (1)
-    {
-      fd_set rfds, wfds;
-      int maxfd = -1;
-      FD_ZERO (&rfds);
-      FD_ZERO (&wfds);
-      // CLOSE
-      if (ieof && isize == 0 && !iclosed)
+      if (!S_ISREG (st[0].st_mode))
 	{
-	  close (ipfds[1]);
-	  iclosed = 1;
+	  fprintf (stderr,
+		   _("cannot run parallel mode on non regular input\n"));
+	  exit (EXIT_FAILURE);
 	}
-      if (oeof && osize == 0)
-	break;
-      if (!ieof && isize < st[0].st_blksize)
+      // with journal, after the journal is created
+      if (!overwrite && !opt.append && opt.journal == NULL
+	  && S_ISREG (st[1].st_mode) && ftruncate (fds[1], 0) == -1)
 	{
-	  FD_SET (fds[0], &rfds);
-	  if (maxfd < fds[0])
-	    maxfd = fds[0];
+	  perror ("ftruncate");
+	  exit (EXIT_FAILURE);
 	}
-      if (isize > 0)
+    }
+  if (argc <= optind && !opt.punchhole
+      && (opt.file_rename == NULL || !overwrite))
+    {
+      if (!opt.append && S_ISREG (st[1].st_mode))
 	{
-	  FD_SET (ipfds[1], &wfds);
-	  if (maxfd < ipfds[1])
-	    maxfd = ipfds[1];
+	  if (ftruncate (fds[1], 0) == -1)
+	    {
+	      perror ("ftruncate");
+	      exit (EXIT_FAILURE);
+	    }
 	}
-      if (!oeof && osize < st[1].st_blksize)
+      pump (fds, opt.clone, opt.cache);
+      sum_finish (&opt, fds[1]);
+      if (opt.atomic != ATOMIC_NONE)
+	publish_output (&opt, fds[1]);
+      else if (opt.file_rename != NULL && opt.file_output != NULL
+	       && rename (opt.file_output, opt.file_rename) == -1)
 	{
-	  FD_SET (opfds[0], &rfds);
-	  if (maxfd < opfds[0])
-	    maxfd = opfds[0];
+	  perror (opt.file_rename);
+	  exit (EXIT_FAILURE);
 	}
-      if (osize > 0 && (!overwrite || opt.append || ieof || ipos > opos))
+      exit (EXIT_SUCCESS);
+    }
+  size_t bufsize = opt.bufsize == 0 ? DEFAULT_BUFSIZE : opt.bufsize;
+  long pagesize = sysconf (_SC_PAGESIZE);
+  bufsize = (bufsize + pagesize - 1) / pagesize * pagesize;
+  size_t pmax = opt.pipe_max == 0 ? pipe_max_size () : opt.pipe_max;
+  pid_t pids[nstage];
+  if (exec_direct (&opt, overwrite, builtin))
+    {
+      // the command writes the temporary file directly
+      if (opt.atomic != ATOMIC_NONE)
 	{
-	  FD_SET (fds[1], &wfds);
-	  if (maxfd < fds[1])
-	    maxfd = fds[1];
+	  spawn_pipeline (stages, nstage, fds[0], fds[1],
+			  bufsize < pmax ? bufsize : pmax, pids);
+	  int status = wait_pipeline (pids, nstage);
+	  if (status == EXIT_SUCCESS)
+	    publish_output (&opt, fds[1]);
+	  else
+	    discard_output (&opt);
+	  exit (status);
 	}
-      if (maxfd == -1)
+      if (nstage > 1)
 	{
-	  if (ieof && isize == 0 && oeof && osize == 0)
-	    break;
-	  fprintf (stderr, _("buffer exceeded\n"));
-	  fprintf (stderr,
-		   _("%s(%ju/%ju) -> %s (buffer = %zu/pipe buffer = %u)\n"),
-		   opt.file_input ==
-		   NULL ? _("<stdin>") : getrelative (opt.file_input),
-		   (uintmax_t) ipos, (uintmax_t) st[0].st_size,
-		   argv[optind] == NULL ? argv[0] : argv[optind], isize,
-		   PIPE_BUF);
-	  fprintf (stderr,
-		   _("%s(%ju/%ju) <- %s (buffer = %zu/pipe buffer = %u)\n"),
-		   opt.file_output ==
-		   NULL ? _("<stdout>") : getrelative (opt.file_output),
-		   (uintmax_t) opos, (uintmax_t) st[1].st_size,
-		   argv[optind] == NULL ? argv[0] : argv[optind], osize,
-		   PIPE_BUF);
+	  spawn_pipeline (stages, nstage, fds[0], fds[1],
+			  bufsize < pmax ? bufsize : pmax, pids);
+	  exit (wait_pipeline (pids, nstage));
+	}
+      dup2 (fds[0], STDIN_FILENO);
+      dup2 (fds[1], STDOUT_FILENO);
+      execvp (argv[optind], argv + optind);
+      perror (argv[optind]);
+      exit (EXIT_FAILURE);
+    }
+  pid_t pid = -1;
+  int pfds[2] = { -1, -1 };
+  size_t psize[2] = { 0, 0 };
+  if (opt.jobs == 0 && !builtin)
+    {
+      int ipfds[2];
+      int opfds[2];
+      if (pipe2 (ipfds, O_CLOEXEC) == -1)
+	{
+	  perror ("pipe");
 	  exit (EXIT_FAILURE);
 	}
-      int ret = select (maxfd + 1, &rfds, &wfds, NULL, NULL);
-      if (ret == -1)
+      if (pipe2 (opfds, O_CLOEXEC) == -1)
 	{
-	  perror ("select");
+	  perror ("pipe");
 	  exit (EXIT_FAILURE);
 	}
-      if (FD_ISSET (ipfds[1], &wfds))
+      psize[0] = setpipesize (ipfds[1], bufsize < pmax ? bufsize : pmax);
+      psize[1] = setpipesize (opfds[0], bufsize < pmax ? bufsize : pmax);
+      if (argc > optind)
 	{
-	  ssize_t sz = write (ipfds[1], ibuf, isize);
-	  if (sz == -1)
-	    {
-	      perror ("write");
-	      exit (EXIT_FAILURE);
-	    }
-	  memmove (ibuf, ibuf + sz, isize - sz);
-	  isize -= sz;
-	  continue;
+	  spawn_pipeline (stages, nstage, ipfds[0], opfds[1],
+			  bufsize < pmax ? bufsize : pmax, pids);
+	  pid = pids[nstage - 1];
 	}
-      if (FD_ISSET (opfds[0], &rfds))
+      else if ((pid = fork ()) == -1)
 	{
-	  ssize_t sz =
-	    read (opfds[0], obuf + osize, st[1].st_blksize - osize);
-	  if (sz == -1)
-	    {
-	      perror ("read");
-	      exit (EXIT_FAILURE);
-	    }
-	  if (sz == 0)
-	    oeof = 1;
-	  else
-	    osize += sz;
-	  continue;
+	  perror ("fork");
+	  exit (EXIT_FAILURE);
 	}
-      if (FD_ISSET (fds[0], &rfds))
+      else if (pid == 0)
 	{
-	  size_t rsize = st[0].st_blksize - isize;
-	  if (overwrite && opt.append && st[0].st_size - ipos < rsize)
-	    rsize = st[0].st_size - ipos;
-	  ssize_t sz = rsize == 0 ? 0 : read (fds[0], ibuf + isize, rsize);
-	  if (sz == -1)
-	    {
-	      perror ("read");
-	      exit (EXIT_FAILURE);
-	    }
-	  if (sz == 0)
-	    ieof = 1;
-	  else
-	    {
-	      if (opt.punchhole)
-		{
-		  if (fallocate
-		      (fds[0], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-		       ipos, sz) == -1)
-		    {
-		      perror ("fallocate");
-		      exit (EXIT_FAILURE);
-		    }
-		}
-	      ipos += sz;
-	      isize += sz;
-	    }
-	  continue;
+	  close (ipfds[1]);
+	  close (opfds[0]);
+	  int pfds[2] = { ipfds[0], opfds[1] };
+	  // the relay takes the checksums
+	  sum_enabled = 0;
+	  pump (pfds, 0, CACHE_NORMAL);
+	  exit (EXIT_SUCCESS);
 	}
-      if (FD_ISSET (fds[1], &wfds))
+      close (ipfds[0]);
+      close (opfds[1]);
+      pfds[0] = ipfds[1];
+      pfds[1] = opfds[0];
+    }
+  // each command group of fan-out writes its tee file directly
+  int tfds[ntee];
+  pid_t tpids[ntee];
+  for (int k = 0; k < ntee; k++)
+    {
+      int n = split_stages (groups[k], NULL);
+      char **gstages[n];
+      split_stages (groups[k], gstages);
+      for (int j = 0; j < n && n > 1; j++)
+	if (gstages[j][0] == NULL)
+	  {
+	    fprintf (stderr, _("no command specified for pipeline\n"));
+	    print_usage (stderr, argc, argv);
+	    exit (EXIT_FAILURE);
+	  }
+      int gpfds[2];
+      if (pipe2 (gpfds, O_CLOEXEC) == -1)
 	{
-	  size_t wsize = osize;
-	  if (!ieof && overwrite && !opt.append && wsize > ipos - opos)
-	    wsize = ipos - opos;
-	  ssize_t sz = write (fds[1], obuf, wsize);
-	  if (sz == -1)
-	    {
-	      perror ("write");
-	      exit (EXIT_FAILURE);
-	    }
-	  memmove (obuf, obuf + sz, st[1].st_blksize - sz);
-	  opos += sz;
-	  osize -= sz;
-	  continue;
+	  perror ("pipe");
+	  exit (EXIT_FAILURE);
 	}
+      setpipesize (gpfds[1], psize[0]);
+      pid_t gpids[n];
+      spawn_pipeline (gstages, n, gpfds[0], ofds[k],
+		      bufsize < pmax ? bufsize : pmax, gpids);
+      close (gpfds[0]);
+      close (ofds[k]);
+      tfds[k] = gpfds[1];
+      tpids[k] = gpids[n - 1];
     }
+  struct relay r = {
+    .opt = &opt,
+    .fds = {fds[0], fds[1]},
+    .pfds = {pfds[0], pfds[1]},
+    .st = {st[0], st[1]},
+    .cmd = argv[optind] == NULL ? argv[0] : argv[optind],
+    .stages = stages,
+    .nstage = nstage,
+    .pids = opt.jobs == 0 && argc > optind && !builtin ? pids : NULL,
+    .tfds = tfds,
+    .ntee = ntee,
+    .codec = builtin ? &codec : NULL,
+    .bufsize = bufsize,
+    .psize = {psize[0], psize[1]},
+    .pmax = pmax,
+    .overwrite = overwrite,
+    .ipos = 0,
+    .opos = opt.append ? st[1].st_size : 0,
+    .jfd = -1,
+  };
+  relay (&r);
   close (fds[0]);
-  close (opfds[0]);
+  if (pfds[1] != -1)
+    close (pfds[1]);
+  if (opt.jobs > 0 || builtin)
+    {
+      finish_output (&r, r.status);
+      if (opt.stats != NULL)
+	relay_stats (&r);
+      exit (r.status);
+    }
   int ret_status = EXIT_FAILURE;
+  int tee_status = EXIT_SUCCESS;
   while (1)
     {
       int status;
@@ -852,32 +7236,24 @@ main (int argc, char *argv[])
       if (pid_child == -1)
 	{
 	  if (errno == ECHILD)
-	    exit (ret_status);
+	    {
+	      if (opt.stats != NULL)
+		relay_stats (&r);
+	      exit (ret_status == EXIT_SUCCESS ? tee_status : ret_status);
+	    }
 	  perror ("wait");
 	  exit (EXIT_FAILURE);
 	}
+      // a failed command group fails the whole, but not the output
+      for (int k = 0; k < ntee; k++)
+	if (pid_child == tpids[k] && tee_status == EXIT_SUCCESS)
+	  tee_status = WIFEXITED (status) ? WEXITSTATUS (status)
+	    : EXIT_FAILURE;
       if (pid_child == pid)
 	{
 	  if (WIFEXITED (status))
 	    ret_status = WEXITSTATUS (status);
-	  if (opos > 0 || ret_status == EXIT_SUCCESS)
-	    {
-	      if (overwrite && ftruncate (fds[1], opos) == -1)
-		{
-		  perror (opt.file_output);
-		  exit (EXIT_FAILURE);
-		}
-	      close (fds[1]);
-	      if (opt.file_rename != NULL)
-		{
-		  if (opt.file_output != NULL
-		      && rename (opt.file_output, opt.file_rename) == -1)
-		    {
-		      perror (opt.file_rename);
-		      exit (EXIT_FAILURE);
-		    }
-		}
-	    }
+	  finish_output (&r, ret_status);
 	}
     }
 }
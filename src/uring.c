@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include "uring.h"
+
+// Minimal io_uring wrapper on raw system calls, so that ow does not
+// depend on liburing.
+
+int
+uring_init (struct uring *ring, unsigned entries)
+{
+  struct io_uring_params p;
+  memset (&p, 0, sizeof (p));
+  memset (ring, 0, sizeof (*ring));
+  ring->fd = syscall (__NR_io_uring_setup, entries, &p);
+  if (ring->fd == -1)
+    return -1;
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_len > ring->sq_len)
+	ring->sq_len = ring->cq_len;
+      ring->cq_len = ring->sq_len;
+    }
+  ring->sq_ptr = mmap (NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED)
+    goto error;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr = ring->sq_ptr;
+  else
+    {
+      ring->cq_ptr = mmap (NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_CQ_RING);
+      if (ring->cq_ptr == MAP_FAILED)
+	goto error;
+    }
+  ring->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto error;
+  char *sq = ring->sq_ptr;
+  char *cq = ring->cq_ptr;
+  ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  ring->sq_entries = p.sq_entries;
+  return 0;
+
+error:
+  {
+    int saved_errno = errno;
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+      munmap (ring->sq_ptr, ring->sq_len);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED
+	&& ring->cq_ptr != ring->sq_ptr)
+      munmap (ring->cq_ptr, ring->cq_len);
+    close (ring->fd);
+    errno = saved_errno;
+    return -1;
+  }
+}
+
+void
+uring_exit (struct uring *ring)
+{
+  munmap (ring->sqes, ring->sqes_len);
+  if (ring->cq_ptr != ring->sq_ptr)
+    munmap (ring->cq_ptr, ring->cq_len);
+  munmap (ring->sq_ptr, ring->sq_len);
+  close (ring->fd);
+}
+
+struct io_uring_sqe *
+uring_get_sqe (struct uring *ring)
+{
+  unsigned head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->sq_pending;
+  if (tail - head >= ring->sq_entries)
+    return NULL;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  ring->sq_array[index] = index;
+  ring->sq_pending++;
+  memset (sqe, 0, sizeof (*sqe));
+  return sqe;
+}
+
+void
+uring_prep_rw (struct io_uring_sqe *sqe, int op, int fd, void *buf,
+	       unsigned len, off_t off, uint64_t user_data)
+{
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = user_data;
+}
+
+// off_in or off_out of -1 uses the current position (as NULL of splice).
+void
+uring_prep_splice (struct io_uring_sqe *sqe, int fd_in, off_t off_in,
+		   int fd_out, off_t off_out, unsigned len, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->splice_fd_in = fd_in;
+  sqe->splice_off_in = off_in;
+  sqe->fd = fd_out;
+  sqe->off = off_out;
+  sqe->len = len;
+  sqe->splice_flags = 0;
+  sqe->user_data = user_data;
+}
+
+void
+uring_prep_cancel (struct io_uring_sqe *sqe, uint64_t target)
+{
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = UINT64_MAX;
+}
+
+// Submit queued entries and wait for at least wait_nr completions.
+// Returns the number of submitted entries.
+int
+uring_enter (struct uring *ring, unsigned wait_nr)
+{
+  unsigned submit = ring->sq_pending;
+  __atomic_store_n (ring->sq_tail, *ring->sq_tail + submit,
+		    __ATOMIC_RELEASE);
+  ring->sq_pending = 0;
+  int submitted = 0;
+  while (1)
+    {
+      int ret = syscall (__NR_io_uring_enter, ring->fd, submit - submitted,
+			 wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0,
+			 NULL, 0);
+      if (ret == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      submitted += ret;
+      if (ret == 0 || (unsigned) submitted >= submit)
+	return submitted;
+      wait_nr = 0;
+    }
+}
+
+struct io_uring_cqe *
+uring_peek_cqe (struct uring *ring)
+{
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+void
+uring_cqe_seen (struct uring *ring)
+{
+  __atomic_store_n (ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
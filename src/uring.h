@@ -0,0 +1,43 @@
+#ifndef OW_URING_H
+#define OW_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+struct uring
+{
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_len;
+  size_t cq_len;
+  size_t sqes_len;
+  unsigned sq_entries;
+  unsigned sq_pending;
+};
+
+int uring_init (struct uring *ring, unsigned entries);
+void uring_exit (struct uring *ring);
+struct io_uring_sqe *uring_get_sqe (struct uring *ring);
+void uring_prep_rw (struct io_uring_sqe *sqe, int op, int fd, void *buf,
+		    unsigned len, off_t off, uint64_t user_data);
+void uring_prep_splice (struct io_uring_sqe *sqe, int fd_in, off_t off_in,
+			int fd_out, off_t off_out, unsigned len,
+			uint64_t user_data);
+void uring_prep_cancel (struct io_uring_sqe *sqe, uint64_t target);
+int uring_enter (struct uring *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe (struct uring *ring);
+void uring_cqe_seen (struct uring *ring);
+
+#endif